@@ -0,0 +1,179 @@
+/**
+ * @file decisiontrace.h Declaration of the always-on binary trace of the
+ * decisions made by gemini transactions.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef DECISIONTRACE_H__
+#define DECISIONTRACE_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <atomic>
+
+/// A compact record of a single decision made by a Gemini transaction.
+struct DecisionRecord
+{
+  /// Wall clock time of the decision, in nanoseconds since the epoch.
+  uint64_t timestamp_ns;
+
+  /// The SAS trail of the transaction, which identifies it.
+  uint64_t trail;
+
+  /// The decision (one of DecisionTrace::Event).
+  uint16_t event;
+
+  /// The status code of the response the decision relates to (if any).
+  uint16_t status_code;
+
+  /// The fork the decision relates to (if any).
+  int32_t fork_id;
+};
+
+/// The DecisionTrace holds a fixed-size ring of DecisionRecords for each
+/// thread that writes to it, so that the recent behaviour of Gemini can be
+/// examined after the event at almost no cost to call processing.
+///
+/// Each ring only has a single writer, so writing a record is lock-free and
+/// just a handful of stores. The rings live in a shared memory mapping of
+/// the trace file (if one is configured), so the kernel preserves the trace
+/// even if the process crashes - after a crash, the file as it was left
+/// holds the trace up to the crash. The file can be read with
+/// gemini_trace_decode, including while the process is still writing to it.
+/// An in-memory trace has to be written out on a crash with dump_on_crash().
+class DecisionTrace
+{
+public:
+  enum Event
+  {
+    REQ_NOT_SIP = 1,
+    REQ_TO_VOIP_CLIENT = 2,
+    REQ_TO_NATIVE_DEVICE = 3,
+    REQ_FORKED = 4,
+    REQ_NATIVE_UNREACHABLE = 5,
+    FORK_TO_VOIP = 6,
+    FORK_TO_NATIVE = 7,
+    FORK_TO_MOBILE_VOIP = 8,
+    RSP_RECEIVED = 9,
+    RETRY_ON_480 = 10,
+    NO_RETRY_ON_480 = 11,
+    REQ_TEL_URI_CONVERTED = 12,
+    REQ_PASSED_THROUGH = 13,
+    REQ_TO_MEMOISED_LEG = 14,
+    MEMO_FALLBACK = 15,
+    REQ_NATIVE_DUPLICATE = 16,
+  };
+
+  /// Constructor.
+  ///
+  /// @param file           - The file to hold the trace. If this is empty,
+  ///                         the trace is only held in memory and must be
+  ///                         written out with dump().
+  /// @param num_rings      - The maximum number of threads that can write to
+  ///                         the trace.
+  /// @param ring_size      - The number of records held for each thread.
+  ///                         Rounded up to a power of two.
+  DecisionTrace(const std::string& file = "",
+                uint32_t num_rings = 64,
+                uint32_t ring_size = 4096);
+
+  /// Destructor.
+  virtual ~DecisionTrace();
+
+  /// Adds a record to the calling thread's ring.
+  void record(uint64_t trail,
+              Event event,
+              int32_t fork_id = 0,
+              uint16_t status_code = 0);
+
+  /// Asks the kernel to write the trace out to its file. This is safe to
+  /// call from a signal handler.
+  void sync();
+
+  /// Writes the trace out to a file. This is safe to call from a signal
+  /// handler.
+  ///
+  /// @param path           - The file to write.
+  /// @returns whether the trace was written successfully.
+  bool dump(const char* path);
+
+  /// Writes the trace out if the process crashes. When the process receives
+  /// a fatal signal (SIGSEGV, SIGBUS, SIGILL, SIGFPE or SIGABRT), the trace
+  /// is dumped to the given file, or just synced if no file is given and the
+  /// trace is held in a file. The signal is then passed on to the handler
+  /// that was installed before.
+  ///
+  /// Only one trace is written out on a crash, so calling this replaces any
+  /// trace it was previously called on.
+  ///
+  /// @param path           - The file to dump the trace to, or empty.
+  void dump_on_crash(const std::string& path = "");
+
+  /// Returns the number of records that were lost because more threads
+  /// wrote to the trace than it has rings for.
+  uint64_t dropped_records() const { return _dropped_records.load(); }
+
+  /// Reads all the records from a trace file, sorted by time. The oldest
+  /// slot in each full ring is skipped, as that is the one the writer fills
+  /// in next, and it may have been part way through doing so.
+  ///
+  /// @param path           - The file to read.
+  /// @param records        - <out> The records in the file.
+  /// @returns whether the file was a valid trace.
+  static bool load(const std::string& path,
+                   std::vector<DecisionRecord>& records);
+
+  /// Returns a printable name for an event.
+  static const char* event_name(uint16_t event);
+
+private:
+  /// The header at the start of the trace.
+  struct Header
+  {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_rings;
+    uint32_t ring_size;
+    uint32_t record_size;
+  };
+
+  /// Each ring starts with the count of records ever written to it, padded
+  /// to a cache line so that threads don't contend on each other's rings.
+  struct RingHeader
+  {
+    std::atomic<uint64_t> head;
+    uint64_t padding[7];
+  };
+
+  RingHeader* ring(uint32_t index);
+  RingHeader* ring_for_this_thread();
+
+  static size_t ring_bytes(uint32_t ring_size);
+
+  int _fd;
+  uint32_t _num_rings;
+  uint32_t _ring_size;
+  size_t _size;
+  char* _base;
+
+  /// Unique identifier of this trace, which threads look up their ring in it
+  /// by.
+  uint64_t _id;
+
+  std::atomic<uint32_t> _next_ring;
+  std::atomic<uint64_t> _dropped_records;
+
+  static std::atomic<uint64_t> _next_id;
+
+  static const char MAGIC[8];
+  static const uint32_t VERSION = 1;
+};
+
+#endif
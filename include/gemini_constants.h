@@ -12,10 +12,113 @@
 #ifndef GEMINI_CONSTANTS_H_
 #define GEMINI_CONSTANTS_H_
 
+#include <stdint.h>
 #include <pjsip.h>
 
-const pj_str_t STR_TWIN_PRE = pj_str((char*)"twin-prefix");
-const pj_str_t STR_WITH_TWIN = pj_str((char*)"+sip.with-twin");
-const pj_str_t STR_3GPP_ICS = pj_str((char*)"+g.3gpp.ics");
+/// A feature tag (or parameter name or value) that Gemini matches or adds
+/// to requests. Tags are built at compile time, so need no static
+/// construction, and carry their length so that they can be matched
+/// cheaply (see GeminiUtils::tag_matches).
+struct GeminiTag
+{
+  pj_str_t str;
+};
+
+/// Returns the length of a string at compile time.
+constexpr pj_ssize_t gemini_tag_length(const char* s)
+{
+  return (*s == '\0') ? 0 : 1 + gemini_tag_length(s + 1);
+}
+
+#define GEMINI_TAG(S) {{const_cast<char*>(S), gemini_tag_length(S)}}
+
+constexpr GeminiTag TAG_TWIN_PREFIX = GEMINI_TAG("twin-prefix");
+constexpr GeminiTag TAG_WITH_TWIN = GEMINI_TAG("+sip.with-twin");
+constexpr GeminiTag TAG_3GPP_ICS = GEMINI_TAG("+g.3gpp.ics");
+
+/// The values of the g.3gpp.ics feature tag that identify a native device.
+constexpr GeminiTag TAG_SERVER = GEMINI_TAG("server");
+constexpr GeminiTag TAG_PRINCIPAL = GEMINI_TAG("principal");
+
+/// The g.3gpp.ics value Gemini requires (or rejects) on forks.
+constexpr GeminiTag TAG_3GPP_ICS_SERVER_PRINCIPAL = GEMINI_TAG("\"server,principal\"");
+
+/// The parameters of a tel: URI that pjsip holds outside its parameter list.
+constexpr GeminiTag TAG_ISUB = GEMINI_TAG("isub");
+constexpr GeminiTag TAG_EXT = GEMINI_TAG("ext");
+
+/// The header naming the event package of a SUBSCRIBE, and its compact form
+/// (RFC 6665).
+constexpr GeminiTag TAG_EVENT = GEMINI_TAG("Event");
+constexpr GeminiTag TAG_EVENT_SHORT = GEMINI_TAG("o");
+
+constexpr pj_str_t STR_TWIN_PRE = TAG_TWIN_PREFIX.str;
+constexpr pj_str_t STR_WITH_TWIN = TAG_WITH_TWIN.str;
+constexpr pj_str_t STR_3GPP_ICS = TAG_3GPP_ICS.str;
+
+/// The types of leg that Gemini forks requests on to.
+enum GeminiLegType
+{
+  /// To the subscriber's VoIP clients (other than those on mobile devices).
+  LEG_VOIP = 0,
+
+  /// To the native device.
+  LEG_NATIVE = 1,
+
+  /// To the VoIP clients hosted on mobile devices.
+  LEG_MOBILE_VOIP = 2,
+
+  NUM_LEG_TYPES = 3
+};
+
+/// The alternative twinning policies that Gemini can evaluate in shadow mode.
+enum GeminiShadowPolicy
+{
+  /// Fork to the mobile hosted VoIP clients at the same time as the native
+  /// devices, rather than waiting for them all to return a 480.
+  SHADOW_PARALLEL_FORK = 0,
+
+  /// Fork to the mobile hosted VoIP clients if no native device has rung
+  /// within a hedge delay.
+  SHADOW_HEDGED_RETRY = 1,
+
+  NUM_SHADOW_POLICIES = 2
+};
+
+/// The limits on how much of a request's Accept-Contact headers Gemini
+/// scans, so that a malformed or malicious request can't make the scan
+/// arbitrarily expensive.
+enum GeminiScanLimit
+{
+  /// The number of Accept-Contact headers looked at.
+  SCAN_LIMIT_HEADERS = 0,
+
+  /// The number of feature parameters looked at, across all the headers.
+  SCAN_LIMIT_PARAMS = 1,
+
+  /// The length of each feature parameter value looked at.
+  SCAN_LIMIT_VALUE_LEN = 2,
+
+  NUM_SCAN_LIMITS = 3
+};
+
+/// The Accept-Contact and Reject-Contact headers that Gemini adds to
+/// requests.
+enum GeminiContactHeader
+{
+  /// Reject-Contact: *;+sip.with-twin
+  REJECT_WITH_TWIN = 0,
+
+  /// Reject-Contact: *;+g.3gpp.ics="server,principal"
+  REJECT_3GPP_ICS = 1,
+
+  /// Accept-Contact: *;+g.3gpp.ics="server,principal";require;explicit
+  ACCEPT_3GPP_ICS = 2,
+
+  /// Accept-Contact: *;+sip.with-twin;require;explicit
+  ACCEPT_WITH_TWIN = 3,
+
+  NUM_CONTACT_HEADERS = 4
+};
 
 #endif
@@ -23,9 +23,15 @@ namespace SASEvent
 
   const int FORKING_ON_480_RSP = GEMINI_BASE + 0x000010;
   const int NO_RETRY_ON_480_RSP = GEMINI_BASE + 0x000011;
+  const int NATIVE_TWIN_UNREACHABLE = GEMINI_BASE + 0x000012;
+  const int SUBSCRIBE_MEMO_FALLBACK = GEMINI_BASE + 0x000013;
+  const int NATIVE_FORK_DUPLICATE = GEMINI_BASE + 0x000014;
 
   const int CALL_TO_VOIP_CLIENT = GEMINI_BASE + 0x000020;
   const int CALL_TO_NATIVE_DEVICE = GEMINI_BASE + 0x000021;
+  const int SUBSCRIBE_TO_MEMOISED_LEG = GEMINI_BASE + 0x000022;
+
+  const int TEL_URI_CONVERTED = GEMINI_BASE + 0x000030;
 
 } //namespace SASEvent
 
@@ -0,0 +1,196 @@
+/**
+ * @file geministats.h Statistics collected by the gemini AS.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef GEMINISTATS_H__
+#define GEMINISTATS_H__
+
+#include <stdint.h>
+#include <atomic>
+
+#include "gemini_constants.h"
+
+/// A histogram of non-negative values, with buckets that double in size.
+/// Bucket 0 holds the value 0, and bucket n (n > 0) holds values in the range
+/// [2^(n-1), 2^n), with the last bucket also holding anything larger.
+///
+/// Values can be recorded from any thread without locking. Each histogram
+/// starts on its own cache line, so that threads recording in one don't
+/// contend with threads recording in its neighbours (such as the same
+/// histogram for another type of leg).
+class alignas(64) GeminiHistogram
+{
+public:
+  static const int NUM_BUCKETS = 32;
+
+  GeminiHistogram();
+
+  /// Records a value.
+  void record(uint64_t value);
+
+  /// Returns the number of values recorded.
+  uint64_t count() const { return _count.load(std::memory_order_relaxed); }
+
+  /// Returns the sum of the values recorded.
+  uint64_t sum() const { return _sum.load(std::memory_order_relaxed); }
+
+  /// Returns the number of values recorded in a bucket.
+  uint64_t bucket(int index) const
+  {
+    return _buckets[index].load(std::memory_order_relaxed);
+  }
+
+  /// Returns an upper bound on the given percentile of the values recorded
+  /// (that is, the top of the bucket that the percentile falls in).
+  ///
+  /// @param percentile     - The percentile, between 0 and 100.
+  uint64_t percentile(double percentile) const;
+
+  /// Returns the bucket that a value is recorded in.
+  static int bucket_index(uint64_t value);
+
+private:
+  std::atomic<uint64_t> _buckets[NUM_BUCKETS];
+  std::atomic<uint64_t> _count;
+  std::atomic<uint64_t> _sum;
+};
+
+/// A count of events, which can be incremented from any thread without
+/// locking. Each counter has its own cache line, so that threads counting
+/// one event don't contend with threads counting its neighbours.
+class alignas(64) GeminiCounter
+{
+public:
+  GeminiCounter() : _value(0) {}
+
+  /// Counts an event.
+  void increment() { _value.fetch_add(1, std::memory_order_relaxed); }
+
+  /// Returns the number of events counted.
+  uint64_t value() const { return _value.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<uint64_t> _value;
+};
+
+/// Where a candidate twinning policy, evaluated in shadow mode, would have
+/// behaved differently from the active one. Only the forked calls sampled
+/// by MobileTwinnedAppServer::Config::shadow_sample_rate are evaluated.
+struct GeminiShadowStats
+{
+  GeminiShadowStats();
+
+  /// Number of forked calls the policy was evaluated on.
+  GeminiCounter calls;
+
+  /// Number of forks the policy would have sent that the active policy
+  /// avoided.
+  GeminiCounter extra_forks;
+
+  /// Number of retries to the mobile hosted VoIP clients the policy would
+  /// have made earlier.
+  GeminiCounter earlier_retries;
+
+  /// How much earlier (in milliseconds) each of those retries would have
+  /// been made.
+  GeminiHistogram latency_saved_ms;
+};
+
+/// Statistics collected by the mobile twinned AS.
+class GeminiStats
+{
+public:
+  GeminiStats();
+
+  /// Number of requests with tel: URIs converted to SIP URIs (which would
+  /// previously have been rejected).
+  GeminiCounter tel_uris_converted;
+
+  /// Number of requests rejected because their Request URI wasn't (and
+  /// couldn't be converted to) a SIP URI.
+  GeminiCounter non_sip_uris_rejected;
+
+  /// Number of requests passed through without creating a transaction.
+  GeminiCounter requests_passed_through;
+
+  /// Number of SUBSCRIBEs sent only to the leg that accepted the
+  /// subscriber's last subscription, and how many of those were then forked
+  /// to the other leg after being rejected.
+  GeminiCounter subscribes_to_memoised_leg;
+  GeminiCounter subscribe_memo_fallbacks;
+
+  /// Number of calls not forked to the native twin because another
+  /// transaction already had a fork to it in flight for the same call.
+  GeminiCounter native_forks_deduplicated;
+
+  /// Number of calls forked to the native twin without being recorded in
+  /// the native fork dedup table, because there was no room for them.
+  GeminiCounter native_fork_dedup_overflows;
+
+  /// Number of requests that weren't forked to some of the subscriber's
+  /// native devices, because the AS URI had more twin-prefix parameters
+  /// than Gemini forks to.
+  GeminiCounter twin_prefixes_truncated;
+
+  /// Number of scans of a request's Accept-Contact headers cut short, by the
+  /// limit that was reached.
+  GeminiCounter accept_contact_scans_truncated[NUM_SCAN_LIMITS];
+
+  /// Number of Accept-Contact and Reject-Contact headers not added to
+  /// requests because an equivalent header was already there.
+  GeminiCounter contact_headers_skipped;
+
+  /// Time (in milliseconds) from a fork being sent to its first 18x
+  /// response, by the type of leg.
+  GeminiHistogram time_to_ring_ms[NUM_LEG_TYPES];
+
+  /// Time (in milliseconds) from a fork being sent to it being answered, by
+  /// the type of leg.
+  GeminiHistogram time_to_answer_ms[NUM_LEG_TYPES];
+
+  /// Time (in milliseconds) from a fork being sent to it failing, by the
+  /// type of leg (only if detailed timings are configured).
+  GeminiHistogram time_to_fail_ms[NUM_LEG_TYPES];
+
+  /// Post-dial delay - the time (in milliseconds) from the request reaching
+  /// Gemini to the first 18x response on any fork - by the type of the leg
+  /// that rang first (only if detailed timings are configured).
+  GeminiHistogram post_dial_delay_ms[NUM_LEG_TYPES];
+
+  /// Pool memory (in bytes) added by Gemini's changes to each request, by
+  /// the type of leg.
+  GeminiHistogram pool_bytes_added[NUM_LEG_TYPES];
+
+  /// Bytes added to each request on the wire by Gemini's changes, by the
+  /// type of leg (only if pool usage is recorded).
+  GeminiHistogram wire_bytes_added[NUM_LEG_TYPES];
+
+  /// Pool memory (in bytes) in use once Gemini has changed each request, by
+  /// the type of leg.
+  GeminiHistogram pool_used_bytes[NUM_LEG_TYPES];
+
+  /// Number of times Gemini's changes to a request made its pool allocate
+  /// another block, by the type of leg.
+  GeminiCounter pool_expansions[NUM_LEG_TYPES];
+
+  /// The evaluation of each candidate policy in shadow mode.
+  GeminiShadowStats shadow[NUM_SHADOW_POLICIES];
+
+  /// Returns a printable name for a type of leg.
+  static const char* leg_type_name(GeminiLegType leg_type);
+
+  /// Returns a printable name for a shadow policy.
+  static const char* shadow_policy_name(GeminiShadowPolicy policy);
+
+  /// Returns a printable name for a scan limit.
+  static const char* scan_limit_name(GeminiScanLimit limit);
+};
+
+#endif
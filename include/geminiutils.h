@@ -0,0 +1,151 @@
+/**
+ * @file geminiutils.h Utility functions shared by the gemini AS.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef GEMINIUTILS_H__
+#define GEMINIUTILS_H__
+
+#include <stdint.h>
+#include <time.h>
+
+#include "gemini_constants.h"
+
+namespace GeminiUtils
+{
+  /// A clock that can stand in for the system clock, returning the time in
+  /// milliseconds.
+  typedef uint64_t (*Clock)();
+
+  /// Returns the current monotonic time in milliseconds.
+  inline uint64_t now_ms()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+  }
+
+  /// Normalises a telephone number from a tel: URI by removing any visual
+  /// separators, writing the result to a buffer supplied by the caller.
+  /// Global numbers (starting with '+') may only contain digits, and local
+  /// numbers may also contain '*', '#' and the hex digits A-F (RFC 3966).
+  ///
+  /// @param number         - The number
+  /// @param number_len     - The length of the number
+  /// @param out            - <out> The buffer to write the number to
+  /// @param out_len        - The size of the buffer
+  /// @returns the length of the normalised number, or -1 if the number is
+  ///          invalid or doesn't fit in the buffer
+  int normalise_number(const char* number,
+                       int number_len,
+                       char* out,
+                       int out_len);
+
+  /// Builds the user part of a SIP URI equivalent to a tel: URI (RFC 3261
+  /// section 19.1.6), writing it to a buffer supplied by the caller. Global
+  /// numbers, and local numbers whose phone-context is a global number
+  /// prefix, become global numbers. Other local numbers keep their
+  /// phone-context.
+  ///
+  /// @param number         - The number from the tel: URI
+  /// @param number_len     - The length of the number
+  /// @param context        - The phone-context from the tel: URI
+  /// @param context_len    - The length of the phone-context (may be 0)
+  /// @param out            - <out> The buffer to write the user part to
+  /// @param out_len        - The size of the buffer
+  /// @returns the length of the user part, or -1 if the number is invalid
+  ///          or the user part doesn't fit in the buffer
+  int tel_to_sip_user(const char* number,
+                      int number_len,
+                      const char* context,
+                      int context_len,
+                      char* out,
+                      int out_len);
+
+  /// Appends a parameter of a tel: URI (such as isub, ext or postd) to the
+  /// user part built by tel_to_sip_user, as RFC 3261 section 19.1.6 keeps
+  /// them in the user part of the equivalent SIP URI.
+  ///
+  /// @param name           - The name of the parameter
+  /// @param name_len       - The length of the name
+  /// @param value          - The value of the parameter
+  /// @param value_len      - The length of the value (0 if it has none)
+  /// @param out            - <out> The buffer holding the user part
+  /// @param len            - The length of the user part so far
+  /// @param out_len        - The size of the buffer
+  /// @returns the new length of the user part, or -1 if it doesn't fit in
+  ///          the buffer
+  int append_tel_param(const char* name,
+                       int name_len,
+                       const char* value,
+                       int value_len,
+                       char* out,
+                       int len,
+                       int out_len);
+
+  /// Returns whether a string is the given tag, ignoring case. Strings of a
+  /// different length are rejected without looking at their contents.
+  bool tag_matches(const pj_str_t* str, const GeminiTag& tag);
+
+  /// The limits on how much of a request's headers a scan looks at.
+  struct ScanLimits
+  {
+    /// The defaults are far beyond anything a real client sends.
+    ScanLimits() :
+      max_headers(32),
+      max_params(256),
+      max_value_len(256)
+    {
+    }
+
+    /// The most headers to look at.
+    int max_headers;
+
+    /// The most parameters to look at, across all the headers.
+    int max_params;
+
+    /// The most characters of each parameter value to look at.
+    int max_value_len;
+  };
+
+  /// Returns whether any Accept-Contact header in a request has the feature
+  /// 'g.3gpp.ics' with a value identifying a native device. The scan stops
+  /// at the first such feature, or once it reaches any of the limits, so its
+  /// cost is bounded however many headers and parameters the request has.
+  ///
+  /// @param req            - The request to check
+  /// @param limits         - The limits on the scan
+  /// @param truncated      - <out> A bitmask of the limits (1 << each
+  ///                         GeminiScanLimit) that cut the scan short
+  /// @returns whether there's the matching feature within the limits
+  bool accept_contact_has_3gpp_ics(const pjsip_msg* req,
+                                   const ScanLimits& limits,
+                                   int& truncated);
+
+  /// Returns which of the headers Gemini adds are already in a request (for
+  /// example because it has spiralled, or Gemini is invoked more than once),
+  /// in a single scan of its headers. A header is only equivalent to one
+  /// Gemini adds if it has exactly the same feature (and, for an
+  /// Accept-Contact header, is also explicit and required). Headers beyond
+  /// the limit on the number of headers are ignored (so are treated as not
+  /// present).
+  ///
+  /// @param req            - The request to check
+  /// @param limits         - The limits on the scan
+  /// @param truncated      - <out> A bitmask of the limits (1 << each
+  ///                         GeminiScanLimit) that cut the scan short
+  /// @returns a bitmask of the headers (1 << each GeminiContactHeader)
+  ///          present
+  int contact_headers_present(const pjsip_msg* req,
+                              const ScanLimits& limits,
+                              int& truncated);
+
+} // namespace GeminiUtils
+
+#endif
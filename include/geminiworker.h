@@ -0,0 +1,190 @@
+/**
+ * @file geminiworker.h Declaration of the background worker that does the
+ * gemini AS's bookkeeping off the call processing path.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef GEMINIWORKER_H__
+#define GEMINIWORKER_H__
+
+#include <stdint.h>
+#include <string>
+#include <atomic>
+#include <initializer_list>
+#include <pthread.h>
+
+extern "C" {
+#include <pjsip.h>
+}
+
+#include "sas.h"
+#include "geministats.h"
+#include "twinstatecache.h"
+#include "subscribememo.h"
+
+/// The GeminiWorker does Gemini's bookkeeping - building and reporting SAS
+/// events, and updating the twin state cache and SUBSCRIBE memo - on a
+/// background thread, so that Sprout's worker threads only have to make the
+/// routing decision and send the requests. (Histograms aren't recorded
+/// through the worker, as recording one inline costs less than queuing it.)
+///
+/// Worker threads hand over small fixed-size records through a bounded
+/// lock-free queue, which never blocks and never allocates. If the queue is
+/// full the record is dropped and counted, rather than holding up the call.
+/// The background thread sleeps while the queue is empty, and is woken by
+/// the next record published.
+class GeminiWorker
+{
+public:
+  /// The types of bookkeeping the worker does.
+  enum Op
+  {
+    SAS_EVENT = 0,
+    TWIN_STATE = 1,
+    SUBSCRIBE_LEG = 2,
+    NUM_OPS = 3
+  };
+
+  /// Constructor.
+  ///
+  /// @param queue_size     - The maximum number of queued records. Rounded
+  ///                         up to a power of two.
+  GeminiWorker(uint32_t queue_size = 4096);
+
+  /// Destructor. Completes all the bookkeeping queued, including any records
+  /// still being filled in.
+  virtual ~GeminiWorker();
+
+  /// Allocates the worker on a cache line boundary, as its producer and
+  /// consumer positions are laid out on separate cache lines (which new
+  /// only guarantees from C++17).
+  static void* operator new(size_t size);
+  static void operator delete(void* ptr);
+
+  /// Queues reporting a SAS event.
+  ///
+  /// @param trail          - The trail to report the event on.
+  /// @param event_id       - The event.
+  /// @param uri            - A URI to add as a variable parameter (or NULL
+  ///                         if there isn't one). This is printed before the
+  ///                         record is queued, so it needn't outlive the
+  ///                         call.
+  /// @param static_params  - The static parameters of the event.
+  void report_event(SAS::TrailId trail,
+                    int event_id,
+                    pjsip_uri* uri = NULL,
+                    std::initializer_list<uint32_t> static_params = {});
+
+  /// Queues recording the reachability of a subscriber's native twin.
+  void set_native_state(TwinStateCache* cache,
+                        const std::string& user,
+                        TwinStateCache::State state);
+
+  /// Queues memoising the leg that accepted a subscription. NUM_LEG_TYPES
+  /// forgets the leg instead.
+  void set_subscribe_leg(SubscribeMemo* memo,
+                         const std::string& key,
+                         GeminiLegType leg_type);
+
+  /// Waits until everything queued before the call has been done.
+  void flush();
+
+  /// Returns the number of records of a type dropped because the queue was
+  /// full.
+  uint64_t dropped(Op op) const { return _dropped[op].load(); }
+
+  /// Returns the number of records the worker has processed.
+  uint64_t processed() const { return _processed.load(); }
+
+private:
+  /// The largest string (URI or key) a record can hold. Longer ones are
+  /// dealt with inline.
+  static const int MAX_STRING = 256;
+  static const int MAX_STATIC_PARAMS = 4;
+
+  /// A record of bookkeeping to do. This is plain old data, so it can be
+  /// copied into the queue without any allocation. Its string (if it has
+  /// one) is held separately, in the string slot for the record's position,
+  /// so that records without one don't carry the space for it.
+  struct Record
+  {
+    uint8_t op;
+    uint8_t num_static_params;
+    uint16_t string_len;
+    int32_t arg;
+    void* target;
+    uint64_t value;
+    uint32_t static_params[MAX_STATIC_PARAMS];
+  };
+
+  /// A slot in the queue. The sequence number says whether the slot is free
+  /// for the producer at a position, or holds a record for the consumer.
+  struct Cell
+  {
+    std::atomic<uint64_t> sequence;
+    Record record;
+  };
+
+  /// The string of a record.
+  struct StringSlot
+  {
+    char string[MAX_STRING];
+  };
+
+  /// Claims a cell to fill in, or returns NULL (counting the drop) if the
+  /// queue is full.
+  Cell* claim(Op op, uint64_t& pos);
+
+  /// Returns the string slot for a position in the queue.
+  char* string_slot(uint64_t pos) { return _strings[pos & _mask].string; }
+
+  /// Hands a filled-in cell to the worker, waking it if it's asleep.
+  void publish(Cell* cell, uint64_t pos);
+
+  /// Does the bookkeeping described by a record.
+  static void apply(const Record& record, const char* string);
+
+  /// Waits for the record at a position to be published. Returns false
+  /// instead if we've been asked to stop and everything claimed has been
+  /// processed.
+  bool wait_for_record(uint64_t pos);
+
+  /// Entry point and main loop for the background thread.
+  static void* thread_function(void* worker);
+  void run();
+
+  uint32_t _mask;
+  Cell* _cells;
+  StringSlot* _strings;
+
+  /// The producers' and consumer's positions in the queue, on separate cache
+  /// lines.
+  alignas(64) std::atomic<uint64_t> _enqueue_pos;
+  alignas(64) std::atomic<uint64_t> _processed;
+
+  /// Whether the worker is asleep (or about to sleep) waiting for a record,
+  /// and the number of threads waiting in flush(). These are only written
+  /// when the worker is idle and when flushing, so producers can check them
+  /// on every record cheaply.
+  alignas(64) std::atomic<bool> _sleeping;
+  std::atomic<int> _flushing;
+
+  std::atomic<uint64_t> _dropped[NUM_OPS];
+  std::atomic<bool> _terminated;
+
+  /// Protects sleeping and waking the worker, and the threads flushing.
+  pthread_mutex_t _lock;
+  pthread_cond_t _record_cond;
+  pthread_cond_t _flush_cond;
+
+  pthread_t _thread;
+  bool _thread_started;
+};
+
+#endif
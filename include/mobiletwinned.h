@@ -21,6 +21,14 @@ extern "C" {
 }
 
 #include "appserver.h"
+#include "twinstatecache.h"
+#include "decisiontrace.h"
+#include "geministats.h"
+#include "geminiutils.h"
+#include "tenantaccounting.h"
+#include "subscribememo.h"
+#include "geminiworker.h"
+#include "nativeforkdedup.h"
 
 class MobileTwinnedAppServer;
 class MobileTwinnedAppServerTsx;
@@ -35,11 +43,146 @@ class MobileTwinnedAppServerTsx;
 class MobileTwinnedAppServer : public AppServer
 {
 public:
+  /// Requests that the AS passes straight through, without creating a
+  /// transaction, as it won't fork them and has no need to see their
+  /// responses.
+  enum PassThrough
+  {
+    /// Requests targeted at a specific VoIP client (whose Request URI has a
+    /// 'gr' parameter).
+    PASS_THROUGH_GR = 0x01,
+  };
+
+  /// Optional behaviour of the AS. A default constructed Config gives the
+  /// basic twinning service.
+  struct Config
+  {
+    Config() :
+      twin_state_cache(NULL),
+      decision_trace(NULL),
+      tenant_accounting(NULL),
+      home_domain(),
+      pass_through(PASS_THROUGH_GR),
+      detailed_timings(false),
+      record_pool_usage(false),
+      reserve_pool(false),
+      shadow_sample_rate(0),
+      shadow_hedge_ms(2000),
+      subscribe_memo(NULL),
+      worker(NULL),
+      native_fork_dedup(NULL),
+      accept_contact_limits(),
+      clock(NULL)
+    {
+    }
+
+    /// Cache of native twin reachability shared between Gemini nodes. If
+    /// this is set, INVITEs to subscribers whose native twin is known to be
+    /// unreachable are forked straight to the mobile hosted VoIP clients.
+    TwinStateCache* twin_state_cache;
+
+    /// Trace to record the decisions made by each transaction in (may be
+    /// NULL).
+    DecisionTrace* decision_trace;
+
+    /// Accounting of the work done for each tenant (may be NULL).
+    TenantAccounting* tenant_accounting;
+
+    /// The home domain. If this is set, requests with tel: Request URIs are
+    /// converted to SIP URIs in this domain and twinned as normal, rather
+    /// than being rejected.
+    std::string home_domain;
+
+    /// The requests to pass through (a combination of PassThrough values).
+    int pass_through;
+
+    /// Whether to record the time to fail of each fork and the post-dial
+    /// delay of each call, as well as the time to ring and answer.
+    bool detailed_timings;
+
+    /// Whether to record how much Gemini's changes to each request grow its
+    /// pool, and its size on the wire.
+    bool record_pool_usage;
+
+    /// Whether to allocate the parameters and strings Gemini adds to each
+    /// request in a single block, rather than separately.
+    bool reserve_pool;
+
+    /// How often to evaluate the candidate twinning policies in shadow mode
+    /// (one in this many forked calls, or 0 to never do so).
+    int shadow_sample_rate;
+
+    /// The hedge delay the hedged retry candidate is evaluated with in
+    /// shadow mode, in milliseconds. Gemini itself only ever retries on a
+    /// 480, so this has no effect on the forks it sends.
+    int shadow_hedge_ms;
+
+    /// The memo of which leg accepts each subscriber's subscriptions (or
+    /// NULL to always fork SUBSCRIBEs to both legs).
+    SubscribeMemo* subscribe_memo;
+
+    /// The background worker to report SAS events and update the twin
+    /// state cache and SUBSCRIBE memo on (or NULL to do it inline).
+    GeminiWorker* worker;
+
+    /// The table of native forks in flight, to avoid forking the same call
+    /// to the native twin twice (or NULL to always fork to it).
+    NativeForkDedup* native_fork_dedup;
+
+    /// The limits on how much of each request's Accept-Contact headers are
+    /// scanned for g.3gpp.ics. If a request goes beyond them, only the part
+    /// within them is considered.
+    GeminiUtils::ScanLimits accept_contact_limits;
+
+    /// The clock the transactions time calls on (or NULL for the system
+    /// clock). This is only set by simulations that run Gemini on virtual
+    /// time.
+    GeminiUtils::Clock clock;
+  };
+
   /// Constructor
-  MobileTwinnedAppServer(const std::string& _service_name) : AppServer(_service_name)
+  MobileTwinnedAppServer(const std::string& _service_name,
+                         const Config& config = Config()) :
+    AppServer(_service_name),
+    _config(config)
+  {
+  }
+
+  /// Allocates the AS on a cache line boundary, as its statistics are laid
+  /// out on cache lines (which new only guarantees from C++17).
+  static void* operator new(size_t size);
+  static void operator delete(void* ptr);
+
+  const Config& config() const { return _config; }
+
+  GeminiStats& stats() { return _stats; }
+
+  /// Returns the time, in milliseconds, on the configured clock.
+  uint64_t now_ms() const
+  {
+    return (_config.clock != NULL) ? _config.clock() : GeminiUtils::now_ms();
+  }
+
+  /// Records a value in one of the AS's histograms. This is always done
+  /// inline (even if there's a background worker), as that's only a few
+  /// relaxed atomic adds, which cost less than queuing them.
+  void record(GeminiHistogram& histogram, uint64_t value)
   {
+    histogram.record(value);
   }
 
+  /// Reports a SAS event.
+  ///
+  /// @param trail          - The trail to report the event on.
+  /// @param event_id       - The event.
+  /// @param uri            - A URI to add as a variable parameter (or NULL
+  ///                         if there isn't one).
+  /// @param static_params  - The static parameters of the event.
+  void report_event(SAS::TrailId trail,
+                    int event_id,
+                    pjsip_uri* uri = NULL,
+                    std::initializer_list<uint32_t> static_params = {});
+
   /// Called when the system determines the service should be invoked for a
   /// received request.  The AppServer can either return NULL indicating it
   /// does not want to process the request, or create a suitable object
@@ -56,6 +199,17 @@ public:
                                     pjsip_sip_uri*& next_hop,
                                     pj_pool_t* pool,
                                     SAS::TrailId trail);
+
+private:
+  /// Returns whether a request should be passed through without creating
+  /// a transaction.
+  ///
+  /// @param  req           - The received request message.
+  /// @param  trail         - The SAS trail id for the message.
+  bool pass_through(pjsip_msg* req, SAS::TrailId trail);
+
+  Config _config;
+  GeminiStats _stats;
 };
 
 /// The MobileTwinnedAppServerTsx class subclasses AppServerTsx and provides
@@ -67,7 +221,9 @@ class MobileTwinnedAppServerTsx : public AppServerTsx
 {
 public:
   /// Constructor.
-  MobileTwinnedAppServerTsx();
+  ///
+  /// @param mobile_twinned - The AS that created this transaction.
+  MobileTwinnedAppServerTsx(MobileTwinnedAppServer* mobile_twinned);
 
   /// Virtual destructor.
   virtual ~MobileTwinnedAppServerTsx();
@@ -76,9 +232,13 @@ public:
   /// the original received request for the transaction.
   ///
   /// This function tries to fork INVITEs and SUBSCRIBEs to twinned mobile
-  /// devices. If successful, it will call send_request twice to forward the
-  /// request to the two forks. If unsuccessful, it will create and send a
-  /// 480 response.
+  /// devices. It normally calls send_request once for the VoIP clients and
+  /// once for each native device (up to MAX_TWINS), but sends the request
+  /// to only one of the legs if it's targeted at a specific VoIP client or
+  /// at the native devices, if the SUBSCRIBE memo knows which leg will
+  /// accept it, or if another transaction is already paging the native
+  /// twin. If the Request URI isn't (and can't be converted to) a SIP URI,
+  /// it will create and send a 480 response.
   ///
   /// @param req           - The received initial request.
   virtual void on_initial_request(pjsip_msg* req);
@@ -97,24 +257,288 @@ public:
   virtual void on_response(pjsip_msg* rsp, int fork_id);
 
 private:
+  /// Rejects a request whose Request URI isn't (and couldn't be converted
+  /// to) a SIP URI.
+  ///
+  /// @param req            - The request to reject
+  void reject_non_sip_uri(pjsip_msg* req);
+
+  /// Converts the tel: Request URI of a request to the equivalent SIP URI in
+  /// the home domain, keeping the tel: URI's parameters in the user part.
+  ///
+  /// @param req            - The request to convert
+  /// @returns whether the conversion was successful
+  bool convert_tel_uri(pjsip_msg* req);
+
+  /// The maximum number of native devices we fork to.
+  static const int MAX_TWINS = 4;
+
+  /// Gets the twin prefixes (one for each native device) from the AS URI.
+  ///
+  /// @param twin_prefixes  - <out> The twin-prefix parameters. If there are
+  ///                         none this holds a single NULL entry.
+  /// @param truncated      - <out> Whether there were more than MAX_TWINS
+  ///                         twin-prefix parameters, so some were ignored.
+  /// @returns the number of native devices
+  int get_twin_prefixes(pjsip_param* twin_prefixes[], bool& truncated);
+
+  /// A set of changes Gemini makes to the request on a leg. This provides
+  /// the memory for the changes, and records how much they grow the
+  /// request's pool once they're complete.
+  class LegMutation
+  {
+  public:
+    /// Constructor.
+    ///
+    /// @param tsx          - The transaction making the changes
+    /// @param req          - The request being changed
+    /// @param leg_type     - The type of leg the request is for
+    /// @param num_params   - The number of parameters the changes add
+    /// @param string_bytes - The size of the strings the changes add
+    LegMutation(MobileTwinnedAppServerTsx* tsx,
+                pjsip_msg* req,
+                GeminiLegType leg_type,
+                int num_params,
+                pj_size_t string_bytes = 0);
+
+    /// Destructor. Records the growth of the pool.
+    ~LegMutation();
+
+    /// The request's pool.
+    pj_pool_t* pool() const { return _pool; }
+
+    /// Allocates a parameter, with no value.
+    pjsip_param* new_param(const pj_str_t& name);
+
+    /// Allocates a string.
+    char* new_string(pj_size_t len);
+
+    /// Adds one of Gemini's headers to the request.
+    void add_hdr(pjsip_msg* req, void* hdr);
+
+    /// Counts bytes added to the request other than by add_hdr (only
+    /// recorded if we're recording pool usage).
+    void added_bytes(pj_size_t bytes) { _wire_bytes += bytes; }
+
+  private:
+    MobileTwinnedAppServerTsx* _tsx;
+    pj_pool_t* _pool;
+    GeminiLegType _leg_type;
+
+    /// The unused parameters and strings in the reservation (if any).
+    pjsip_param* _reserved_params;
+    int _reserved_num_params;
+    char* _reserved_strings;
+    pj_size_t _reserved_string_bytes;
+
+    /// The state of the pool before the changes (if we're recording it).
+    pj_size_t _used_before;
+    pj_size_t _capacity_before;
+
+    /// The bytes the changes add to the request on the wire (if we're
+    /// recording pool usage).
+    pj_size_t _wire_bytes;
+  };
+
+  /// Sets up a request to fork to a native device.
+  ///
+  /// @param req            - The request to manipulate
+  /// @param twin_prefix    - The native device's twin prefix (can be NULL)
+  void set_up_native_fork(pjsip_msg* req,
+                          pjsip_param* twin_prefix);
+
+  /// Sets up a request to fork to the VoIP clients.
+  ///
+  /// @param req            - The request to manipulate
+  void set_up_voip_fork(pjsip_msg* req);
+
+  /// Sets up and sends a request to each native device.
+  ///
+  /// @param req            - The request to send (which is copied for each
+  ///                         additional native device)
+  /// @param twin_prefixes  - The native devices' twin prefixes
+  /// @param num_twins      - The number of native devices
+  void send_native_forks(pjsip_msg* req,
+                         pjsip_param* twin_prefixes[],
+                         int num_twins);
+
+  /// Looks up which leg accepted the subscriber's last subscription to the
+  /// event package of a SUBSCRIBE (if we're memoising them).
+  ///
+  /// @param req            - The SUBSCRIBE
+  /// @returns the type of leg, or NUM_LEG_TYPES if it isn't known
+  GeminiLegType memoised_subscribe_leg(pjsip_msg* req);
+
+  /// Forks the SUBSCRIBE to the leg that the memoised leg wasn't, once the
+  /// memoised leg has rejected it.
+  ///
+  /// @param fork_id        - The fork the rejection was received on
+  /// @param status_code    - The status code of the rejection
+  void fall_back_from_memo(int fork_id, int status_code);
+
+  /// Memoises which leg accepted the SUBSCRIBE, once every fork of it has
+  /// completed.
+  void learn_subscribe_leg();
+
+  /// Updates the SUBSCRIBE memo with the leg that accepted the SUBSCRIBE
+  /// (or forgets the leg, given NUM_LEG_TYPES).
+  void set_subscribe_leg(GeminiLegType leg_type);
+
+  /// Returns the size of the user part that adding a twin prefix to a
+  /// Request URI creates.
+  static pj_size_t twin_prefix_bytes(pjsip_uri* req_uri,
+                                     pjsip_param* twin_prefix);
+
   /// Adds a twin prefix to a request URI
   ///
   /// @param req_uri        - <in/out> The Request URI to manipulate
   /// @param twin_prefix    - The prefix to add (can be empty)
-  /// @param pool           - The pool to use
+  /// @param mutation       - The changes being made to the request
   void add_twin_prefix(pjsip_uri* req_uri,
                        pjsip_param* twin_prefix,
-                       pj_pool_t* pool);
+                       LegMutation& mutation);
 
   /// Returns whether any Accept-Contact headers in the request contain
-  /// the feature 'g.3gpp.ics'
+  /// the feature 'g.3gpp.ics', within the configured scan limits
   ///
   /// @param req            - The request to check
   /// @returns whether there's the matching feature
   bool accept_contact_header_has_3gpp_ics(pjsip_msg* req);
 
-  /// Fork ID for the INVITE that has been sent on to the mobile device.
-  int _mobile_fork_id;
+  /// Counts a scan of the request's Accept-Contact and Reject-Contact
+  /// headers that was cut short by the configured limits.
+  ///
+  /// @param truncated      - A bitmask of the limits (1 << each
+  ///                         GeminiScanLimit) that cut the scan short
+  void count_truncated_scan(int truncated);
+
+  /// Sets up a request to fork to the VoIP clients hosted on mobile devices,
+  /// by adding an Accept-Contact header requiring the feature
+  /// '+sip.with-twin'.
+  ///
+  /// @param req            - The request to manipulate
+  void set_up_mobile_voip_fork(pjsip_msg* req);
+
+  /// Returns which of the headers Gemini adds are already in the request
+  /// (as a bitmask of 1 << each GeminiContactHeader), so we don't add them
+  /// again. Every request we change is a copy of the original request, made
+  /// before any of our changes, so this only scans the first request it's
+  /// called with.
+  ///
+  /// @param req            - The request being changed
+  int existing_contact_headers(pjsip_msg* req);
+
+  /// Returns whether one of Gemini's headers needs adding to the request,
+  /// counting it as skipped if it's already there.
+  ///
+  /// @param req            - The request being changed
+  /// @param contact_hdr    - The header
+  bool need_contact_hdr(pjsip_msg* req, GeminiContactHeader contact_hdr);
+
+  /// Sends a request on a fork, and starts tracking the fork's progress.
+  ///
+  /// @param req            - The request to send
+  /// @param leg_type       - The type of leg the fork is
+  /// @returns the ID of the fork
+  int send_fork(pjsip_msg*& req, GeminiLegType leg_type);
+
+  /// The progress of a fork.
+  struct ForkRecord
+  {
+    int fork_id;
+    GeminiLegType leg_type;
+    uint64_t sent_ms;
+    uint64_t first_18x_ms;
+    uint64_t final_ms;
+    int final_code;
+  };
+
+  /// Tracks the progress of a fork from a response received on it, and
+  /// records the timings of the fork in the AS's statistics.
+  ///
+  /// @param rsp            - The response
+  /// @param fork_id        - The fork the response was received on
+  /// @returns the record of the fork, or NULL if it isn't one of ours
+  ForkRecord* track_fork(pjsip_msg* rsp, int fork_id);
+
+  /// Returns whether every native device we forked to has returned a 480.
+  bool all_native_forks_unavailable();
+
+  /// Returns whether every fork we've made has failed.
+  bool all_forks_failed();
+
+  /// Returns whether another transaction already has a fork of this call to
+  /// the native twin in flight. If not, this transaction claims the call.
+  ///
+  /// @param req            - The request
+  bool native_fork_in_flight(pjsip_msg* req);
+
+  /// Releases this transaction's claim on the call's native fork (if it has
+  /// one), once every native fork has completed.
+  void release_native_fork();
+
+  /// Returns whether to evaluate the candidate policies on this call.
+  bool shadow_sampled();
+
+  /// Evaluates the candidate policies when the active one retries to the
+  /// mobile hosted VoIP clients.
+  ///
+  /// @param now_ms         - When the retry is made
+  void shadow_on_retry(uint64_t now_ms);
+
+  /// Evaluates the candidate policies on a call that completes without a
+  /// retry, if this final response completes it.
+  ///
+  /// @param status_code    - The status code of the response being passed on
+  void shadow_on_response(int status_code);
+
+  /// Evaluates the candidate policies on a call that completes without a
+  /// retry.
+  void shadow_on_complete();
+
+  /// Returns when the hedged retry policy would have retried the call, or 0
+  /// if it wouldn't have done so before now_ms.
+  uint64_t hedge_retry_ms(uint64_t now_ms);
+
+  /// Records a decision in the decision trace (if there is one).
+  void trace_decision(DecisionTrace::Event event,
+                      int fork_id = 0,
+                      int status_code = 0);
+
+  /// Adds to one of the tenant's counters (if we're accounting for them).
+  void account(TenantAccounting::Counter counter, uint64_t value = 1);
+
+  /// Records the reachability of the native twin in the twin state cache
+  /// (if we're using one).
+  ///
+  /// @param state          - The state of the native twin
+  void record_twin_state(TwinStateCache::State state);
+
+  /// The AS that created this transaction.
+  MobileTwinnedAppServer* _mobile_twinned;
+
+  /// The key of the subscriber in the twin state cache, or empty if we
+  /// aren't recording the state of the native twin.
+  std::string _twin_state_key;
+
+  /// The key of the subscription in the SUBSCRIBE memo, or empty if we
+  /// aren't memoising it.
+  std::string _subscribe_key;
+
+  /// The leg we sent the SUBSCRIBE to because it accepted the last one, or
+  /// NUM_LEG_TYPES if we forked it to both legs.
+  GeminiLegType _memo_leg;
+
+  /// The forks we've made. This maps each fork ID to the type of leg it is.
+  /// We never make more forks than one to the VoIP clients, one to each
+  /// native device and one to the mobile hosted VoIP clients.
+  static const int MAX_FORKS = MAX_TWINS + 2;
+  ForkRecord _forks[MAX_FORKS];
+  int _num_forks;
+
+  /// When the initial request reached us, and whether any fork has rung yet.
+  uint64_t _start_ms;
+  bool _rung;
 
   /// Whether or not we've already tried to fork an INVITE to the
   /// VoIP client on the mobile device, which we try to do after
@@ -124,6 +548,21 @@ private:
 
   /// Whether the request should only be sent to a single target
   bool _single_target;
+
+  /// The tenant this transaction is accounted to.
+  int _tenant;
+
+  /// Whether we're evaluating the candidate policies on this call.
+  bool _shadow;
+
+  /// The key of the call in the native fork dedup table, if we've claimed
+  /// its native fork, or 0, and the owner of the claim.
+  uint64_t _native_fork_key;
+  uint64_t _native_fork_owner;
+
+  /// Which of the headers Gemini adds were already in the original request,
+  /// or -1 if we haven't looked yet.
+  int _existing_contact_headers;
 };
 
 #endif
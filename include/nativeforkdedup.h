@@ -0,0 +1,129 @@
+/**
+ * @file nativeforkdedup.h Declaration of the table of native forks in
+ * flight, used to avoid paging a native twin twice for the same call.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef NATIVEFORKDEDUP_H__
+#define NATIVEFORKDEDUP_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <pthread.h>
+
+#include <pjsip.h>
+
+#include "geminiutils.h"
+
+/// The NativeForkDedup records which calls (identified by Call-ID and
+/// callee) Gemini currently has a fork to the native twin in flight for.
+/// If Gemini is invoked more than once for the same call - for example
+/// because the call was forked upstream to several contacts that share the
+/// same terminating services - only the first invocation forks to the native
+/// twin, so the native device isn't paged twice.
+///
+/// The table is open-addressed, and split into stripes that each have
+/// their own lock and probe only within their own slots, so that threads
+/// handling different calls rarely contend. Probes are bounded, so a claim
+/// always costs a handful of comparisons. Entries expire after a window, in
+/// case they're never released. If there's no room for a call, it is let
+/// through rather than being deduplicated.
+class NativeForkDedup
+{
+public:
+  /// Constructor.
+  ///
+  /// @param window_ms      - How long (in milliseconds) an entry lasts if it
+  ///                         isn't released.
+  /// @param capacity       - The number of calls the table can hold.
+  /// @param clock          - The clock to use (or NULL for the system
+  ///                         clock).
+  NativeForkDedup(int window_ms = 5000,
+                  uint32_t capacity = 65536,
+                  GeminiUtils::Clock clock = NULL);
+
+  /// Destructor.
+  virtual ~NativeForkDedup();
+
+  /// Allocates the table on a cache line boundary, as its stripes are laid
+  /// out on separate cache lines (which new only guarantees from C++17).
+  static void* operator new(size_t size);
+  static void operator delete(void* ptr);
+
+  /// Returns the key of a call. This is never 0.
+  ///
+  /// @param call_id        - The Call-ID of the call.
+  /// @param callee_user    - The user part of the callee's URI.
+  /// @param callee_host    - The host part of the callee's URI.
+  static uint64_t key(const pj_str_t* call_id,
+                      const pj_str_t* callee_user,
+                      const pj_str_t* callee_host);
+
+  /// Claims the native fork of a call.
+  ///
+  /// @param key            - The key of the call.
+  /// @param owner          - <out> Identifies this claim, to release it with.
+  ///                         This is 0 if the claim couldn't be recorded
+  ///                         because there was no room for it, in which case
+  ///                         it doesn't need to be released.
+  /// @returns false if another transaction already has a native fork of the
+  ///          call in flight, and true otherwise.
+  bool claim(uint64_t key, uint64_t& owner);
+
+  /// Releases the native fork of a call, once it has completed. This does
+  /// nothing if the claim has since expired, so it can't release a claim
+  /// that another transaction has made on the call since.
+  ///
+  /// @param key            - The key of the call.
+  /// @param owner          - The owner returned when the call was claimed.
+  void release(uint64_t key, uint64_t owner);
+
+  /// Returns the number of calls that couldn't be recorded because there
+  /// was no room for them.
+  uint64_t overflows() const { return _overflows.load(); }
+
+private:
+  struct Entry
+  {
+    uint64_t key;
+    uint64_t owner;
+    uint64_t expiry_ms;
+  };
+
+  /// A stripe of the table, padded so that stripes' locks don't share cache
+  /// lines. Each claim recorded in the stripe gets the next owner.
+  struct alignas(64) Stripe
+  {
+    pthread_mutex_t lock;
+    Entry* entries;
+    uint64_t next_owner;
+  };
+
+  Stripe& stripe_for(uint64_t key);
+
+  /// Returns the current time in milliseconds.
+  uint64_t now_ms() const
+  {
+    return (_clock != NULL) ? _clock() : GeminiUtils::now_ms();
+  }
+
+  static const int NUM_STRIPES = 64;
+
+  /// The number of slots (from its home slot) that a call can be in.
+  static const uint32_t MAX_PROBES = 16;
+
+  int _window_ms;
+  uint32_t _stripe_slots;
+  uint32_t _max_probes;
+  GeminiUtils::Clock _clock;
+  Stripe _stripes[NUM_STRIPES];
+  std::atomic<uint64_t> _overflows;
+};
+
+#endif
@@ -0,0 +1,97 @@
+/**
+ * @file subscribememo.h Declaration of the memo of which leg accepted each
+ * subscriber's subscriptions.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef SUBSCRIBEMEMO_H__
+#define SUBSCRIBEMEMO_H__
+
+#include <string>
+#include <unordered_map>
+#include <pthread.h>
+
+#include "gemini_constants.h"
+#include "geminiutils.h"
+
+/// The SubscribeMemo records, for each subscriber and event package, which
+/// type of leg (the VoIP clients or the native devices) accepted the last
+/// initial SUBSCRIBE that Gemini forked. For most event packages only one of
+/// the legs ever accepts, so later SUBSCRIBEs can be sent straight there
+/// rather than costing a transaction on the other leg every time a watcher
+/// resubscribes.
+///
+/// Entries expire after a TTL, so that the full fork is made again from time
+/// to time in case the subscriber's devices have changed. The memo is split
+/// into shards to limit lock contention between worker threads, and each
+/// shard holds a bounded number of entries.
+class SubscribeMemo
+{
+public:
+  /// Constructor.
+  ///
+  /// @param ttl_ms          - How long (in milliseconds) entries are trusted.
+  /// @param max_entries     - The maximum number of entries.
+  /// @param clock           - The clock to use (or NULL for the system
+  ///                          clock).
+  SubscribeMemo(int ttl_ms = 600000,
+                unsigned int max_entries = 100000,
+                GeminiUtils::Clock clock = NULL);
+
+  /// Destructor.
+  virtual ~SubscribeMemo();
+
+  /// Returns the key of a subscriber's subscriptions to an event package.
+  ///
+  /// @param user           - The subscriber (as user@host).
+  /// @param package        - The event package.
+  static std::string key(const std::string& user, const std::string& package);
+
+  /// Returns the type of leg that accepted the last subscription with the
+  /// given key, or NUM_LEG_TYPES if this isn't known.
+  GeminiLegType get_leg(const std::string& key);
+
+  /// Records the type of leg that accepted a subscription.
+  void set_leg(const std::string& key, GeminiLegType leg_type);
+
+  /// Forgets the type of leg that accepted a subscription, so that the next
+  /// one is forked to both legs.
+  void forget(const std::string& key);
+
+private:
+  /// An entry in the memo.
+  struct Entry
+  {
+    GeminiLegType leg_type;
+    uint64_t expiry_ms;
+  };
+
+  static const int NUM_SHARDS = 16;
+  struct Shard
+  {
+    pthread_mutex_t lock;
+    std::unordered_map<std::string, Entry> entries;
+  };
+
+  Shard& shard_for(const std::string& key);
+
+  /// Returns the current time in milliseconds.
+  uint64_t now_ms() const
+  {
+    return (_clock != NULL) ? _clock() : GeminiUtils::now_ms();
+  }
+
+  int _ttl_ms;
+  unsigned int _max_shard_entries;
+  GeminiUtils::Clock _clock;
+
+  Shard _shards[NUM_SHARDS];
+};
+
+#endif
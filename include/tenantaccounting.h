@@ -0,0 +1,207 @@
+/**
+ * @file tenantaccounting.h Declaration of the per-tenant accounting of the
+ * resources used by the gemini AS.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef TENANTACCOUNTING_H__
+#define TENANTACCOUNTING_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <pthread.h>
+
+#include <pjsip.h>
+
+/// TenantAccounting counts the work Gemini does for each tenant, where a
+/// tenant is identified by the AS URI in its IFCs (so each enterprise, with
+/// its own twin prefixes, is a separate tenant).
+///
+/// Tenants are interned into small integer IDs the first time they're seen.
+/// Looking up a known tenant is lock-free, and each thread counts into its
+/// own block of counters, so accounting doesn't add contention between
+/// worker threads. The counters are summed into a snapshot periodically by a
+/// background thread.
+class TenantAccounting
+{
+public:
+  enum Counter
+  {
+    /// INVITEs and SUBSCRIBEs processed.
+    INVITES = 0,
+    SUBSCRIBES = 1,
+
+    /// Forks sent, and how many of those were retries on 480.
+    FORKS = 2,
+    RETRIES = 3,
+
+    /// Time spent in Gemini's request and response processing, in
+    /// nanoseconds.
+    PROCESSING_NS = 4,
+
+    /// Pool memory used by the requests sent on forks, in bytes.
+    POOL_BYTES = 5,
+
+    NUM_COUNTERS = 6
+  };
+
+  /// The usage of a single tenant.
+  struct Usage
+  {
+    std::string tenant;
+    uint64_t counters[NUM_COUNTERS];
+  };
+
+  /// Receives each periodic snapshot, to export it (for example to the
+  /// statistics or SNMP tables of the process Gemini is running in).
+  class SnapshotListener
+  {
+  public:
+    virtual ~SnapshotListener() {}
+
+    /// Called on the background thread with the usage of each tenant during
+    /// the period just ended. Tenants with no usage in the period are
+    /// omitted.
+    virtual void snapshot_taken(const std::vector<Usage>& usage) = 0;
+  };
+
+  /// The tenant that requests are counted against if they don't have an AS
+  /// URI, or if there are already max_tenants tenants.
+  static const int OTHER_TENANT = 0;
+
+  /// Constructor.
+  ///
+  /// @param max_tenants        - The maximum number of tenants to count
+  ///                             separately.
+  /// @param snapshot_period_ms - How often to take a snapshot of the usage.
+  /// @param listener           - Where to export each snapshot (or NULL to
+  ///                             only keep the last one).
+  TenantAccounting(int max_tenants = 1024,
+                   int snapshot_period_ms = 10000,
+                   SnapshotListener* listener = NULL);
+
+  /// Destructor.
+  virtual ~TenantAccounting();
+
+  /// Returns the ID of the tenant with the given AS URI, interning it if
+  /// it's new.
+  ///
+  /// @param route_hdr      - The Route header holding the AS URI (can be
+  ///                         NULL).
+  int tenant_id(const pjsip_route_hdr* route_hdr);
+
+  /// Returns the ID of the tenant with the given key, interning it if it's
+  /// new.
+  int tenant_id(const char* key, int key_len);
+
+  /// Adds to a counter for a tenant.
+  void add(int tenant, Counter counter, uint64_t value);
+
+  /// Gets the total usage of each tenant since the accounting was created.
+  ///
+  /// @param usage          - <out> The usage of each tenant.
+  void totals(std::vector<Usage>& usage);
+
+  /// Gets the usage of each tenant during the last complete snapshot period.
+  /// Tenants with no usage in the period are omitted.
+  ///
+  /// @param usage          - <out> The usage of each tenant.
+  void last_snapshot(std::vector<Usage>& usage);
+
+  /// Takes a snapshot now, and passes it to the listener. This is normally
+  /// done by the background thread.
+  void take_snapshot();
+
+  /// Returns the number of threads that have counted anything (each of
+  /// which has its own block of counters).
+  int num_threads();
+
+  /// Returns the current monotonic time in nanoseconds.
+  static uint64_t now_ns();
+
+  /// Counts the processing time of a tenant from when it's created to when
+  /// it's destroyed.
+  class Timer
+  {
+  public:
+    Timer(TenantAccounting* accounting, const int& tenant) :
+      _accounting(accounting),
+      _tenant(tenant),
+      _start_ns((accounting != NULL) ? now_ns() : 0)
+    {
+    }
+
+    ~Timer()
+    {
+      if (_accounting != NULL)
+      {
+        _accounting->add(_tenant, PROCESSING_NS, now_ns() - _start_ns);
+      }
+    }
+
+  private:
+    TenantAccounting* _accounting;
+
+    /// The tenant may not be known until part way through the processing,
+    /// so this refers to where it will be stored.
+    const int& _tenant;
+    uint64_t _start_ns;
+  };
+
+private:
+  struct Tenant
+  {
+    uint32_t hash;
+    std::string key;
+  };
+
+  /// Returns the calling thread's block of counters.
+  std::atomic<uint64_t>* counters_for_this_thread();
+
+  /// Entry point and main loop for the background thread.
+  static void* thread_function(void* accounting);
+  void run();
+
+  int _max_tenants;
+  int _snapshot_period_ms;
+  SnapshotListener* _listener;
+
+  /// The interned tenants. Entries are only ever added (under _lock), and
+  /// are published through _slots, so can be read without locking.
+  std::vector<Tenant> _tenants;
+  std::atomic<int> _num_tenants;
+
+  /// Open-addressed hash table of tenants. Each slot holds a tenant ID plus
+  /// one, or zero if it's empty.
+  std::atomic<int>* _slots;
+  uint32_t _slot_mask;
+
+  /// The blocks of counters belonging to each thread that has counted
+  /// anything. Each block holds NUM_COUNTERS counters per tenant.
+  std::vector<std::atomic<uint64_t>*> _thread_counters;
+
+  /// The totals at the last snapshot, and the usage in the period before it.
+  std::vector<uint64_t> _snapshot_totals;
+  std::vector<Usage> _last_snapshot;
+
+  /// Unique identifier of this accounting, which threads look up their
+  /// counters for it by.
+  uint64_t _id;
+  static std::atomic<uint64_t> _next_id;
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+  bool _terminated;
+  pthread_t _thread;
+  bool _thread_started;
+};
+
+#endif
@@ -0,0 +1,181 @@
+/**
+ * @file twinstatecache.h Declaration of the cache of native twin reachability
+ * shared between gemini nodes.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef TWINSTATECACHE_H__
+#define TWINSTATECACHE_H__
+
+#include <string>
+#include <unordered_map>
+#include <atomic>
+#include <pthread.h>
+
+#include "store.h"
+#include "eventq.h"
+#include "geminiutils.h"
+
+/// The TwinStateCache records whether a subscriber's native twin was
+/// reachable the last time Gemini forked to it, so that every Gemini node can
+/// benefit from what any one of them has learned.
+///
+/// Lookups made on the request path only ever consult a local near-cache and
+/// never block on the network. Misses are resolved asynchronously against the
+/// shared Store (typically a memcached cluster) by a background thread, which
+/// drains queued operations in batches and abandons any lookups left in a
+/// batch once it has exceeded its time budget.
+///
+/// A native twin that's unreachable is only ever learnt to be reachable
+/// again from a call that forks to it, so once every probe interval one
+/// lookup of an unreachable native twin returns UNKNOWN, to let that call
+/// probe it.
+class TwinStateCache
+{
+public:
+  enum State
+  {
+    UNKNOWN = 0,
+    REACHABLE = 1,
+    UNREACHABLE = 2
+  };
+
+  /// Constructor.
+  ///
+  /// @param store           - The shared store to use.
+  /// @param ttl             - How long (in seconds) entries last in the store.
+  /// @param near_ttl        - How long (in seconds) entries are trusted in the
+  ///                          local near-cache before being refreshed.
+  /// @param batch_budget_ms - The time budget for each batch of store
+  ///                          lookups.
+  /// @param max_queue       - The maximum number of queued store operations.
+  /// @param max_entries     - The maximum number of near-cache entries.
+  /// @param probe_interval  - How often (in seconds) a call is allowed to
+  ///                          probe a native twin known to be unreachable.
+  /// @param clock           - The clock to use (or NULL for the system
+  ///                          clock).
+  TwinStateCache(Store* store,
+                 int ttl = 300,
+                 int near_ttl = 30,
+                 int batch_budget_ms = 20,
+                 unsigned int max_queue = 1000,
+                 unsigned int max_entries = 100000,
+                 int probe_interval = 10,
+                 GeminiUtils::Clock clock = NULL);
+
+  /// Destructor.
+  virtual ~TwinStateCache();
+
+  /// Returns what is known locally about the reachability of a subscriber's
+  /// native twin. This never blocks - if nothing is known locally, UNKNOWN is
+  /// returned and a lookup is queued so the answer is available next time.
+  ///
+  /// @param user           - The subscriber (as user@host).
+  /// @returns the state of the native twin.
+  State get_native_state(const std::string& user);
+
+  /// Records the reachability of a subscriber's native twin. The near-cache
+  /// is updated immediately, and the write to the store is queued.
+  ///
+  /// @param user           - The subscriber (as user@host).
+  /// @param state          - The new state.
+  void set_native_state(const std::string& user, State state);
+
+  /// Returns the number of store operations that were abandoned, either
+  /// because the queue was full or the batch budget was exceeded.
+  uint64_t dropped_ops() const { return _dropped_ops.load(); }
+
+  /// Returns the number of lookups that let a call probe a native twin
+  /// known to be unreachable.
+  uint64_t probes() const { return _probes.load(); }
+
+  /// Waits until the background thread has dealt with every store operation
+  /// queued before the call (cpp-common's eventq has no way of doing this
+  /// itself).
+  void flush();
+
+private:
+  /// An operation queued for the background thread.
+  struct Op
+  {
+    enum Type { GET, SET };
+    Type type;
+    std::string user;
+    State state;
+  };
+
+  /// An entry in the near-cache.
+  struct Entry
+  {
+    State state;
+    uint64_t expiry_ms;
+
+    /// When a call may next probe the native twin, if it's unreachable.
+    uint64_t probe_ms;
+  };
+
+  /// The near-cache is split into shards to limit lock contention between
+  /// worker threads.
+  static const int NUM_SHARDS = 16;
+  struct Shard
+  {
+    pthread_mutex_t lock;
+    std::unordered_map<std::string, Entry> entries;
+  };
+
+  Shard& shard_for(const std::string& user);
+
+  /// Updates the near-cache entry for the user. Must be called with the
+  /// shard's lock held.
+  void update_entry(Shard& shard, const std::string& user, State state);
+
+  void queue_op(Op::Type type, const std::string& user, State state);
+
+  /// Returns the current time in milliseconds.
+  uint64_t now_ms() const
+  {
+    return (_clock != NULL) ? _clock() : GeminiUtils::now_ms();
+  }
+
+  /// Entry point and main loop for the background thread.
+  static void* thread_function(void* cache);
+  void run();
+
+  /// Performs queued operations against the store.
+  void do_get(const std::string& user);
+  void do_set(const std::string& user, State state);
+
+  Store* _store;
+  int _ttl;
+  int _near_ttl_ms;
+  int _batch_budget_ms;
+  unsigned int _max_shard_entries;
+  int _probe_interval_ms;
+  GeminiUtils::Clock _clock;
+
+  Shard _shards[NUM_SHARDS];
+
+  eventq<Op> _queue;
+  pthread_t _thread;
+  bool _thread_started;
+  std::atomic<uint64_t> _dropped_ops;
+  std::atomic<uint64_t> _probes;
+
+  /// The number of operations queued, and the number the background thread
+  /// has dealt with (under _flush_lock), so that flush can wait for them.
+  std::atomic<uint64_t> _ops_queued;
+  uint64_t _ops_done;
+  pthread_mutex_t _flush_lock;
+  pthread_cond_t _flush_cond;
+
+  static const std::string TABLE;
+  static const int MAX_BATCH_SIZE = 64;
+};
+
+#endif
@@ -0,0 +1,261 @@
+/**
+ * @file acceptcontact_bench.cpp Worst-case latency benchmark for the scan of
+ * Accept-Contact headers done by the mobile twinned AS which is part of
+ * gemini.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+// Times GeminiUtils::accept_contact_has_3gpp_ics on pathological requests -
+// with many Accept-Contact headers, many feature parameters, or a huge
+// g.3gpp.ics value - of increasing size, both with the default scan limits
+// and with no limits. With the limits, the worst-case latency of a scan
+// should stay flat however large the request gets.
+//
+// The benchmark is configured through the environment:
+//
+//   GEMINI_BENCH_SCAN_SIZES      - Comma-separated sizes of the pathological
+//                                  part of each request (default
+//                                  "1,16,256,4096").
+//   GEMINI_BENCH_SCAN_ITERATIONS - Scans timed for each request (default
+//                                  10000).
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gtest/gtest.h"
+
+#include "siptest.hpp"
+#include "stack.h"
+#include "geminiutils.h"
+
+/// The shapes of pathological request.
+enum Shape
+{
+  /// Many Accept-Contact headers, none for the native device.
+  MANY_HEADERS = 0,
+
+  /// One Accept-Contact header with many feature parameters.
+  MANY_PARAMS = 1,
+
+  /// A g.3gpp.ics feature with a huge value that doesn't identify a native
+  /// device.
+  LONG_VALUE = 2,
+
+  NUM_SHAPES = 3
+};
+
+static const char* SHAPE_NAMES[NUM_SHAPES] = {"headers", "params", "value"};
+
+/// The latency of a scan, in nanoseconds.
+struct ScanLatency
+{
+  uint64_t p50_ns;
+  uint64_t p99_ns;
+  uint64_t max_ns;
+};
+
+/// Fixture for the benchmark.
+///
+/// This derives from SipTest to ensure PJSIP is set up correctly, but doesn't
+/// actually use most of its function (and doesn't register a module).
+class AcceptContactBench : public SipTest
+{
+public:
+  static void SetUpTestCase()
+  {
+    SipTest::SetUpTestCase();
+  }
+
+  static void TearDownTestCase()
+  {
+    SipTest::TearDownTestCase();
+  }
+
+  AcceptContactBench() : SipTest(NULL)
+  {
+  }
+
+  /// Reads an integer from the environment.
+  static int env_int(const char* name, int default_value)
+  {
+    const char* value = getenv(name);
+    return (value != NULL) ? atoi(value) : default_value;
+  }
+
+  /// Reads a list of integers from the environment.
+  static std::vector<int> env_ints(const char* name, const char* default_value)
+  {
+    const char* value = getenv(name);
+    std::string list = (value != NULL) ? value : default_value;
+    std::vector<int> ints;
+    size_t start = 0;
+
+    while (start < list.length())
+    {
+      size_t end = list.find(',', start);
+      end = (end == std::string::npos) ? list.length() : end;
+      ints.push_back(atoi(list.substr(start, end - start).c_str()));
+      start = end + 1;
+    }
+
+    return ints;
+  }
+
+  /// Builds the text of a pathological request.
+  static std::string request_text(Shape shape, int size)
+  {
+    std::string extra;
+
+    switch (shape)
+    {
+      case MANY_HEADERS:
+        for (int ii = 0; ii < size; ++ii)
+        {
+          extra += "Accept-Contact: *;audio\r\n";
+        }
+        break;
+
+      case MANY_PARAMS:
+        extra = "Accept-Contact: *";
+
+        for (int ii = 0; ii < size; ++ii)
+        {
+          extra += ";p" + std::to_string(ii);
+        }
+
+        extra += "\r\n";
+        break;
+
+      case LONG_VALUE:
+        extra = "Accept-Contact: *;+g.3gpp.ics=\"" + std::string(size, 'x') +
+                "\"\r\n";
+        break;
+
+      default:
+        break;
+    }
+
+    return "INVITE sip:6505551234@homedomain SIP/2.0\r\n"
+      "Via: SIP/2.0/TCP 10.114.61.213;branch=z9hG4bK0123456789abcdef\r\n"
+      "From: <sip:6505551000@homedomain>;tag=10.114.61.213+1+8c8b232a+5fb751cf\r\n"
+      "To: <sip:6505551234@homedomain>\r\n"
+      "Max-Forwards: 68\r\n"
+      "Call-ID: 0gQAAC8WAAACBAAALxYAAAL8P3UbW8l4mT8YBkKGRKc5SOHaJ1gMRqsUOO4ohntC@10.114.61.213\r\n"
+      "CSeq: 16567 INVITE\r\n" +
+      extra +
+      "Content-Length: 0\r\n\r\n";
+  }
+
+  /// Parses a message into a pool.
+  static pjsip_msg* parse(pj_pool_t* pool, const std::string& text)
+  {
+    char* buf = (char*)pj_pool_alloc(pool, text.length() + 1);
+    memcpy(buf, text.c_str(), text.length() + 1);
+    return pjsip_parse_msg(pool, buf, text.length(), NULL);
+  }
+
+  /// Times scans of a request.
+  static ScanLatency time_scans(pjsip_msg* req,
+                                const GeminiUtils::ScanLimits& limits,
+                                int iterations)
+  {
+    std::vector<uint64_t> latencies(iterations);
+    int truncated;
+
+    for (int ii = 0; ii < iterations; ++ii)
+    {
+      std::chrono::steady_clock::time_point start =
+                                             std::chrono::steady_clock::now();
+      bool has_3gpp_ics =
+              GeminiUtils::accept_contact_has_3gpp_ics(req, limits, truncated);
+      std::chrono::steady_clock::time_point end =
+                                             std::chrono::steady_clock::now();
+
+      // Make sure the scan isn't optimised away.
+      EXPECT_FALSE(has_3gpp_ics);
+      latencies[ii] = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                       end - start).count();
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    ScanLatency latency;
+    latency.p50_ns = latencies[iterations / 2];
+    latency.p99_ns = latencies[(iterations * 99) / 100];
+    latency.max_ns = latencies[iterations - 1];
+    return latency;
+  }
+};
+
+TEST_F(AcceptContactBench, WorstCaseLatency)
+{
+  std::vector<int> sizes = env_ints("GEMINI_BENCH_SCAN_SIZES", "1,16,256,4096");
+  int iterations = std::max(1, env_int("GEMINI_BENCH_SCAN_ITERATIONS", 10000));
+
+  GeminiUtils::ScanLimits limited;
+  GeminiUtils::ScanLimits unlimited;
+  unlimited.max_headers = INT_MAX;
+  unlimited.max_params = INT_MAX;
+  unlimited.max_value_len = INT_MAX;
+
+  printf("\nScan limits: %d headers, %d params, %d value characters\n\n",
+         limited.max_headers, limited.max_params, limited.max_value_len);
+  printf("%-8s %6s | %10s %10s %10s | %10s %10s %10s | %s\n",
+         "Shape", "Size",
+         "p50 (ns)", "p99 (ns)", "max (ns)",
+         "p50 (ns)", "p99 (ns)", "max (ns)",
+         "Truncated");
+  printf("%-8s %6s | %32s | %32s |\n", "", "", "limited", "unlimited");
+
+  for (int shape = 0; shape < NUM_SHAPES; ++shape)
+  {
+    for (size_t ii = 0; ii < sizes.size(); ++ii)
+    {
+      pj_pool_t* pool =
+               pj_pool_create(&stack_data.cp.factory, "bench", 4000, 4000, NULL);
+      pjsip_msg* req = parse(pool, request_text((Shape)shape, sizes[ii]));
+      ASSERT_TRUE(req != NULL);
+
+      int truncated;
+      GeminiUtils::accept_contact_has_3gpp_ics(req, limited, truncated);
+
+      // Beyond the limits, the scan must have been cut short. The value
+      // scanned includes its quotes.
+      int limit[NUM_SHAPES] = {limited.max_headers,
+                               limited.max_params,
+                               limited.max_value_len};
+      GeminiScanLimit limit_reached[NUM_SHAPES] = {SCAN_LIMIT_HEADERS,
+                                                   SCAN_LIMIT_PARAMS,
+                                                   SCAN_LIMIT_VALUE_LEN};
+      int scanned = (shape == LONG_VALUE) ? sizes[ii] + 2 : sizes[ii];
+      EXPECT_EQ(scanned > limit[shape],
+                (truncated & (1 << limit_reached[shape])) != 0);
+
+      ScanLatency with_limits = time_scans(req, limited, iterations);
+      ScanLatency without_limits = time_scans(req, unlimited, iterations);
+
+      printf("%-8s %6d | %10lu %10lu %10lu | %10lu %10lu %10lu | 0x%x\n",
+             SHAPE_NAMES[shape],
+             sizes[ii],
+             with_limits.p50_ns,
+             with_limits.p99_ns,
+             with_limits.max_ns,
+             without_limits.p50_ns,
+             without_limits.p99_ns,
+             without_limits.max_ns,
+             truncated);
+
+      pj_pool_release(pool);
+    }
+  }
+}
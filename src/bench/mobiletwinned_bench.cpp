@@ -0,0 +1,887 @@
+/**
+ * @file mobiletwinned_bench.cpp Multi-core scaling benchmark for the mobile
+ * twinned AS which is part of gemini.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+// Drives MobileTwinnedAppServerTsx instances concurrently from 1..N threads
+// (all sharing one MobileTwinnedAppServer, as Sprout's worker threads do) and
+// reports throughput, scaling efficiency and, for each decision branch of
+// on_initial_request and on_response, the hardware performance counters
+// around it. A branch whose LLC misses per operation grow with the number of
+// threads is touching a cache line that other threads write to, which is
+// the signature of false sharing.
+//
+// The benchmark is configured through the environment:
+//
+//   GEMINI_BENCH_THREADS   - Maximum number of threads (default: number of
+//                            CPUs, capped at 16).
+//   GEMINI_BENCH_CALLS     - Calls per thread for each run (default 20000).
+//   GEMINI_BENCH_COUNTERS  - Set to 0 to skip reading the counters, to
+//                            measure throughput without the cost of reading
+//                            them (two syscalls per operation).
+//   GEMINI_BENCH_TRACE     - Set to 1 to attach a decision trace.
+//   GEMINI_BENCH_CACHE     - Set to 1 to attach a twin state cache (backed by
+//                            a LocalStore).
+//   GEMINI_BENCH_DETAILED_TIMINGS
+//                          - Set to 1 to also record the time to fail and
+//                            post-dial delay histograms.
+//   GEMINI_BENCH_WORKER    - Set to 1 to do the bookkeeping on a background
+//                            worker (WorkerVsInline always measures both).
+//   GEMINI_BENCH_DEDUP     - Set to 1 to attach a native fork dedup table.
+//   GEMINI_BENCH_MEMO      - Set to 1 to attach a SUBSCRIBE memo.
+//   GEMINI_BENCH_TENANTS   - Set to 1 to attach tenant accounting.
+//
+// Each call has its own Call-ID, so the dedup table sees distinct calls, but
+// every SUBSCRIBE is to the same subscriber, so the SUBSCRIBE memo is shared
+// between all the threads.
+//
+// No multi-thread results have been recorded yet. The bench has not been run
+// against a full Sprout build, so none of the shared state above has been
+// shown to scale. Record the results for each piece of state (and the
+// WorkerVsInline comparison) here once they have been collected on a
+// production-sized box.
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "gtest/gtest.h"
+
+#include "siptest.hpp"
+#include "mockappserver.hpp"
+#include "mobiletwinned.h"
+#include "stack.h"
+#include "pjutils.h"
+#include "localstore.h"
+#include "twinstatecache.h"
+#include "decisiontrace.h"
+#include "tenantaccounting.h"
+#include "subscribememo.h"
+#include "geminiworker.h"
+#include "nativeforkdedup.h"
+
+/// The hardware and software counters collected around each operation, read
+/// as a single group so that they cover exactly the same instructions.
+class PerfCounters
+{
+public:
+  enum Counter
+  {
+    CYCLES,
+    INSTRUCTIONS,
+    LLC_MISSES,
+    CONTEXT_SWITCHES,
+    NUM_COUNTERS
+  };
+
+  PerfCounters() :
+    _leader(-1),
+    _num_open(0)
+  {
+    for (int ii = 0; ii < NUM_COUNTERS; ++ii)
+    {
+      _fds[ii] = -1;
+      _index[ii] = -1;
+    }
+  }
+
+  ~PerfCounters()
+  {
+    for (int ii = 0; ii < NUM_COUNTERS; ++ii)
+    {
+      if (_fds[ii] >= 0)
+      {
+        close(_fds[ii]);
+      }
+    }
+  }
+
+  /// Opens the counters for the calling thread. Counters the kernel or
+  /// hardware won't provide (common in VMs and containers) read as zero.
+  ///
+  /// @returns whether the cycle counter (the group leader) could be opened.
+  bool open()
+  {
+    static const struct { uint32_t type; uint64_t config; bool user_only; }
+      COUNTERS[NUM_COUNTERS] =
+      {{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, true},
+       {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, true},
+       {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, true},
+       // Context switches happen in the kernel, so must count kernel events.
+       {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, false}};
+
+    for (int ii = 0; ii < NUM_COUNTERS; ++ii)
+    {
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = COUNTERS[ii].type;
+      attr.config = COUNTERS[ii].config;
+      attr.exclude_kernel = COUNTERS[ii].user_only;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_GROUP;
+
+      _fds[ii] = syscall(__NR_perf_event_open, &attr, 0, -1, _leader, 0);
+
+      if (_fds[ii] < 0)
+      {
+        if (ii == CYCLES)
+        {
+          return false;
+        }
+
+        continue;
+      }
+
+      if (ii == CYCLES)
+      {
+        _leader = _fds[ii];
+      }
+
+      // Values in a group read come back in the order the counters were
+      // added to the group.
+      _index[ii] = _num_open++;
+    }
+
+    return true;
+  }
+
+  /// Reads the current values of the counters.
+  void read(uint64_t values[NUM_COUNTERS])
+  {
+    uint64_t buf[1 + NUM_COUNTERS] = {0};
+
+    if ((_leader < 0) || (::read(_leader, buf, sizeof(buf)) <= 0))
+    {
+      memset(values, 0, NUM_COUNTERS * sizeof(uint64_t));
+      return;
+    }
+
+    for (int ii = 0; ii < NUM_COUNTERS; ++ii)
+    {
+      values[ii] = (_index[ii] >= 0) ? buf[1 + _index[ii]] : 0;
+    }
+  }
+
+private:
+  int _leader;
+  int _num_open;
+  int _fds[NUM_COUNTERS];
+  int _index[NUM_COUNTERS];
+};
+
+/// The decision branches measured. A response is RSP_RETRIED if on_response
+/// sent a new request, and RSP_FORWARDED otherwise.
+enum Branch
+{
+  REQ_FORKED,
+  REQ_TO_NATIVE_DEVICE,
+  REQ_TO_VOIP_CLIENT,
+  REQ_SUBSCRIBE,
+  RSP_FORWARDED,
+  RSP_RETRIED,
+  NUM_BRANCHES
+};
+
+static const char* BRANCH_NAMES[NUM_BRANCHES] =
+  {"req-forked", "req-to-native", "req-to-voip-client", "req-subscribe",
+   "rsp-forwarded", "rsp-retried"};
+
+/// The calls each thread makes, in rotation.
+enum Scenario
+{
+  // Forked to the VoIP clients and the native device, which rings before a
+  // VoIP client answers.
+  FORKED_ANSWERED,
+
+  // Forked to the VoIP clients and the native device, which is unavailable,
+  // so the call is retried to the mobile hosted VoIP clients.
+  FORKED_RETRIED,
+
+  // Sent to the native device only (Accept-Contact with g.3gpp.ics).
+  NATIVE_ONLY,
+
+  // Sent to a single VoIP client (Request URI with a gr parameter). These
+  // only reach a transaction if the AS isn't configured to pass them
+  // through, but the transaction is driven directly here.
+  VOIP_CLIENT,
+
+  // A SUBSCRIBE, which the VoIP client accepts. It's forked to both legs
+  // unless the SUBSCRIBE memo knows the VoIP client accepts them.
+  SUBSCRIBED,
+
+  NUM_SCENARIOS
+};
+
+/// Counts for a single branch.
+struct BranchResult
+{
+  uint64_t ops;
+  uint64_t counters[PerfCounters::NUM_COUNTERS];
+};
+
+/// Everything a thread measures during a run. Each thread fills in its own
+/// result, padded so the benchmark doesn't add false sharing of its own.
+struct ThreadResult
+{
+  BranchResult branches[NUM_BRANCHES];
+  uint64_t calls;
+  char padding[64];
+};
+
+/// Totals across all the threads of a run.
+struct RunResult
+{
+  int threads;
+  double calls_per_sec;
+  BranchResult branches[NUM_BRANCHES];
+};
+
+/// An AppServerTsxHelper that does the minimum work a Sproutlet would for
+/// the methods Gemini calls. These bypass gmock, which serialises every call
+/// to a mocked method on a global mutex and so would dominate the results.
+class BenchTsxHelper : public MockAppServerTsxHelper
+{
+public:
+  BenchTsxHelper(pj_pool_t* pool, pjsip_route_hdr* route) :
+    _pool(pool),
+    _route(route),
+    _original(NULL),
+    _next_fork_id(1),
+    _requests_sent(0)
+  {
+  }
+
+  /// Starts a new call, whose original request is req.
+  void start_call(pjsip_msg* req)
+  {
+    _original = req;
+    _next_fork_id = 1;
+  }
+
+  /// Returns the number of requests sent so far.
+  uint64_t requests_sent() const { return _requests_sent; }
+
+  pjsip_msg* original_request() override
+  {
+    return pjsip_msg_clone(_pool, _original);
+  }
+
+  const pjsip_route_hdr* route_hdr() const override
+  {
+    return _route;
+  }
+
+  pjsip_msg* clone_request(pjsip_msg* req) override
+  {
+    return pjsip_msg_clone(_pool, req);
+  }
+
+  pjsip_msg* create_response(pjsip_msg* req,
+                             pjsip_status_code status_code,
+                             const std::string& status_text) override
+  {
+    // None of the scenarios are rejected.
+    return NULL;
+  }
+
+  int send_request(pjsip_msg*& req) override
+  {
+    _requests_sent++;
+    return _next_fork_id++;
+  }
+
+  void send_response(pjsip_msg*& rsp) override
+  {
+  }
+
+  void free_msg(pjsip_msg*& msg) override
+  {
+  }
+
+  pj_pool_t* get_pool(const pjsip_msg* msg) override
+  {
+    return _pool;
+  }
+
+private:
+  pj_pool_t* _pool;
+  pjsip_route_hdr* _route;
+  pjsip_msg* _original;
+  int _next_fork_id;
+  uint64_t _requests_sent;
+};
+
+/// Fixture for the benchmark.
+///
+/// This derives from SipTest to ensure PJSIP is set up correctly, but doesn't
+/// actually use most of its function (and doesn't register a module).
+class MobileTwinnedBench : public SipTest
+{
+public:
+  static void SetUpTestCase()
+  {
+    SipTest::SetUpTestCase();
+  }
+
+  static void TearDownTestCase()
+  {
+    SipTest::TearDownTestCase();
+  }
+
+  MobileTwinnedBench() :
+    SipTest(NULL),
+    _as(NULL),
+    _store(NULL),
+    _cache(NULL),
+    _trace(NULL),
+    _accounting(NULL),
+    _memo(NULL),
+    _worker(NULL),
+    _dedup(NULL),
+    _counters_enabled(env_int("GEMINI_BENCH_COUNTERS", 1) != 0),
+    _counters_available(true)
+  {
+  }
+
+  /// Reads an integer from the environment.
+  static int env_int(const char* name, int default_value)
+  {
+    const char* value = getenv(name);
+    return (value != NULL) ? atoi(value) : default_value;
+  }
+
+  /// Creates the optional shared state selected in the environment, and
+  /// returns the configuration of an AS that uses it.
+  MobileTwinnedAppServer::Config configure(int max_threads);
+
+  /// Deletes the AS and the shared state.
+  void destroy();
+
+  /// Runs the given number of threads, each making calls_per_thread calls.
+  RunResult run(int threads, int calls_per_thread);
+
+  /// Runs the given numbers of threads in turn, after warming up.
+  std::vector<RunResult> scale(const std::vector<int>& thread_counts,
+                               int calls_per_thread);
+
+  /// The body of each thread.
+  void run_thread(int index,
+                  int calls,
+                  std::atomic<int>* ready,
+                  std::atomic<bool>* go,
+                  ThreadResult* result);
+
+  MobileTwinnedAppServer* _as;
+  LocalStore* _store;
+  TwinStateCache* _cache;
+  DecisionTrace* _trace;
+  TenantAccounting* _accounting;
+  SubscribeMemo* _memo;
+  GeminiWorker* _worker;
+  NativeForkDedup* _dedup;
+  bool _counters_enabled;
+  std::atomic<bool> _counters_available;
+};
+
+/// Builds the text of a request or response for a scenario.
+static std::string message_text(Scenario scenario, const char* status)
+{
+  std::string method = (scenario == SUBSCRIBED) ? "SUBSCRIBE" : "INVITE";
+  std::string first_line = (status == NULL) ?
+    method + " sip:6505551234@homedomain" +
+      ((scenario == VOIP_CLIENT) ? ";gr=hello" : "") + " SIP/2.0" :
+    std::string("SIP/2.0 ") + status;
+
+  return first_line + "\r\n"
+    "Via: SIP/2.0/TCP 10.114.61.213;branch=z9hG4bK0123456789abcdef\r\n"
+    "From: <sip:6505551000@homedomain>;tag=10.114.61.213+1+8c8b232a+5fb751cf\r\n"
+    "To: <sip:6505551234@homedomain>\r\n" +
+    ((scenario == NATIVE_ONLY) ?
+       "Accept-Contact: *;audio\r\n"
+       "Accept-Contact: *;+g.3gpp.ics=\"server,principal\"\r\n" : "") +
+    ((scenario == SUBSCRIBED) ? "Event: presence\r\n" : "") +
+    "Max-Forwards: 68\r\n"
+    "Call-ID: 0gQAAC8WAAACBAAALxYAAAL8P3UbW8l4mT8YBkKGRKc5SOHaJ1gMRqsUOO4ohntC@10.114.61.213\r\n"
+    "CSeq: 16567 " + method + "\r\n"
+    "User-Agent: Accession 2.0.0.0\r\n"
+    "Allow: PRACK, INVITE, ACK, BYE, CANCEL, UPDATE, SUBSCRIBE, NOTIFY, REFER, MESSAGE, OPTIONS\r\n"
+    "Content-Length: 0\r\n\r\n";
+}
+
+/// Parses a message into a pool. The parser is thread safe (unlike
+/// SipTest::parse_msg, which shares the stack pool).
+static pjsip_msg* parse(pj_pool_t* pool, const std::string& text)
+{
+  char* buf = (char*)pj_pool_alloc(pool, text.length() + 1);
+  memcpy(buf, text.c_str(), text.length() + 1);
+  return pjsip_parse_msg(pool, buf, text.length(), NULL);
+}
+
+void MobileTwinnedBench::run_thread(int index,
+                                    int calls,
+                                    std::atomic<int>* ready,
+                                    std::atomic<bool>* go,
+                                    ThreadResult* result)
+{
+  // PJSIP needs to know about every thread that uses it.
+  pj_thread_desc desc;
+  pj_thread_t* thread;
+  memset(desc, 0, sizeof(desc));
+  pj_thread_register("gemini_bench", desc, &thread);
+
+  // Pin the thread, so runs are repeatable and the number of threads is the
+  // number of cores in use.
+  int num_cpus = std::thread::hardware_concurrency();
+
+  if (num_cpus > 0)
+  {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(index % num_cpus, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  }
+
+  // Each thread has its own pools, like Sprout's worker threads. The
+  // templates live for the whole run, and the call pool is reset for each
+  // call.
+  pj_pool_t* template_pool =
+       pj_pool_create(&stack_data.cp.factory, "bench-templates", 4000, 4000, NULL);
+  pj_pool_t* call_pool =
+       pj_pool_create(&stack_data.cp.factory, "bench-call", 4000, 4000, NULL);
+
+  pjsip_route_hdr* route = pjsip_route_hdr_create(template_pool);
+  route->name_addr.uri = PJUtils::uri_from_string(
+                     "sip:mobile-twinned@gemini.homedomain;twin-prefix=111",
+                     template_pool);
+
+  pjsip_msg* requests[NUM_SCENARIOS];
+  for (int ii = 0; ii < NUM_SCENARIOS; ++ii)
+  {
+    requests[ii] = parse(template_pool, message_text((Scenario)ii, NULL));
+  }
+
+  pjsip_msg* rsp_180 = parse(template_pool, message_text(FORKED_ANSWERED, "180 Ringing"));
+  pjsip_msg* rsp_200 = parse(template_pool, message_text(FORKED_ANSWERED, "200 OK"));
+  pjsip_msg* rsp_480 = parse(template_pool, message_text(FORKED_ANSWERED, "480 Temporarily Unavailable"));
+  pjsip_msg* rsp_sub_200 = parse(template_pool, message_text(SUBSCRIBED, "200 OK"));
+
+  BenchTsxHelper helper(call_pool, route);
+  PerfCounters counters;
+
+  if ((_counters_enabled) && (!counters.open()))
+  {
+    _counters_available = false;
+  }
+
+  memset(result, 0, sizeof(*result));
+
+  uint64_t before[PerfCounters::NUM_COUNTERS] = {0};
+  uint64_t after[PerfCounters::NUM_COUNTERS] = {0};
+
+  // Measures a single operation, attributing it to a branch.
+  auto measure = [&](Branch branch, std::function<void()> op)
+  {
+    if (_counters_enabled)
+    {
+      counters.read(before);
+    }
+
+    op();
+
+    if (_counters_enabled)
+    {
+      counters.read(after);
+
+      for (int ii = 0; ii < PerfCounters::NUM_COUNTERS; ++ii)
+      {
+        result->branches[branch].counters[ii] += after[ii] - before[ii];
+      }
+    }
+
+    result->branches[branch].ops++;
+  };
+
+  // Sends a response to the transaction on a fork.
+  auto respond = [&](MobileTwinnedAppServerTsx& tsx, pjsip_msg* rsp, int fork_id)
+  {
+    pjsip_msg* clone = pjsip_msg_clone(call_pool, rsp);
+    uint64_t sent = helper.requests_sent();
+    uint64_t before_rsp[PerfCounters::NUM_COUNTERS] = {0};
+    uint64_t after_rsp[PerfCounters::NUM_COUNTERS] = {0};
+
+    if (_counters_enabled)
+    {
+      counters.read(before_rsp);
+    }
+
+    tsx.on_response(clone, fork_id);
+
+    if (_counters_enabled)
+    {
+      counters.read(after_rsp);
+    }
+
+    // We only know which branch we took once it's done.
+    Branch branch = (helper.requests_sent() > sent) ? RSP_RETRIED : RSP_FORWARDED;
+
+    for (int ii = 0; ii < PerfCounters::NUM_COUNTERS; ++ii)
+    {
+      result->branches[branch].counters[ii] += after_rsp[ii] - before_rsp[ii];
+    }
+
+    result->branches[branch].ops++;
+  };
+
+  (*ready)++;
+
+  while (!go->load())
+  {
+  }
+
+  for (int call = 0; call < calls; ++call)
+  {
+    Scenario scenario = (Scenario)(call % NUM_SCENARIOS);
+    pj_pool_reset(call_pool);
+
+    pjsip_msg* req = pjsip_msg_clone(call_pool, requests[scenario]);
+    pjsip_msg* original = pjsip_msg_clone(call_pool, requests[scenario]);
+    char call_id[64];
+    snprintf(call_id, sizeof(call_id), "bench-%d-%d@10.114.61.213", index, call);
+    pj_strdup2(call_pool, &PJSIP_MSG_CID_HDR(req)->id, call_id);
+    pj_strdup2(call_pool, &PJSIP_MSG_CID_HDR(original)->id, call_id);
+    helper.start_call(original);
+
+    MobileTwinnedAppServerTsx tsx(_as);
+    tsx.set_helper(&helper);
+
+    // The VoIP fork is always sent first (fork 1), followed by the native
+    // fork (fork 2) and any retry to the mobile hosted VoIP clients.
+    switch (scenario)
+    {
+      case FORKED_ANSWERED:
+        measure(REQ_FORKED, [&]() { tsx.on_initial_request(req); });
+        respond(tsx, rsp_180, 2);
+        respond(tsx, rsp_200, 1);
+        break;
+
+      case FORKED_RETRIED:
+        measure(REQ_FORKED, [&]() { tsx.on_initial_request(req); });
+        respond(tsx, rsp_480, 2);
+        respond(tsx, rsp_200, 3);
+        break;
+
+      case NATIVE_ONLY:
+        measure(REQ_TO_NATIVE_DEVICE, [&]() { tsx.on_initial_request(req); });
+        respond(tsx, rsp_200, 1);
+        break;
+
+      case SUBSCRIBED:
+        // The VoIP fork is first whether or not the SUBSCRIBE is forked.
+        measure(REQ_SUBSCRIBE, [&]() { tsx.on_initial_request(req); });
+        respond(tsx, rsp_sub_200, 1);
+        break;
+
+      case VOIP_CLIENT:
+      default:
+        measure(REQ_TO_VOIP_CLIENT, [&]() { tsx.on_initial_request(req); });
+        respond(tsx, rsp_200, 1);
+        break;
+    }
+
+    result->calls++;
+  }
+
+  pj_pool_release(call_pool);
+  pj_pool_release(template_pool);
+}
+
+RunResult MobileTwinnedBench::run(int threads, int calls_per_thread)
+{
+  std::vector<ThreadResult> results(threads);
+  std::vector<std::thread> workers;
+  std::atomic<int> ready(0);
+  std::atomic<bool> go(false);
+
+  for (int ii = 0; ii < threads; ++ii)
+  {
+    workers.push_back(std::thread(&MobileTwinnedBench::run_thread,
+                                  this,
+                                  ii,
+                                  calls_per_thread,
+                                  &ready,
+                                  &go,
+                                  &results[ii]));
+  }
+
+  // Start all the threads together, once they've set up.
+  while (ready.load() < threads)
+  {
+    std::this_thread::yield();
+  }
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  go = true;
+
+  for (size_t ii = 0; ii < workers.size(); ++ii)
+  {
+    workers[ii].join();
+  }
+
+  double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                              start).count();
+
+  RunResult run_result;
+  memset(&run_result, 0, sizeof(run_result));
+  run_result.threads = threads;
+  uint64_t calls = 0;
+
+  for (int ii = 0; ii < threads; ++ii)
+  {
+    calls += results[ii].calls;
+
+    for (int branch = 0; branch < NUM_BRANCHES; ++branch)
+    {
+      run_result.branches[branch].ops += results[ii].branches[branch].ops;
+
+      for (int counter = 0; counter < PerfCounters::NUM_COUNTERS; ++counter)
+      {
+        run_result.branches[branch].counters[counter] +=
+                                results[ii].branches[branch].counters[counter];
+      }
+    }
+  }
+
+  run_result.calls_per_sec = (secs > 0) ? (calls / secs) : 0;
+  return run_result;
+}
+
+MobileTwinnedAppServer::Config MobileTwinnedBench::configure(int max_threads)
+{
+  MobileTwinnedAppServer::Config config;
+
+  if (env_int("GEMINI_BENCH_CACHE", 0) != 0)
+  {
+    _store = new LocalStore();
+    _cache = new TwinStateCache(_store);
+    config.twin_state_cache = _cache;
+  }
+
+  if (env_int("GEMINI_BENCH_TRACE", 0) != 0)
+  {
+    _trace = new DecisionTrace("", max_threads + 1);
+    config.decision_trace = _trace;
+  }
+
+  if (env_int("GEMINI_BENCH_TENANTS", 0) != 0)
+  {
+    _accounting = new TenantAccounting();
+    config.tenant_accounting = _accounting;
+  }
+
+  if (env_int("GEMINI_BENCH_MEMO", 0) != 0)
+  {
+    _memo = new SubscribeMemo();
+    config.subscribe_memo = _memo;
+  }
+
+  if (env_int("GEMINI_BENCH_WORKER", 0) != 0)
+  {
+    _worker = new GeminiWorker();
+    config.worker = _worker;
+  }
+
+  if (env_int("GEMINI_BENCH_DEDUP", 0) != 0)
+  {
+    _dedup = new NativeForkDedup();
+    config.native_fork_dedup = _dedup;
+  }
+
+  config.detailed_timings = (env_int("GEMINI_BENCH_DETAILED_TIMINGS", 0) != 0);
+
+  return config;
+}
+
+void MobileTwinnedBench::destroy()
+{
+  delete _as; _as = NULL;
+
+  // The worker completes its queued bookkeeping, on the shared state, as
+  // it's deleted, so goes first.
+  delete _worker; _worker = NULL;
+  delete _dedup; _dedup = NULL;
+  delete _memo; _memo = NULL;
+  delete _accounting; _accounting = NULL;
+  delete _trace; _trace = NULL;
+  delete _cache; _cache = NULL;
+  delete _store; _store = NULL;
+}
+
+std::vector<RunResult> MobileTwinnedBench::scale(
+                                        const std::vector<int>& thread_counts,
+                                        int calls_per_thread)
+{
+  // Warm up, so the first run doesn't pay for faulting in pools and code.
+  run(1, calls_per_thread / 10);
+
+  std::vector<RunResult> results;
+  for (size_t ii = 0; ii < thread_counts.size(); ++ii)
+  {
+    results.push_back(run(thread_counts[ii], calls_per_thread));
+  }
+
+  return results;
+}
+
+/// Returns the numbers of threads to run - going up in powers of two, ending
+/// at the maximum.
+static std::vector<int> thread_counts(int max_threads)
+{
+  std::vector<int> counts;
+  for (int threads = 1; threads < max_threads; threads *= 2)
+  {
+    counts.push_back(threads);
+  }
+  counts.push_back(max_threads);
+  return counts;
+}
+
+/// Returns a counter value per operation.
+static double per_op(const BranchResult& branch, int counter)
+{
+  return (branch.ops > 0) ? ((double)branch.counters[counter] / branch.ops) : 0;
+}
+
+TEST_F(MobileTwinnedBench, Scaling)
+{
+  int num_cpus = std::thread::hardware_concurrency();
+  int max_threads = env_int("GEMINI_BENCH_THREADS",
+                            (num_cpus > 0) ? std::min(num_cpus, 16) : 4);
+  int calls = env_int("GEMINI_BENCH_CALLS", 20000);
+
+  // Attach any optional shared state we've been asked to measure.
+  _as = new MobileTwinnedAppServer("mobile-twinned", configure(max_threads));
+  std::vector<RunResult> results = scale(thread_counts(max_threads), calls);
+
+  printf("\nThroughput (%d calls per thread%s)\n", calls,
+         _counters_enabled ? ", including the cost of reading counters" : "");
+  printf("%8s %14s %12s\n", "threads", "calls/sec", "efficiency");
+
+  for (size_t ii = 0; ii < results.size(); ++ii)
+  {
+    // Efficiency is the throughput relative to perfect linear scaling from a
+    // single thread.
+    double efficiency = results[ii].calls_per_sec /
+                        (results[ii].threads * results[0].calls_per_sec);
+    printf("%8d %14.0f %11.1f%%\n",
+           results[ii].threads, results[ii].calls_per_sec, efficiency * 100);
+  }
+
+  if ((_counters_enabled) && (!_counters_available))
+  {
+    printf("\nPerformance counters are unavailable (check "
+           "/proc/sys/kernel/perf_event_paranoid)\n");
+  }
+  else if (_counters_enabled)
+  {
+    printf("\nPer operation, by branch\n");
+    printf("%-20s %8s %10s %6s %10s %12s %12s\n",
+           "branch", "threads", "cycles", "IPC", "LLC-miss", "ctx-sw/1k", "LLC-growth");
+
+    for (int branch = 0; branch < NUM_BRANCHES; ++branch)
+    {
+      double base_misses = per_op(results[0].branches[branch],
+                                  PerfCounters::LLC_MISSES);
+
+      for (size_t ii = 0; ii < results.size(); ++ii)
+      {
+        const BranchResult& result = results[ii].branches[branch];
+        double cycles = per_op(result, PerfCounters::CYCLES);
+        double instructions = per_op(result, PerfCounters::INSTRUCTIONS);
+        double misses = per_op(result, PerfCounters::LLC_MISSES);
+        double switches = per_op(result, PerfCounters::CONTEXT_SWITCHES) * 1000;
+
+        // LLC misses per operation growing with the number of threads, when
+        // each thread works on its own messages, means cache lines are
+        // bouncing between cores - flag it as a potential hotspot.
+        double growth = (base_misses > 0) ? (misses / base_misses) : 0;
+        bool hotspot = ((growth > 2.0) && (misses > 1.0));
+
+        printf("%-20s %8d %10.0f %6.2f %10.2f %12.3f %11.1fx%s\n",
+               (ii == 0) ? BRANCH_NAMES[branch] : "",
+               results[ii].threads,
+               cycles,
+               (cycles > 0) ? (instructions / cycles) : 0,
+               misses,
+               switches,
+               growth,
+               hotspot ? "  <- possible false sharing" : "");
+      }
+    }
+  }
+
+  destroy();
+}
+
+// Compares doing the bookkeeping inline on the transaction's thread with
+// handing it to the background worker, with the same shared state attached.
+// The worker only takes the SAS events and the updates to the twin state
+// cache and SUBSCRIBE memo, so attach those to see what it saves.
+TEST_F(MobileTwinnedBench, WorkerVsInline)
+{
+  int num_cpus = std::thread::hardware_concurrency();
+  int max_threads = env_int("GEMINI_BENCH_THREADS",
+                            (num_cpus > 0) ? std::min(num_cpus, 16) : 4);
+  int calls = env_int("GEMINI_BENCH_CALLS", 20000);
+  std::vector<int> counts = thread_counts(max_threads);
+  MobileTwinnedAppServer::Config config = configure(max_threads);
+
+  config.worker = NULL;
+  _as = new MobileTwinnedAppServer("mobile-twinned", config);
+  std::vector<RunResult> inline_results = scale(counts, calls);
+  delete _as; _as = NULL;
+
+  if (_worker == NULL)
+  {
+    _worker = new GeminiWorker();
+  }
+
+  config.worker = _worker;
+  _as = new MobileTwinnedAppServer("mobile-twinned", config);
+  std::vector<RunResult> worker_results = scale(counts, calls);
+
+  printf("\nBookkeeping inline and on the worker (%d calls per thread%s)\n",
+         calls,
+         _counters_enabled ? ", including the cost of reading counters" : "");
+  printf("%8s %14s %14s %8s\n", "threads", "inline/sec", "worker/sec", "gain");
+
+  for (size_t ii = 0; ii < counts.size(); ++ii)
+  {
+    double inline_rate = inline_results[ii].calls_per_sec;
+    double worker_rate = worker_results[ii].calls_per_sec;
+    printf("%8d %14.0f %14.0f %7.1f%%\n",
+           counts[ii],
+           inline_rate,
+           worker_rate,
+           (inline_rate > 0) ? ((worker_rate / inline_rate - 1) * 100) : 0);
+  }
+
+  destroy();
+}
@@ -0,0 +1,425 @@
+/**
+ * @file decisiontrace.cpp Implementation of the always-on binary trace of the
+ * decisions made by gemini transactions.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <new>
+#include <algorithm>
+#include <unordered_map>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "decisiontrace.h"
+
+const char DecisionTrace::MAGIC[8] = {'G', 'E', 'M', 'T', 'R', 'A', 'C', 'E'};
+
+std::atomic<uint64_t> DecisionTrace::_next_id(1);
+
+/// The trace header is padded to a cache line.
+static const size_t HEADER_BYTES = 64;
+
+/// The ring most recently used by this thread, and the trace it belongs to.
+static thread_local uint64_t t_trace_id = 0;
+static thread_local void* t_ring = NULL;
+
+/// The ring this thread has in every trace it has written to, by the ID of
+/// the trace, so that a thread alternating between traces keeps writing to
+/// the same ring in each. IDs are never reused, so the entries of traces
+/// that have been destroyed are never looked up again.
+static thread_local std::unordered_map<uint64_t, void*> t_rings_by_id;
+
+/// The trace to write out if the process crashes, and the file to dump it
+/// to (if any).
+static std::atomic<DecisionTrace*> s_crash_trace(NULL);
+static char s_crash_path[PATH_MAX];
+
+/// The fatal signals the trace is written out on, and the handlers that
+/// were installed for them before.
+static const int CRASH_SIGNALS[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT};
+static const int NUM_CRASH_SIGNALS = sizeof(CRASH_SIGNALS) /
+                                     sizeof(CRASH_SIGNALS[0]);
+static struct sigaction s_old_actions[NUM_CRASH_SIGNALS];
+static pthread_once_t s_crash_handlers_once = PTHREAD_ONCE_INIT;
+
+static void crash_handler(int signum)
+{
+  DecisionTrace* trace = s_crash_trace.load();
+
+  if (trace != NULL)
+  {
+    if (s_crash_path[0] != '\0')
+    {
+      trace->dump(s_crash_path);
+    }
+    else
+    {
+      trace->sync();
+    }
+  }
+
+  // Put back the previous handler and raise the signal again for it. The
+  // signal is blocked until we return, when it's delivered to that handler.
+  for (int ii = 0; ii < NUM_CRASH_SIGNALS; ++ii)
+  {
+    if (CRASH_SIGNALS[ii] == signum)
+    {
+      sigaction(signum, &s_old_actions[ii], NULL);
+    }
+  }
+
+  raise(signum);
+}
+
+static void install_crash_handlers()
+{
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = crash_handler;
+  sigemptyset(&action.sa_mask);
+
+  for (int ii = 0; ii < NUM_CRASH_SIGNALS; ++ii)
+  {
+    sigaction(CRASH_SIGNALS[ii], &action, &s_old_actions[ii]);
+  }
+}
+
+DecisionTrace::DecisionTrace(const std::string& file,
+                             uint32_t num_rings,
+                             uint32_t ring_size) :
+  _fd(-1),
+  _num_rings(num_rings),
+  _ring_size(1),
+  _size(0),
+  _base(NULL),
+  _id(_next_id++),
+  _next_ring(0),
+  _dropped_records(0)
+{
+  // Ring sizes are a power of two so that records can be indexed by masking
+  // the head.
+  while (_ring_size < ring_size)
+  {
+    _ring_size <<= 1;
+  }
+
+  _size = HEADER_BYTES + (_num_rings * ring_bytes(_ring_size));
+
+  if (!file.empty())
+  {
+    _fd = open(file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if ((_fd < 0) || (ftruncate(_fd, _size) != 0))
+    {
+      TRC_ERROR("Failed to create decision trace file %s: %s",
+                file.c_str(), strerror(errno));
+
+      if (_fd >= 0)
+      {
+        close(_fd);
+        _fd = -1;
+      }
+
+      return;
+    }
+
+    _base = (char*)mmap(NULL, _size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+  }
+  else
+  {
+    _base = (char*)mmap(NULL,
+                        _size,
+                        PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1,
+                        0);
+  }
+
+  if (_base == MAP_FAILED)
+  {
+    TRC_ERROR("Failed to map decision trace: %s", strerror(errno));
+    _base = NULL;
+    return;
+  }
+
+  Header* header = (Header*)_base;
+  memcpy(header->magic, MAGIC, sizeof(MAGIC));
+  header->version = VERSION;
+  header->num_rings = _num_rings;
+  header->ring_size = _ring_size;
+  header->record_size = sizeof(DecisionRecord);
+
+  for (uint32_t ii = 0; ii < _num_rings; ++ii)
+  {
+    new (&ring(ii)->head) std::atomic<uint64_t>(0);
+  }
+}
+
+DecisionTrace::~DecisionTrace()
+{
+  DecisionTrace* trace = this;
+  s_crash_trace.compare_exchange_strong(trace, NULL);
+
+  if (_base != NULL)
+  {
+    munmap(_base, _size);
+  }
+
+  if (_fd >= 0)
+  {
+    close(_fd);
+  }
+}
+
+void DecisionTrace::record(uint64_t trail,
+                           Event event,
+                           int32_t fork_id,
+                           uint16_t status_code)
+{
+  if (_base == NULL)
+  {
+    return;
+  }
+
+  RingHeader* ring = ring_for_this_thread();
+
+  if (ring == NULL)
+  {
+    _dropped_records++;
+    return;
+  }
+
+  // This thread is the only writer to the ring, so we can fill in the next
+  // record and then publish it by moving the head on.
+  uint64_t head = ring->head.load(std::memory_order_relaxed);
+  DecisionRecord* record =
+                  (DecisionRecord*)(ring + 1) + (head & (_ring_size - 1));
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  record->timestamp_ns = ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+  record->trail = trail;
+  record->event = event;
+  record->status_code = status_code;
+  record->fork_id = fork_id;
+
+  ring->head.store(head + 1, std::memory_order_release);
+}
+
+void DecisionTrace::sync()
+{
+  if ((_base != NULL) && (_fd >= 0))
+  {
+    msync(_base, _size, MS_ASYNC);
+  }
+}
+
+void DecisionTrace::dump_on_crash(const std::string& path)
+{
+  // Stop writing out any trace while we change the file.
+  s_crash_trace.store(NULL);
+  strncpy(s_crash_path, path.c_str(), sizeof(s_crash_path) - 1);
+  s_crash_path[sizeof(s_crash_path) - 1] = '\0';
+
+  pthread_once(&s_crash_handlers_once, install_crash_handlers);
+  s_crash_trace.store(this);
+}
+
+bool DecisionTrace::dump(const char* path)
+{
+  if (_base == NULL)
+  {
+    return false;
+  }
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+  if (fd < 0)
+  {
+    return false;
+  }
+
+  size_t written = 0;
+
+  while (written < _size)
+  {
+    ssize_t rc = write(fd, _base + written, _size - written);
+
+    if (rc < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+
+      break;
+    }
+
+    written += rc;
+  }
+
+  close(fd);
+  return (written == _size);
+}
+
+bool DecisionTrace::load(const std::string& path,
+                         std::vector<DecisionRecord>& records)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+
+  if (fd < 0)
+  {
+    return false;
+  }
+
+  struct stat st;
+  bool valid = false;
+  char* base = (char*)MAP_FAILED;
+
+  if ((fstat(fd, &st) == 0) && ((size_t)st.st_size >= HEADER_BYTES))
+  {
+    base = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+
+  if (base != MAP_FAILED)
+  {
+    Header* header = (Header*)base;
+    size_t bytes_per_ring = ring_bytes(header->ring_size);
+
+    valid = ((memcmp(header->magic, MAGIC, sizeof(MAGIC)) == 0) &&
+             (header->version == VERSION) &&
+             (header->record_size == sizeof(DecisionRecord)) &&
+             (header->ring_size != 0) &&
+             ((header->ring_size & (header->ring_size - 1)) == 0) &&
+             ((size_t)st.st_size >=
+                       HEADER_BYTES + (header->num_rings * bytes_per_ring)));
+
+    for (uint32_t ii = 0; valid && (ii < header->num_rings); ++ii)
+    {
+      char* ring_base = base + HEADER_BYTES + (ii * bytes_per_ring);
+      RingHeader* ring = (RingHeader*)ring_base;
+      DecisionRecord* ring_records = (DecisionRecord*)(ring + 1);
+
+      // The writer fills in the slot after the head before moving the head
+      // on, so skip that slot (which holds the oldest record once the ring
+      // is full).
+      uint64_t head = ring->head.load(std::memory_order_acquire);
+      uint64_t count = std::min(head, (uint64_t)header->ring_size - 1);
+      size_t first = records.size();
+
+      for (uint64_t jj = head - count; jj < head; ++jj)
+      {
+        records.push_back(ring_records[jj & (header->ring_size - 1)]);
+      }
+
+      // If the file is still being written to, the writer may have moved
+      // on while we were copying. Drop any records it could have started
+      // overwriting.
+      std::atomic_thread_fence(std::memory_order_acquire);
+      uint64_t new_head = ring->head.load(std::memory_order_relaxed);
+
+      if (new_head - head + count >= header->ring_size)
+      {
+        uint64_t overwritten = new_head - head + count -
+                               header->ring_size + 1;
+        overwritten = std::min(overwritten, count);
+        records.erase(records.begin() + first,
+                      records.begin() + first + overwritten);
+      }
+    }
+
+    munmap(base, st.st_size);
+  }
+
+  close(fd);
+
+  std::stable_sort(records.begin(),
+                   records.end(),
+                   [](const DecisionRecord& a, const DecisionRecord& b)
+                   {
+                     return a.timestamp_ns < b.timestamp_ns;
+                   });
+
+  return valid;
+}
+
+const char* DecisionTrace::event_name(uint16_t event)
+{
+  switch (event)
+  {
+    case REQ_NOT_SIP:             return "REQ_NOT_SIP";
+    case REQ_TO_VOIP_CLIENT:      return "REQ_TO_VOIP_CLIENT";
+    case REQ_TO_NATIVE_DEVICE:    return "REQ_TO_NATIVE_DEVICE";
+    case REQ_FORKED:              return "REQ_FORKED";
+    case REQ_NATIVE_UNREACHABLE:  return "REQ_NATIVE_UNREACHABLE";
+    case FORK_TO_VOIP:            return "FORK_TO_VOIP";
+    case FORK_TO_NATIVE:          return "FORK_TO_NATIVE";
+    case FORK_TO_MOBILE_VOIP:     return "FORK_TO_MOBILE_VOIP";
+    case RSP_RECEIVED:            return "RSP_RECEIVED";
+    case RETRY_ON_480:            return "RETRY_ON_480";
+    case NO_RETRY_ON_480:         return "NO_RETRY_ON_480";
+    case REQ_TEL_URI_CONVERTED:   return "REQ_TEL_URI_CONVERTED";
+    case REQ_PASSED_THROUGH:      return "REQ_PASSED_THROUGH";
+    case REQ_TO_MEMOISED_LEG:     return "REQ_TO_MEMOISED_LEG";
+    case MEMO_FALLBACK:           return "MEMO_FALLBACK";
+    case REQ_NATIVE_DUPLICATE:    return "REQ_NATIVE_DUPLICATE";
+    default:                      return "UNKNOWN";
+  }
+}
+
+DecisionTrace::RingHeader* DecisionTrace::ring(uint32_t index)
+{
+  return (RingHeader*)(_base + HEADER_BYTES + (index * ring_bytes(_ring_size)));
+}
+
+DecisionTrace::RingHeader* DecisionTrace::ring_for_this_thread()
+{
+  if (t_trace_id == _id)
+  {
+    return (RingHeader*)t_ring;
+  }
+
+  std::unordered_map<uint64_t, void*>::iterator it = t_rings_by_id.find(_id);
+
+  if (it != t_rings_by_id.end())
+  {
+    t_ring = it->second;
+  }
+  else
+  {
+    // This thread hasn't written to this trace before, so claim it a ring.
+    uint32_t index = _next_ring++;
+    t_ring = (index < _num_rings) ? ring(index) : NULL;
+    t_rings_by_id[_id] = t_ring;
+
+    if (t_ring == NULL)
+    {
+      TRC_WARNING("No space in the decision trace for another thread");
+    }
+  }
+
+  t_trace_id = _id;
+  return (RingHeader*)t_ring;
+}
+
+size_t DecisionTrace::ring_bytes(uint32_t ring_size)
+{
+  // Keep each ring cache line aligned.
+  size_t bytes = sizeof(RingHeader) + (ring_size * sizeof(DecisionRecord));
+  return (bytes + 63) & ~(size_t)63;
+}
@@ -0,0 +1,103 @@
+/**
+ * @file geministats.cpp Statistics collected by the gemini AS.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "geministats.h"
+
+GeminiHistogram::GeminiHistogram() :
+  _count(0),
+  _sum(0)
+{
+  for (int ii = 0; ii < NUM_BUCKETS; ++ii)
+  {
+    _buckets[ii].store(0, std::memory_order_relaxed);
+  }
+}
+
+void GeminiHistogram::record(uint64_t value)
+{
+  _buckets[bucket_index(value)].fetch_add(1, std::memory_order_relaxed);
+  _count.fetch_add(1, std::memory_order_relaxed);
+  _sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+uint64_t GeminiHistogram::percentile(double percentile) const
+{
+  uint64_t total = count();
+
+  if (total == 0)
+  {
+    return 0;
+  }
+
+  // Find the bucket holding the value at the requested rank.
+  uint64_t rank = (uint64_t)((percentile / 100.0) * total);
+  rank = (rank == 0) ? 1 : ((rank > total) ? total : rank);
+  uint64_t seen = 0;
+
+  for (int ii = 0; ii < NUM_BUCKETS; ++ii)
+  {
+    seen += bucket(ii);
+
+    if (seen >= rank)
+    {
+      return (ii == 0) ? 0 : ((1ull << ii) - 1);
+    }
+  }
+
+  // Only possible if values were recorded while we were counting.
+  return (1ull << (NUM_BUCKETS - 1)) - 1;
+}
+
+int GeminiHistogram::bucket_index(uint64_t value)
+{
+  int index = (value == 0) ? 0 : (64 - __builtin_clzll(value));
+  return (index < NUM_BUCKETS) ? index : (NUM_BUCKETS - 1);
+}
+
+GeminiShadowStats::GeminiShadowStats()
+{
+}
+
+GeminiStats::GeminiStats()
+{
+}
+
+const char* GeminiStats::leg_type_name(GeminiLegType leg_type)
+{
+  switch (leg_type)
+  {
+    case LEG_VOIP:          return "voip";
+    case LEG_NATIVE:        return "native";
+    case LEG_MOBILE_VOIP:   return "mobile-voip";
+    default:                return "unknown";
+  }
+}
+
+const char* GeminiStats::shadow_policy_name(GeminiShadowPolicy policy)
+{
+  switch (policy)
+  {
+    case SHADOW_PARALLEL_FORK:  return "parallel-fork";
+    case SHADOW_HEDGED_RETRY:   return "hedged-retry";
+    default:                    return "unknown";
+  }
+}
+
+const char* GeminiStats::scan_limit_name(GeminiScanLimit limit)
+{
+  switch (limit)
+  {
+    case SCAN_LIMIT_HEADERS:    return "headers";
+    case SCAN_LIMIT_PARAMS:     return "params";
+    case SCAN_LIMIT_VALUE_LEN:  return "value-length";
+    default:                    return "unknown";
+  }
+}
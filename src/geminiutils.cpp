@@ -0,0 +1,297 @@
+/**
+ * @file geminiutils.cpp Utility functions shared by the gemini AS.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <ctype.h>
+#include <string.h>
+
+#include "geminiutils.h"
+#include "custom_headers.h"
+#include "constants.h"
+
+static const char PHONE_CONTEXT[] = ";phone-context=";
+
+/// Returns whether a character is a visual separator in a telephone number.
+static inline bool is_visual_separator(char c)
+{
+  return ((c == '-') || (c == '.') || (c == '(') || (c == ')'));
+}
+
+int GeminiUtils::normalise_number(const char* number,
+                                  int number_len,
+                                  char* out,
+                                  int out_len)
+{
+  bool global = ((number_len > 0) && (number[0] == '+'));
+  int out_pos = 0;
+  int digits = 0;
+
+  for (int ii = 0; ii < number_len; ++ii)
+  {
+    char c = number[ii];
+
+    if ((ii == 0) && (global))
+    {
+      // Keep the leading '+' of a global number.
+    }
+    else if (is_visual_separator(c))
+    {
+      continue;
+    }
+    else if ((isdigit((unsigned char)c)) ||
+             ((!global) &&
+              ((c == '*') || (c == '#') || (isxdigit((unsigned char)c)))))
+    {
+      c = toupper((unsigned char)c);
+      digits++;
+    }
+    else
+    {
+      return -1;
+    }
+
+    if (out_pos >= out_len)
+    {
+      return -1;
+    }
+
+    out[out_pos++] = c;
+  }
+
+  return (digits > 0) ? out_pos : -1;
+}
+
+int GeminiUtils::tel_to_sip_user(const char* number,
+                                 int number_len,
+                                 const char* context,
+                                 int context_len,
+                                 char* out,
+                                 int out_len)
+{
+  if ((number_len > 0) && (number[0] == '+'))
+  {
+    // A global number - the phone-context (if any) is irrelevant.
+    return normalise_number(number, number_len, out, out_len);
+  }
+
+  if ((context_len > 0) && (context[0] == '+'))
+  {
+    // A local number in the context of a global number prefix, so the
+    // equivalent global number is the prefix followed by the local number.
+    int prefix_len = normalise_number(context, context_len, out, out_len);
+
+    if (prefix_len < 0)
+    {
+      return -1;
+    }
+
+    int local_len = normalise_number(number,
+                                     number_len,
+                                     out + prefix_len,
+                                     out_len - prefix_len);
+
+    if (local_len < 0)
+    {
+      return -1;
+    }
+
+    // The result has to be a valid global number.
+    for (int ii = prefix_len; ii < prefix_len + local_len; ++ii)
+    {
+      if (!isdigit((unsigned char)out[ii]))
+      {
+        return -1;
+      }
+    }
+
+    return prefix_len + local_len;
+  }
+
+  // A local number in the context of a domain (or with no context). Keep the
+  // context as part of the user.
+  int len = normalise_number(number, number_len, out, out_len);
+
+  if ((len < 0) || (context_len == 0))
+  {
+    return len;
+  }
+
+  int phone_context_len = sizeof(PHONE_CONTEXT) - 1;
+
+  if (len + phone_context_len + context_len > out_len)
+  {
+    return -1;
+  }
+
+  memcpy(out + len, PHONE_CONTEXT, phone_context_len);
+  len += phone_context_len;
+  memcpy(out + len, context, context_len);
+  len += context_len;
+
+  return len;
+}
+
+int GeminiUtils::append_tel_param(const char* name,
+                                  int name_len,
+                                  const char* value,
+                                  int value_len,
+                                  char* out,
+                                  int len,
+                                  int out_len)
+{
+  int param_len = 1 + name_len + ((value_len > 0) ? (1 + value_len) : 0);
+
+  if ((len < 0) || (name_len == 0) || (len + param_len > out_len))
+  {
+    return -1;
+  }
+
+  out[len++] = ';';
+  memcpy(out + len, name, name_len);
+  len += name_len;
+
+  if (value_len > 0)
+  {
+    out[len++] = '=';
+    memcpy(out + len, value, value_len);
+    len += value_len;
+  }
+
+  return len;
+}
+
+bool GeminiUtils::tag_matches(const pj_str_t* str, const GeminiTag& tag)
+{
+  return ((str->slen == tag.str.slen) &&
+          (pj_strnicmp(str, &tag.str, tag.str.slen) == 0));
+}
+
+bool GeminiUtils::accept_contact_has_3gpp_ics(const pjsip_msg* req,
+                                              const ScanLimits& limits,
+                                              int& truncated)
+{
+  truncated = 0;
+  int headers = 0;
+  int params = 0;
+  pjsip_accept_contact_hdr* accept_header =
+      (pjsip_accept_contact_hdr*)pjsip_msg_find_hdr_by_name(req,
+                                                            &STR_ACCEPT_CONTACT,
+                                                            NULL);
+
+  while (accept_header != NULL)
+  {
+    if (headers++ >= limits.max_headers)
+    {
+      truncated |= (1 << SCAN_LIMIT_HEADERS);
+      return false;
+    }
+
+    for (pjsip_param* feature_param = accept_header->feature_set.next;
+         feature_param != &accept_header->feature_set;
+         feature_param = feature_param->next)
+    {
+      if (params++ >= limits.max_params)
+      {
+        truncated |= (1 << SCAN_LIMIT_PARAMS);
+        return false;
+      }
+
+      // The name is rejected on its length before its contents are looked
+      // at, so the parameters that aren't g.3gpp.ics cost almost nothing.
+      if (!tag_matches(&feature_param->name, TAG_3GPP_ICS))
+      {
+        continue;
+      }
+
+      pj_str_t value = feature_param->value;
+
+      if (value.slen > limits.max_value_len)
+      {
+        truncated |= (1 << SCAN_LIMIT_VALUE_LEN);
+        value.slen = limits.max_value_len;
+      }
+
+      if ((pj_strstr(&value, &TAG_SERVER.str) != NULL) ||
+          (pj_strstr(&value, &TAG_PRINCIPAL.str) != NULL))
+      {
+        return true;
+      }
+    }
+
+    accept_header =
+     (pjsip_accept_contact_hdr*)pjsip_msg_find_hdr_by_name(req,
+                                                           &STR_ACCEPT_CONTACT,
+                                                           accept_header->next);
+  }
+
+  return false;
+}
+
+int GeminiUtils::contact_headers_present(const pjsip_msg* req,
+                                         const ScanLimits& limits,
+                                         int& truncated)
+{
+  truncated = 0;
+  int present = 0;
+  int headers = 0;
+
+  for (const pjsip_hdr* hdr = req->hdr.next;
+       hdr != &req->hdr;
+       hdr = hdr->next)
+  {
+    bool accept = (pj_stricmp(&hdr->name, &STR_ACCEPT_CONTACT) == 0);
+
+    if ((!accept) && (pj_stricmp(&hdr->name, &STR_REJECT_CONTACT) != 0))
+    {
+      continue;
+    }
+
+    if (headers++ >= limits.max_headers)
+    {
+      truncated |= (1 << SCAN_LIMIT_HEADERS);
+      break;
+    }
+
+    const pjsip_param* feature_set = accept ?
+                   &((const pjsip_accept_contact_hdr*)hdr)->feature_set :
+                   &((const pjsip_reject_contact_hdr*)hdr)->feature_set;
+    const pjsip_param* feature = feature_set->next;
+
+    if ((feature == feature_set) || (feature->next != feature_set))
+    {
+      // Gemini's headers have exactly one feature.
+      continue;
+    }
+
+    bool with_twin = ((tag_matches(&feature->name, TAG_WITH_TWIN)) &&
+                      (feature->value.slen == 0));
+    bool native = ((tag_matches(&feature->name, TAG_3GPP_ICS)) &&
+                   (tag_matches(&feature->value, TAG_3GPP_ICS_SERVER_PRINCIPAL)));
+
+    if (accept)
+    {
+      const pjsip_accept_contact_hdr* accept_hdr =
+                                         (const pjsip_accept_contact_hdr*)hdr;
+
+      if ((accept_hdr->explicit_match) && (accept_hdr->required_match))
+      {
+        present |= (with_twin ? (1 << ACCEPT_WITH_TWIN) : 0) |
+                   (native ? (1 << ACCEPT_3GPP_ICS) : 0);
+      }
+    }
+    else
+    {
+      present |= (with_twin ? (1 << REJECT_WITH_TWIN) : 0) |
+                 (native ? (1 << REJECT_3GPP_ICS) : 0);
+    }
+  }
+
+  return present;
+}
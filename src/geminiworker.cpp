@@ -0,0 +1,410 @@
+/**
+ * @file geminiworker.cpp Implementation of the background worker that does
+ * the gemini AS's bookkeeping off the call processing path.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <new>
+
+#include "log.h"
+#include "geminiworker.h"
+#include "pjutils.h"
+
+GeminiWorker::GeminiWorker(uint32_t queue_size) :
+  _mask(0),
+  _cells(NULL),
+  _strings(NULL),
+  _enqueue_pos(0),
+  _processed(0),
+  _sleeping(false),
+  _flushing(0),
+  _terminated(false),
+  _thread_started(false)
+{
+  uint32_t num_cells = 1;
+
+  while (num_cells < queue_size)
+  {
+    num_cells <<= 1;
+  }
+
+  _mask = num_cells - 1;
+  _cells = new Cell[num_cells];
+  _strings = new StringSlot[num_cells];
+
+  // Each cell starts free for the producer at its own position.
+  for (uint32_t ii = 0; ii < num_cells; ++ii)
+  {
+    _cells[ii].sequence.store(ii, std::memory_order_relaxed);
+  }
+
+  for (int ii = 0; ii < NUM_OPS; ++ii)
+  {
+    _dropped[ii].store(0, std::memory_order_relaxed);
+  }
+
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_record_cond, NULL);
+  pthread_cond_init(&_flush_cond, NULL);
+
+  int rc = pthread_create(&_thread, NULL, &GeminiWorker::thread_function, this);
+
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to start gemini worker thread: %s", strerror(rc));
+    // LCOV_EXCL_STOP
+  }
+  else
+  {
+    _thread_started = true;
+  }
+}
+
+void* GeminiWorker::operator new(size_t size)
+{
+  void* ptr;
+
+  if (posix_memalign(&ptr, alignof(GeminiWorker), size) != 0)
+  {
+    // LCOV_EXCL_START
+    throw std::bad_alloc();
+    // LCOV_EXCL_STOP
+  }
+
+  return ptr;
+}
+
+void GeminiWorker::operator delete(void* ptr)
+{
+  free(ptr);
+}
+
+GeminiWorker::~GeminiWorker()
+{
+  pthread_mutex_lock(&_lock);
+  _terminated.store(true);
+  pthread_cond_signal(&_record_cond);
+  pthread_mutex_unlock(&_lock);
+
+  if (_thread_started)
+  {
+    pthread_join(_thread, NULL);
+  }
+
+  pthread_cond_destroy(&_flush_cond);
+  pthread_cond_destroy(&_record_cond);
+  pthread_mutex_destroy(&_lock);
+  delete[] _strings;
+  delete[] _cells;
+}
+
+void GeminiWorker::report_event(SAS::TrailId trail,
+                                int event_id,
+                                pjsip_uri* uri,
+                                std::initializer_list<uint32_t> static_params)
+{
+  // Print the URI before claiming a cell. If it's too long for a record,
+  // report the event here rather than lose it.
+  char uri_buf[MAX_STRING];
+  int uri_len = 0;
+
+  if (uri != NULL)
+  {
+    uri_len = pjsip_uri_print(PJSIP_URI_IN_REQ_URI, uri, uri_buf, sizeof(uri_buf));
+
+    if (uri_len < 0)
+    {
+      SAS::Event event(trail, event_id, 0);
+
+      for (uint32_t param : static_params)
+      {
+        event.add_static_param(param);
+      }
+
+      event.add_var_param(PJUtils::uri_to_string(PJSIP_URI_IN_REQ_URI, uri));
+      SAS::report_event(event);
+      return;
+    }
+  }
+
+  uint64_t pos;
+  Cell* cell = claim(SAS_EVENT, pos);
+
+  if (cell != NULL)
+  {
+    Record& record = cell->record;
+    record.value = trail;
+    record.arg = event_id;
+    record.num_static_params = 0;
+
+    for (uint32_t param : static_params)
+    {
+      if (record.num_static_params < MAX_STATIC_PARAMS)
+      {
+        record.static_params[record.num_static_params++] = param;
+      }
+    }
+
+    record.string_len = uri_len;
+    memcpy(string_slot(pos), uri_buf, uri_len);
+    publish(cell, pos);
+  }
+}
+
+void GeminiWorker::set_native_state(TwinStateCache* cache,
+                                    const std::string& user,
+                                    TwinStateCache::State state)
+{
+  if (user.length() > MAX_STRING)
+  {
+    cache->set_native_state(user, state);
+    return;
+  }
+
+  uint64_t pos;
+  Cell* cell = claim(TWIN_STATE, pos);
+
+  if (cell != NULL)
+  {
+    cell->record.target = cache;
+    cell->record.arg = state;
+    cell->record.string_len = user.length();
+    memcpy(string_slot(pos), user.data(), user.length());
+    publish(cell, pos);
+  }
+}
+
+void GeminiWorker::set_subscribe_leg(SubscribeMemo* memo,
+                                     const std::string& key,
+                                     GeminiLegType leg_type)
+{
+  if (key.length() > MAX_STRING)
+  {
+    if (leg_type == NUM_LEG_TYPES)
+    {
+      memo->forget(key);
+    }
+    else
+    {
+      memo->set_leg(key, leg_type);
+    }
+
+    return;
+  }
+
+  uint64_t pos;
+  Cell* cell = claim(SUBSCRIBE_LEG, pos);
+
+  if (cell != NULL)
+  {
+    cell->record.target = memo;
+    cell->record.arg = leg_type;
+    cell->record.string_len = key.length();
+    memcpy(string_slot(pos), key.data(), key.length());
+    publish(cell, pos);
+  }
+}
+
+void GeminiWorker::flush()
+{
+  uint64_t target = _enqueue_pos.load();
+
+  if (!_thread_started)
+  {
+    // LCOV_EXCL_START - Nothing will ever be processed.
+    return;
+    // LCOV_EXCL_STOP
+  }
+
+  // The worker checks for flushing threads after each record it processes,
+  // so once we've said we're flushing we'll be woken when it's done.
+  pthread_mutex_lock(&_lock);
+  _flushing++;
+
+  while (_processed.load() < target)
+  {
+    pthread_cond_wait(&_flush_cond, &_lock);
+  }
+
+  _flushing--;
+  pthread_mutex_unlock(&_lock);
+}
+
+GeminiWorker::Cell* GeminiWorker::claim(Op op, uint64_t& pos)
+{
+  pos = _enqueue_pos.load(std::memory_order_relaxed);
+
+  while (true)
+  {
+    Cell* cell = &_cells[pos & _mask];
+    uint64_t sequence = cell->sequence.load(std::memory_order_acquire);
+    int64_t diff = (int64_t)sequence - (int64_t)pos;
+
+    if (diff == 0)
+    {
+      // The cell is free. Claim it by moving the position on, unless another
+      // producer got there first.
+      if (_enqueue_pos.compare_exchange_weak(pos,
+                                             pos + 1,
+                                             std::memory_order_relaxed))
+      {
+        cell->record.op = op;
+        return cell;
+      }
+    }
+    else if (diff < 0)
+    {
+      // The worker hasn't finished with the cell from the last time round,
+      // so the queue is full.
+      _dropped[op]++;
+      return NULL;
+    }
+    else
+    {
+      // Another producer has claimed this position.
+      pos = _enqueue_pos.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+void GeminiWorker::publish(Cell* cell, uint64_t pos)
+{
+  // This and the worker's check of the cell when it goes to sleep are both
+  // sequentially consistent, so either it sees the record or we see that
+  // it's sleeping. It doesn't wait until we've taken the lock, so the signal
+  // can't be lost.
+  cell->sequence.store(pos + 1);
+
+  if (_sleeping.load())
+  {
+    pthread_mutex_lock(&_lock);
+    pthread_cond_signal(&_record_cond);
+    pthread_mutex_unlock(&_lock);
+  }
+}
+
+void GeminiWorker::apply(const Record& record, const char* string)
+{
+  switch (record.op)
+  {
+    case SAS_EVENT:
+    {
+      SAS::Event event(record.value, record.arg, 0);
+
+      for (int ii = 0; ii < record.num_static_params; ++ii)
+      {
+        event.add_static_param(record.static_params[ii]);
+      }
+
+      if (record.string_len != 0)
+      {
+        event.add_var_param(std::string(string, record.string_len));
+      }
+
+      SAS::report_event(event);
+      break;
+    }
+
+    case TWIN_STATE:
+      ((TwinStateCache*)record.target)->set_native_state(
+                               std::string(string, record.string_len),
+                               (TwinStateCache::State)record.arg);
+      break;
+
+    case SUBSCRIBE_LEG:
+    {
+      SubscribeMemo* memo = (SubscribeMemo*)record.target;
+      std::string key(string, record.string_len);
+
+      if (record.arg == NUM_LEG_TYPES)
+      {
+        memo->forget(key);
+      }
+      else
+      {
+        memo->set_leg(key, (GeminiLegType)record.arg);
+      }
+      break;
+    }
+
+    default:
+      // LCOV_EXCL_START
+      TRC_WARNING("Unknown gemini worker record type %d", record.op);
+      break;
+      // LCOV_EXCL_STOP
+  }
+}
+
+void* GeminiWorker::thread_function(void* worker)
+{
+  ((GeminiWorker*)worker)->run();
+  return NULL;
+}
+
+bool GeminiWorker::wait_for_record(uint64_t pos)
+{
+  Cell* cell = &_cells[pos & _mask];
+  bool record_published = true;
+
+  pthread_mutex_lock(&_lock);
+  _sleeping.store(true);
+
+  while (cell->sequence.load() != pos + 1)
+  {
+    // Only stop once every record claimed has been published and
+    // processed, so none are lost.
+    if ((_terminated.load()) && (_enqueue_pos.load() == pos))
+    {
+      record_published = false;
+      break;
+    }
+
+    pthread_cond_wait(&_record_cond, &_lock);
+  }
+
+  _sleeping.store(false);
+  pthread_mutex_unlock(&_lock);
+
+  return record_published;
+}
+
+void GeminiWorker::run()
+{
+  // This is the only consumer, so the position it's read up to is the
+  // number of records it's processed.
+  uint64_t pos = _processed.load();
+
+  while (true)
+  {
+    Cell* cell = &_cells[pos & _mask];
+
+    if (cell->sequence.load(std::memory_order_acquire) == pos + 1)
+    {
+      apply(cell->record, string_slot(pos));
+
+      // Free the cell for the producer's next time round the queue.
+      cell->sequence.store(pos + _mask + 1, std::memory_order_release);
+      _processed.store(++pos);
+
+      if (_flushing.load() != 0)
+      {
+        pthread_mutex_lock(&_lock);
+        pthread_cond_broadcast(&_flush_cond);
+        pthread_mutex_unlock(&_lock);
+      }
+    }
+    else if (!wait_for_record(pos))
+    {
+      break;
+    }
+  }
+}
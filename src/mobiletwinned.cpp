@@ -10,6 +10,9 @@
  * Metaswitch Networks in a separate written agreement.
  */
 
+#include <stdlib.h>
+#include <new>
+
 #include "log.h"
 #include "mobiletwinned.h"
 #include "pjutils.h"
@@ -17,12 +20,10 @@
 #include "custom_headers.h"
 #include "geminisasevent.h"
 #include "constants.h"
-
-const char* STR_SERVER = "server";
-const char* STR_PRINCIPAL = "principal";
+#include "geminiutils.h"
 
 /// Returns a new MobileTwinnedAppServerTsx if the request is either a
-/// SUBSCRIBE or a INVITE.
+/// SUBSCRIBE or a INVITE, and isn't one we pass through.
 AppServerTsx* MobileTwinnedAppServer::get_app_tsx(SproutletHelper* helper,
                                                   pjsip_msg* req,
                                                   pjsip_sip_uri*& next_hop,
@@ -36,37 +37,157 @@ AppServerTsx* MobileTwinnedAppServer::get_app_tsx(SproutletHelper* helper,
     return NULL;
   }
 
+  if (pass_through(req, trail))
+  {
+    // We wouldn't change the request or its responses, so don't create a
+    // transaction. Sprout routes the request on without us (just as for
+    // methods we aren't interested in), and we're not in the response path.
+    _stats.requests_passed_through.increment();
+
+    if (_config.decision_trace != NULL)
+    {
+      _config.decision_trace->record(trail, DecisionTrace::REQ_PASSED_THROUGH);
+    }
+
+    return NULL;
+  }
+
   MobileTwinnedAppServerTsx* mobile_twinned_tsx =
-                                          new MobileTwinnedAppServerTsx();
+                                          new MobileTwinnedAppServerTsx(this);
   return mobile_twinned_tsx;
 }
 
+bool MobileTwinnedAppServer::pass_through(pjsip_msg* req, SAS::TrailId trail)
+{
+  pjsip_uri* req_uri = req->line.req.uri;
+
+  // If the Request URI contains a 'gr' parameter, then this is a request
+  // targeted at a specific VoIP client, which we'd send on unchanged.
+  if ((_config.pass_through & PASS_THROUGH_GR) &&
+      (PJSIP_URI_SCHEME_IS_SIP(req_uri)) &&
+      (pjsip_param_find(&((pjsip_sip_uri*)req_uri)->other_param, &STR_GR)))
+  {
+    TRC_DEBUG("Call is targeted at a specific VoIP client");
+
+    report_event(trail, SASEvent::CALL_TO_VOIP_CLIENT);
+
+    return true;
+  }
+
+  return false;
+}
+
+void* MobileTwinnedAppServer::operator new(size_t size)
+{
+  void* ptr;
+
+  if (posix_memalign(&ptr, alignof(MobileTwinnedAppServer), size) != 0)
+  {
+    // LCOV_EXCL_START
+    throw std::bad_alloc();
+    // LCOV_EXCL_STOP
+  }
+
+  return ptr;
+}
+
+void MobileTwinnedAppServer::operator delete(void* ptr)
+{
+  free(ptr);
+}
+
+void MobileTwinnedAppServer::report_event(
+                                SAS::TrailId trail,
+                                int event_id,
+                                pjsip_uri* uri,
+                                std::initializer_list<uint32_t> static_params)
+{
+  if (_config.worker != NULL)
+  {
+    _config.worker->report_event(trail, event_id, uri, static_params);
+    return;
+  }
+
+  SAS::Event event(trail, event_id, 0);
+
+  for (uint32_t param : static_params)
+  {
+    event.add_static_param(param);
+  }
+
+  if (uri != NULL)
+  {
+    event.add_var_param(PJUtils::uri_to_string(PJSIP_URI_IN_REQ_URI, uri));
+  }
+
+  SAS::report_event(event);
+}
+
 /// Constructor
-MobileTwinnedAppServerTsx::MobileTwinnedAppServerTsx() :
+MobileTwinnedAppServerTsx::MobileTwinnedAppServerTsx(
+                                      MobileTwinnedAppServer* mobile_twinned) :
   AppServerTsx(),
-  _mobile_fork_id(0),
+  _mobile_twinned(mobile_twinned),
+  _twin_state_key(),
+  _subscribe_key(),
+  _memo_leg(NUM_LEG_TYPES),
+  _num_forks(0),
+  _start_ms(0),
+  _rung(false),
   _attempted_mobile_voip_client(false),
-  _single_target(false)
+  _single_target(false),
+  _tenant(TenantAccounting::OTHER_TENANT),
+  _shadow(false),
+  _native_fork_key(0),
+  _native_fork_owner(0),
+  _existing_contact_headers(-1)
 {
 }
 
 /// Destructor
 MobileTwinnedAppServerTsx::~MobileTwinnedAppServerTsx()
 {
+  if (_native_fork_key != 0)
+  {
+    _mobile_twinned->config().native_fork_dedup->release(_native_fork_key,
+                                                         _native_fork_owner);
+  }
 }
 
 void MobileTwinnedAppServerTsx::on_initial_request(pjsip_msg* req)
 {
   TRC_DEBUG("MobileTwinnedAS - process request %p", req);
+  _start_ms = _mobile_twinned->now_ms();
+
+  // Account the request to the tenant whose AS URI invoked us.
+  TenantAccounting* accounting = _mobile_twinned->config().tenant_accounting;
+  TenantAccounting::Timer timer(accounting, _tenant);
+
+  if (accounting != NULL)
+  {
+    _tenant = accounting->tenant_id(route_hdr());
+    account((req->line.req.method.id == PJSIP_INVITE_METHOD) ?
+              TenantAccounting::INVITES : TenantAccounting::SUBSCRIBES);
+  }
+
+  // If we know the home domain, we can twin requests with tel: URIs by
+  // converting them to SIP URIs. If the number isn't valid, we can't find
+  // the subscriber's twins, so the request is rejected.
+  if ((PJSIP_URI_SCHEME_IS_TEL(req->line.req.uri)) &&
+      (!_mobile_twinned->config().home_domain.empty()) &&
+      (!convert_tel_uri(req)))
+  {
+    TRC_DEBUG("Request URI is a tel: URI that can't be converted");
+    reject_non_sip_uri(req);
+    return;
+  }
 
   pjsip_uri* req_uri = req->line.req.uri;
 
   if (!PJSIP_URI_SCHEME_IS_SIP(req_uri))
   {
     TRC_DEBUG("Request URI isn't a SIP URI");
-    pjsip_msg* rsp = create_response(req, PJSIP_SC_TEMPORARILY_UNAVAILABLE);
-    send_response(rsp);
-    free_msg(req);
+    reject_non_sip_uri(req);
     return;
   }
 
@@ -76,46 +197,105 @@ void MobileTwinnedAppServerTsx::on_initial_request(pjsip_msg* req)
   {
     TRC_DEBUG("Call is targeted at a specific VoIP client");
 
-    SAS::Event event(trail(), SASEvent::CALL_TO_VOIP_CLIENT, 0);
-    SAS::report_event(event);
+    _mobile_twinned->report_event(trail(), SASEvent::CALL_TO_VOIP_CLIENT);
 
     _single_target = true;
-    send_request(req);
+    trace_decision(DecisionTrace::REQ_TO_VOIP_CLIENT);
+    send_fork(req, LEG_VOIP);
     return;
   }
 
-  // Get the twin-prefix
-  pjsip_param* twin_prefix = NULL;
-  const pjsip_route_hdr* route_header = route_hdr();
+  // Get the twin prefixes. A subscriber with several native devices has a
+  // twin-prefix parameter on the AS URI for each of them. With no
+  // twin-prefix we still fork to a single native device, using the
+  // subscriber's own number.
+  pjsip_param* twin_prefixes[MAX_TWINS];
+  bool twins_truncated;
+  int num_twins = get_twin_prefixes(twin_prefixes, twins_truncated);
 
-  if (route_header != NULL)
+  if (twins_truncated)
   {
-    pjsip_sip_uri* route_hdr_uri = (pjsip_sip_uri*)route_header->name_addr.uri;
-    twin_prefix = pjsip_param_find(&route_hdr_uri->other_param, &STR_TWIN_PRE);
+    _mobile_twinned->stats().twin_prefixes_truncated.increment();
   }
 
   // If the request has a Accept-Contact header that contains g.3gpp.ics
-  // then this is a request targeted at the native device. Add the twin
+  // then this is a request targeted at the native device(s). Add the twin
   // prefix to the request URI and set the single_target flag
   if (accept_contact_header_has_3gpp_ics(req))
   {
     TRC_DEBUG("Call is targeted at the native device");
+    _single_target = true;
+    trace_decision(DecisionTrace::REQ_TO_NATIVE_DEVICE);
 
-    add_twin_prefix(req_uri, twin_prefix, get_pool(req));
+    // Copy the request for each additional native device before we change
+    // it.
+    pjsip_msg* native_reqs[MAX_TWINS];
+    native_reqs[0] = req; req = NULL;
 
-    SAS::Event event(trail(), SASEvent::CALL_TO_NATIVE_DEVICE, 0);
-    event.add_var_param(PJUtils::uri_to_string(PJSIP_URI_IN_REQ_URI, req_uri));
-    SAS::report_event(event);
+    for (int ii = 1; ii < num_twins; ++ii)
+    {
+      native_reqs[ii] = clone_request(native_reqs[0]);
+    }
+
+    for (int ii = 0; ii < num_twins; ++ii)
+    {
+      pjsip_uri* native_uri = native_reqs[ii]->line.req.uri;
+
+      {
+        LegMutation mutation(this,
+                             native_reqs[ii],
+                             LEG_NATIVE,
+                             0,
+                             twin_prefix_bytes(native_uri, twin_prefixes[ii]));
+        add_twin_prefix(native_uri, twin_prefixes[ii], mutation);
+      }
+
+      _mobile_twinned->report_event(trail(), SASEvent::CALL_TO_NATIVE_DEVICE, native_uri);
+
+      send_fork(native_reqs[ii], LEG_NATIVE);
+    }
+
+    return;
+  }
+
+  // If we know which leg accepted the subscriber's last subscription to this
+  // event package, only send the SUBSCRIBE there.
+  _memo_leg = memoised_subscribe_leg(req);
+
+  if (_memo_leg != NUM_LEG_TYPES)
+  {
+    TRC_DEBUG("Sending SUBSCRIBE to the %s leg that accepted the last one",
+              GeminiStats::leg_type_name(_memo_leg));
+    _mobile_twinned->report_event(trail(), SASEvent::SUBSCRIBE_TO_MEMOISED_LEG,
+                                  NULL,
+                                  {(uint32_t)_memo_leg});
+
+    _mobile_twinned->stats().subscribes_to_memoised_leg.increment();
+    trace_decision(DecisionTrace::REQ_TO_MEMOISED_LEG);
+
+    if (_memo_leg == LEG_VOIP)
+    {
+      set_up_voip_fork(req);
+      send_fork(req, LEG_VOIP);
+    }
+    else
+    {
+      send_native_forks(req, twin_prefixes, num_twins);
+    }
 
-    _single_target = true;
-    _mobile_fork_id = send_request(req);
     return;
   }
 
-  // Otherwise, fork the call. Create a copy of the request we can manipulate
-  // (and change the name of the existing request so we don't accidentally
-  // use it).
-  pjsip_msg* mobile_req = clone_request(req);
+  // Otherwise, fork the call. Create a copy of the request for each native
+  // device that we can manipulate (and change the name of the existing
+  // request so we don't accidentally use it).
+  pjsip_msg* native_reqs[MAX_TWINS];
+
+  for (int ii = 0; ii < num_twins; ++ii)
+  {
+    native_reqs[ii] = clone_request(req);
+  }
+
   pjsip_msg* voip_req = req; req = NULL;
 
   // Set up the fork to the VoIP client.
@@ -125,162 +305,1077 @@ void MobileTwinnedAppServerTsx::on_initial_request(pjsip_msg* req)
   // require that Gemini-compatible clients set this if they detect
   // that they are colocated with a native client).
   TRC_DEBUG("Creating forked request to VoIP client");
-  pj_pool_t* voip_pool = get_pool(voip_req);
-  pjsip_reject_contact_hdr* reject_hdr =
-                                   pjsip_reject_contact_hdr_create(voip_pool);
-  pjsip_param* reject_colocated_voip = PJ_POOL_ALLOC_T(voip_pool, pjsip_param);
-  reject_colocated_voip->name = STR_WITH_TWIN;
-  reject_colocated_voip->value.slen = 0;
-  pj_list_insert_after(&reject_hdr->feature_set, reject_colocated_voip);
-  pjsip_msg_add_hdr(voip_req, (pjsip_hdr*)reject_hdr);
+  set_up_voip_fork(voip_req);
 
-  // We also need a Reject-Contact header containg "g.3gpp.ics", to
-  // ensure that this never matches a native client without a
-  // colocated VoIP phone (which should be rung by the other fork).
-  std::string g_3gpp_ics = std::string("\"") + STR_SERVER + ","
-                                             + STR_PRINCIPAL + "\"";
-  pjsip_reject_contact_hdr* reject_hdr2 =
-                                   pjsip_reject_contact_hdr_create(voip_pool);
-  pjsip_param* reject_native = PJ_POOL_ALLOC_T(voip_pool, pjsip_param);
-  reject_native->name = STR_3GPP_ICS;
-  reject_native->value = pj_strdup3(voip_pool, g_3gpp_ics.c_str());
-  pj_list_insert_after(&reject_hdr2->feature_set, reject_native);
-  pjsip_msg_add_hdr(voip_req, (pjsip_hdr*)reject_hdr2);
-
-  // Set up the fork to the native device.
-  // Append the twin prefix (if set) to the request URI, and add an
-  // Accept-Contact header specifying g.3gpp.ics.
-  TRC_DEBUG("Creating forked request to twinned mobile device");
-  pj_pool_t* mobile_pool = get_pool(mobile_req);
-  add_twin_prefix(mobile_req->line.req.uri, twin_prefix, mobile_pool);
-  pjsip_accept_contact_hdr* accept_hdr =
-                                   pjsip_accept_contact_hdr_create(mobile_pool);
-  accept_hdr->explicit_match = true;
-  accept_hdr->required_match = true;
-  pjsip_param* force_native = PJ_POOL_ALLOC_T(mobile_pool, pjsip_param);
-  force_native->name = STR_3GPP_ICS;
-  force_native->value = pj_strdup3(mobile_pool, g_3gpp_ics.c_str());
-  pj_list_insert_after(&accept_hdr->feature_set, force_native);
-  pjsip_msg_add_hdr(mobile_req, (pjsip_hdr*)accept_hdr);
+  // If we've recently learnt that the native twin isn't reachable, there's
+  // no point in forking to it only to get a 480. Instead, send the second
+  // fork straight to the VoIP clients hosted on mobile devices. The copies
+  // of the request are still unmodified, so this is the same fork as we'd
+  // make on receiving a 480 from the native device.
+  TwinStateCache* twin_state_cache = _mobile_twinned->config().twin_state_cache;
 
-  // Add Reject-Contact "+sip.with-twin", to guard against the
-  // unexpected case where a phone specifies both "+sip.with-twin" and "+g.3gpp.ics".
-  pjsip_reject_contact_hdr* reject_hdr3 =
-                                   pjsip_reject_contact_hdr_create(mobile_pool);
-  pjsip_param* reject_colocated_voip2 = PJ_POOL_ALLOC_T(mobile_pool, pjsip_param);
-  reject_colocated_voip2->name = STR_WITH_TWIN;
-  reject_colocated_voip2->value.slen = 0;
-  pj_list_insert_after(&reject_hdr3->feature_set, reject_colocated_voip2);
-  pjsip_msg_add_hdr(mobile_req, (pjsip_hdr*)reject_hdr3);
-
-  // Report the fact we're forking the request to SAS, including
-  // the new native mobile URI.
-  SAS::Event event(trail(), SASEvent::FORKING_ON_REQ, 0);
-  event.add_var_param(PJUtils::uri_to_string(PJSIP_URI_IN_REQ_URI,
-                                             mobile_req->line.req.uri));
-  SAS::report_event(event);
+  if ((twin_state_cache != NULL) &&
+      (voip_req->line.req.method.id == PJSIP_INVITE_METHOD))
+  {
+    pjsip_sip_uri* sip_uri = (pjsip_sip_uri*)req_uri;
+    _twin_state_key = PJUtils::pj_str_to_string(&sip_uri->user) + "@" +
+                      PJUtils::pj_str_to_string(&sip_uri->host);
+
+    if (twin_state_cache->get_native_state(_twin_state_key) ==
+                                                  TwinStateCache::UNREACHABLE)
+    {
+      TRC_DEBUG("Native twin is known to be unreachable");
+      _mobile_twinned->report_event(trail(), SASEvent::NATIVE_TWIN_UNREACHABLE);
+
+      pjsip_msg* mobile_voip_req = native_reqs[0];
+      set_up_mobile_voip_fork(mobile_voip_req);
+
+      for (int ii = 1; ii < num_twins; ++ii)
+      {
+        free_msg(native_reqs[ii]);
+      }
+
+      trace_decision(DecisionTrace::REQ_NATIVE_UNREACHABLE);
+      send_fork(voip_req, LEG_VOIP);
+      send_fork(mobile_voip_req, LEG_MOBILE_VOIP);
+
+      _attempted_mobile_voip_client = true;
+      return;
+    }
+  }
+
+  // If Gemini has been invoked for this call more than once (for example
+  // because it was forked upstream), only one transaction should page the
+  // native twin. The others just fork to the VoIP clients.
+  if (native_fork_in_flight(voip_req))
+  {
+    TRC_DEBUG("Native fork of this call already in flight");
+    _mobile_twinned->report_event(trail(), SASEvent::NATIVE_FORK_DUPLICATE);
+    _mobile_twinned->stats().native_forks_deduplicated.increment();
+
+    for (int ii = 0; ii < num_twins; ++ii)
+    {
+      free_msg(native_reqs[ii]);
+    }
+
+    trace_decision(DecisionTrace::REQ_NATIVE_DUPLICATE);
+    send_fork(voip_req, LEG_VOIP);
+    return;
+  }
+
+  // Set up the forks to the native devices.
+  TRC_DEBUG("Creating forked requests to %d twinned mobile devices", num_twins);
+
+  for (int ii = 0; ii < num_twins; ++ii)
+  {
+    set_up_native_fork(native_reqs[ii], twin_prefixes[ii]);
+
+    // Report the fact we're forking the request to SAS, including
+    // the new native mobile URI.
+    _mobile_twinned->report_event(trail(), SASEvent::FORKING_ON_REQ,
+                                  native_reqs[ii]->line.req.uri);
+  }
+
+  trace_decision(DecisionTrace::REQ_FORKED);
+  send_fork(voip_req, LEG_VOIP);
+
+  for (int ii = 0; ii < num_twins; ++ii)
+  {
+    send_fork(native_reqs[ii], LEG_NATIVE);
+  }
 
-  send_request(voip_req);
-  _mobile_fork_id = send_request(mobile_req);
+  // This is the decision the candidate policies differ on, so (on a sample
+  // of calls) watch how it plays out.
+  _shadow = shadow_sampled();
 }
 
 void MobileTwinnedAppServerTsx::on_response(pjsip_msg* rsp, int fork_id)
 {
+  TenantAccounting::Timer timer(_mobile_twinned->config().tenant_accounting,
+                                _tenant);
+  int status_code = rsp->line.status.code;
+  trace_decision(DecisionTrace::RSP_RECEIVED, fork_id, status_code);
+
+  ForkRecord* fork = track_fork(rsp, fork_id);
+  bool native_fork = ((fork != NULL) && (fork->leg_type == LEG_NATIVE));
+
+  if ((fork != NULL) && (status_code >= PJSIP_SC_OK))
+  {
+    if ((_memo_leg != NUM_LEG_TYPES) && (all_forks_failed()))
+    {
+      // The leg that accepted the subscriber's last subscription has
+      // rejected this one, so try the other leg instead.
+      fall_back_from_memo(fork_id, status_code);
+      free_msg(rsp);
+      return;
+    }
+
+    learn_subscribe_leg();
+
+    if (native_fork)
+    {
+      release_native_fork();
+    }
+  }
+
+  if ((native_fork) &&
+      (status_code > PJSIP_SC_TRYING) &&
+      (status_code < PJSIP_SC_MULTIPLE_CHOICES))
+  {
+    // A native device is alerting or has answered, so it's reachable.
+    record_twin_state(TwinStateCache::REACHABLE);
+  }
+
   // In on_initial_request we add a Reject-Contact header to INVITEs
   // going to the VoIP client to stop the client and the native mobile
   // service ringing at the same time. If we receive a 480 from the
   // fork to the native mobile device, indicating it isn't registered,
   // we should now try sending the INVITE to any VoIP clients
-  // hosted on mobile devices.
+  // hosted on mobile devices. If there are several native devices, the
+  // VoIP clients could be colocated with any of them, so we only do this
+  // once all of them have returned a 480.
   if ((PJSIP_MSG_CSEQ_HDR(rsp)->method.id == PJSIP_INVITE_METHOD) &&
-      (rsp->line.status.code == PJSIP_SC_TEMPORARILY_UNAVAILABLE) &&
-      (fork_id == _mobile_fork_id) &&
+      (status_code == PJSIP_SC_TEMPORARILY_UNAVAILABLE) &&
+      (native_fork) &&
       (!_attempted_mobile_voip_client))
   {
     if (_single_target)
     {
       TRC_DEBUG("No retry as original call was targeted at a specific device");
-      SAS::Event event(trail(), SASEvent::NO_RETRY_ON_480_RSP, 0);
-      SAS::report_event(event);
+      _mobile_twinned->report_event(trail(), SASEvent::NO_RETRY_ON_480_RSP);
+      trace_decision(DecisionTrace::NO_RETRY_ON_480, fork_id);
+      shadow_on_response(status_code);
+      send_response(rsp);
+      return;
+    }
+
+    if (!all_native_forks_unavailable())
+    {
+      // Either we're still waiting for other native devices (in which case
+      // Sprout holds on to this response until they've responded), or one
+      // of them is registered and rejected the call.
+      TRC_DEBUG("Not all native devices are unavailable");
+      shadow_on_response(status_code);
       send_response(rsp);
       return;
     }
 
     TRC_DEBUG("Creating a new fork to mobile hosted VoIP clients");
-    SAS::Event event(trail(), SASEvent::FORKING_ON_480_RSP, 0);
-    SAS::report_event(event);
+    _mobile_twinned->report_event(trail(), SASEvent::FORKING_ON_480_RSP);
+    record_twin_state(TwinStateCache::UNREACHABLE);
 
-    // Create an Accept-Contact header and add the "+sip.with-twin" parameter.
+    // Add an Accept-Contact header with the "+sip.with-twin" parameter.
     pjsip_msg* req = original_request();
-    pj_pool_t* pool = get_pool(req);
-
-    pjsip_accept_contact_hdr* new_hdr = pjsip_accept_contact_hdr_create(pool);
-    new_hdr->explicit_match = true;
-    new_hdr->required_match = true;
-    pjsip_param* force_twinned = PJ_POOL_ALLOC_T(pool, pjsip_param);
-    force_twinned->name = STR_WITH_TWIN;
-    force_twinned->value.slen = 0;
-    pj_list_insert_after(&new_hdr->feature_set, force_twinned);
-    pjsip_msg_add_hdr(req, (pjsip_hdr*)new_hdr);
-
-    send_request(req);
+    set_up_mobile_voip_fork(req);
+
+    trace_decision(DecisionTrace::RETRY_ON_480, fork_id);
+    account(TenantAccounting::RETRIES);
+
+    if (_shadow)
+    {
+      shadow_on_retry(_mobile_twinned->now_ms());
+    }
+
+    send_fork(req, LEG_MOBILE_VOIP);
     free_msg(rsp);
 
     // Set the flag to indicate we've now tried reaching the VoIP client
     // on the mobile already so we don't come through here again. We
-    // shouldn't do anyway because the fork_ids won't match, but just in
-    // case.
+    // shouldn't do anyway because the new fork isn't to a native device,
+    // but just in case.
     _attempted_mobile_voip_client = true;
   }
   else
   {
+    shadow_on_response(status_code);
     send_response(rsp);
   }
 }
 
-void MobileTwinnedAppServerTsx::add_twin_prefix(pjsip_uri* req_uri,
-                                                pjsip_param* twin_prefix,
-                                                pj_pool_t* pool)
+void MobileTwinnedAppServerTsx::reject_non_sip_uri(pjsip_msg* req)
 {
-  if ((twin_prefix != NULL) && (twin_prefix->value.slen != 0))
+  _mobile_twinned->stats().non_sip_uris_rejected.increment();
+  trace_decision(DecisionTrace::REQ_NOT_SIP);
+  pjsip_msg* rsp = create_response(req, PJSIP_SC_TEMPORARILY_UNAVAILABLE);
+  send_response(rsp);
+  free_msg(req);
+}
+
+bool MobileTwinnedAppServerTsx::convert_tel_uri(pjsip_msg* req)
+{
+  // Telephone numbers are short, so we can build the user part on the stack
+  // and only need to allocate the final string from the pool.
+  static const int MAX_USER_LEN = 256;
+  char user[MAX_USER_LEN];
+
+  pjsip_tel_uri* tel_uri = (pjsip_tel_uri*)pjsip_uri_get_uri(req->line.req.uri);
+  int user_len = GeminiUtils::tel_to_sip_user(tel_uri->number.ptr,
+                                              tel_uri->number.slen,
+                                              tel_uri->context.ptr,
+                                              tel_uri->context.slen,
+                                              user,
+                                              MAX_USER_LEN);
+
+  // RFC 3261 keeps the tel: URI's parameters in the user part, as they
+  // qualify the number.
+  if (tel_uri->isub_param.slen > 0)
+  {
+    user_len = GeminiUtils::append_tel_param(TAG_ISUB.str.ptr,
+                                             TAG_ISUB.str.slen,
+                                             tel_uri->isub_param.ptr,
+                                             tel_uri->isub_param.slen,
+                                             user,
+                                             user_len,
+                                             MAX_USER_LEN);
+  }
+
+  if (tel_uri->ext_param.slen > 0)
+  {
+    user_len = GeminiUtils::append_tel_param(TAG_EXT.str.ptr,
+                                             TAG_EXT.str.slen,
+                                             tel_uri->ext_param.ptr,
+                                             tel_uri->ext_param.slen,
+                                             user,
+                                             user_len,
+                                             MAX_USER_LEN);
+  }
+
+  for (pjsip_param* param = tel_uri->other_param.next;
+       param != &tel_uri->other_param;
+       param = param->next)
   {
-    std::string new_user = PJUtils::pj_str_to_string(&twin_prefix->value) +
-              PJUtils::pj_str_to_string(&((pjsip_sip_uri*)req_uri)->user);
-    ((pjsip_sip_uri*)req_uri)->user = pj_strdup3(pool,
-                                                 new_user.c_str());
+    user_len = GeminiUtils::append_tel_param(param->name.ptr,
+                                             param->name.slen,
+                                             param->value.ptr,
+                                             param->value.slen,
+                                             user,
+                                             user_len,
+                                             MAX_USER_LEN);
   }
+
+  if (user_len < 0)
+  {
+    TRC_DEBUG("Unable to convert tel: URI with number %.*s",
+              (int)tel_uri->number.slen, tel_uri->number.ptr);
+    return false;
+  }
+
+  pj_pool_t* pool = get_pool(req);
+  const std::string& home_domain = _mobile_twinned->config().home_domain;
+  pjsip_sip_uri* sip_uri = pjsip_sip_uri_create(pool, PJ_FALSE);
+  pj_str_t user_str;
+  pj_strset(&user_str, user, user_len);
+  pj_strdup(pool, &sip_uri->user, &user_str);
+  pj_strdup2(pool, &sip_uri->host, home_domain.c_str());
+  sip_uri->user_param = pj_str((char*)"phone");
+  req->line.req.uri = (pjsip_uri*)sip_uri;
+
+  TRC_DEBUG("Converted tel: URI to SIP URI");
+  _mobile_twinned->stats().tel_uris_converted.increment();
+  trace_decision(DecisionTrace::REQ_TEL_URI_CONVERTED);
+
+  _mobile_twinned->report_event(trail(), SASEvent::TEL_URI_CONVERTED, req->line.req.uri);
+
+  return true;
 }
 
-bool MobileTwinnedAppServerTsx::accept_contact_header_has_3gpp_ics(pjsip_msg* req)
+int MobileTwinnedAppServerTsx::get_twin_prefixes(pjsip_param* twin_prefixes[],
+                                                 bool& truncated)
 {
-  // Loop through the feature list on every Accept-Contact header
-  // to check whether any contain 'g.3gpp.ics'
-  bool accept_contact_header_has_3gpp_ics = false;
-  pjsip_accept_contact_hdr* accept_header =
-      (pjsip_accept_contact_hdr*)pjsip_msg_find_hdr_by_name(req,
-                                                            &STR_ACCEPT_CONTACT,
-                                                            NULL);
-  while ((accept_header != NULL) && (!accept_contact_header_has_3gpp_ics))
-  {
-    for (pjsip_param* feature_param = accept_header->feature_set.next;
-         (feature_param != &accept_header->feature_set) &&
-         (!accept_contact_header_has_3gpp_ics);
-         feature_param = feature_param->next)
+  int num_twins = 0;
+  truncated = false;
+  const pjsip_route_hdr* route_header = route_hdr();
+
+  if (route_header != NULL)
+  {
+    pjsip_sip_uri* route_hdr_uri = (pjsip_sip_uri*)route_header->name_addr.uri;
+
+    for (pjsip_param* param = route_hdr_uri->other_param.next;
+         param != &route_hdr_uri->other_param;
+         param = param->next)
     {
-      if (pj_stricmp(&feature_param->name, &STR_3GPP_ICS) == 0)
+      if (GeminiUtils::tag_matches(&param->name, TAG_TWIN_PREFIX))
       {
-        std::string ics_values = PJUtils::pj_str_to_string(&feature_param->value);
-        accept_contact_header_has_3gpp_ics =
-            ((ics_values.find(STR_SERVER) != std::string::npos) ||
-            (ics_values.find(STR_PRINCIPAL) != std::string::npos));
+        if (num_twins == MAX_TWINS)
+        {
+          TRC_WARNING("Ignoring twin-prefix %.*s - only %d native devices are supported",
+                      (int)param->value.slen, param->value.ptr, MAX_TWINS);
+          truncated = true;
+          continue;
+        }
+
+        twin_prefixes[num_twins++] = param;
       }
     }
+  }
+
+  if (num_twins == 0)
+  {
+    twin_prefixes[num_twins++] = NULL;
+  }
+
+  return num_twins;
+}
+
+void MobileTwinnedAppServerTsx::set_up_voip_fork(pjsip_msg* req)
+{
+  // Don't add headers that are already there (for example because the
+  // request has spiralled through Gemini before).
+  bool add_reject_colocated_voip = need_contact_hdr(req, REJECT_WITH_TWIN);
+  bool add_reject_native = need_contact_hdr(req, REJECT_3GPP_ICS);
+
+  LegMutation mutation(this,
+                       req,
+                       LEG_VOIP,
+                       add_reject_colocated_voip + add_reject_native);
+
+  if (add_reject_colocated_voip)
+  {
+    pjsip_reject_contact_hdr* reject_hdr =
+                          pjsip_reject_contact_hdr_create(mutation.pool());
+    pjsip_param* reject_colocated_voip = mutation.new_param(STR_WITH_TWIN);
+    pj_list_insert_after(&reject_hdr->feature_set, reject_colocated_voip);
+    mutation.add_hdr(req, reject_hdr);
+  }
+
+  // We also need a Reject-Contact header containg "g.3gpp.ics", to
+  // ensure that this never matches a native client without a
+  // colocated VoIP phone (which should be rung by the other fork).
+  if (add_reject_native)
+  {
+    pjsip_reject_contact_hdr* reject_hdr2 =
+                          pjsip_reject_contact_hdr_create(mutation.pool());
+    pjsip_param* reject_native = mutation.new_param(STR_3GPP_ICS);
+    reject_native->value = TAG_3GPP_ICS_SERVER_PRINCIPAL.str;
+    pj_list_insert_after(&reject_hdr2->feature_set, reject_native);
+    mutation.add_hdr(req, reject_hdr2);
+  }
+}
+
+void MobileTwinnedAppServerTsx::send_native_forks(pjsip_msg* req,
+                                                  pjsip_param* twin_prefixes[],
+                                                  int num_twins)
+{
+  pjsip_msg* native_reqs[MAX_TWINS];
+  native_reqs[0] = req; req = NULL;
+
+  for (int ii = 1; ii < num_twins; ++ii)
+  {
+    native_reqs[ii] = clone_request(native_reqs[0]);
+  }
+
+  for (int ii = 0; ii < num_twins; ++ii)
+  {
+    set_up_native_fork(native_reqs[ii], twin_prefixes[ii]);
+
+    _mobile_twinned->report_event(trail(), SASEvent::FORKING_ON_REQ,
+                                  native_reqs[ii]->line.req.uri);
+
+    send_fork(native_reqs[ii], LEG_NATIVE);
+  }
+}
+
+GeminiLegType MobileTwinnedAppServerTsx::memoised_subscribe_leg(pjsip_msg* req)
+{
+  SubscribeMemo* memo = _mobile_twinned->config().subscribe_memo;
+
+  if ((memo == NULL) || (req->line.req.method.id == PJSIP_INVITE_METHOD))
+  {
+    return NUM_LEG_TYPES;
+  }
+
+  pjsip_event_hdr* event_hdr = (pjsip_event_hdr*)
+                       pjsip_msg_find_hdr_by_names(req,
+                                                   &TAG_EVENT.str,
+                                                   &TAG_EVENT_SHORT.str,
+                                                   NULL);
+
+  if (event_hdr == NULL)
+  {
+    return NUM_LEG_TYPES;
+  }
+
+  pjsip_sip_uri* sip_uri = (pjsip_sip_uri*)req->line.req.uri;
+  _subscribe_key = SubscribeMemo::key(
+                          PJUtils::pj_str_to_string(&sip_uri->user) + "@" +
+                            PJUtils::pj_str_to_string(&sip_uri->host),
+                          PJUtils::pj_str_to_string(&event_hdr->event_type));
+
+  return memo->get_leg(_subscribe_key);
+}
+
+void MobileTwinnedAppServerTsx::fall_back_from_memo(int fork_id,
+                                                    int status_code)
+{
+  TRC_DEBUG("Memoised leg rejected the SUBSCRIBE - forking to the other leg");
+  _mobile_twinned->report_event(trail(), SASEvent::SUBSCRIBE_MEMO_FALLBACK,
+                                NULL,
+                                {(uint32_t)_memo_leg, (uint32_t)status_code});
+
+  _mobile_twinned->stats().subscribe_memo_fallbacks.increment();
+  set_subscribe_leg(NUM_LEG_TYPES);
+  trace_decision(DecisionTrace::MEMO_FALLBACK, fork_id, status_code);
+
+  GeminiLegType memo_leg = _memo_leg;
+  _memo_leg = NUM_LEG_TYPES;
+  pjsip_msg* req = original_request();
+
+  if (memo_leg == LEG_VOIP)
+  {
+    // Any truncation was counted when the request was first received.
+    pjsip_param* twin_prefixes[MAX_TWINS];
+    bool twins_truncated;
+    int num_twins = get_twin_prefixes(twin_prefixes, twins_truncated);
+    send_native_forks(req, twin_prefixes, num_twins);
+  }
+  else
+  {
+    set_up_voip_fork(req);
+    send_fork(req, LEG_VOIP);
+  }
+}
+
+void MobileTwinnedAppServerTsx::learn_subscribe_leg()
+{
+  if ((_subscribe_key.empty()) || (_memo_leg != NUM_LEG_TYPES))
+  {
+    return;
+  }
+
+  bool accepted[NUM_LEG_TYPES] = {false};
+
+  for (int ii = 0; ii < _num_forks; ++ii)
+  {
+    if (_forks[ii].final_code == 0)
+    {
+      // Still waiting for this fork.
+      return;
+    }
+
+    if (_forks[ii].final_code < PJSIP_SC_MULTIPLE_CHOICES)
+    {
+      accepted[_forks[ii].leg_type] = true;
+    }
+  }
 
-    accept_header =
-     (pjsip_accept_contact_hdr*)pjsip_msg_find_hdr_by_name(req,
-                                                           &STR_ACCEPT_CONTACT,
-                                                           accept_header->next);
+  // Only memoise a leg if it was the only one to accept - if both did, the
+  // subscriber needs subscriptions to both.
+  if (accepted[LEG_VOIP] != accepted[LEG_NATIVE])
+  {
+    set_subscribe_leg(accepted[LEG_VOIP] ? LEG_VOIP : LEG_NATIVE);
   }
+  else
+  {
+    set_subscribe_leg(NUM_LEG_TYPES);
+  }
+}
 
-  return accept_contact_header_has_3gpp_ics;
+void MobileTwinnedAppServerTsx::set_up_native_fork(pjsip_msg* req,
+                                                   pjsip_param* twin_prefix)
+{
+  bool add_force_native = need_contact_hdr(req, ACCEPT_3GPP_ICS);
+  bool add_reject_colocated_voip = need_contact_hdr(req, REJECT_WITH_TWIN);
+
+  // Append the twin prefix (if set) to the request URI, and add an
+  // Accept-Contact header specifying g.3gpp.ics.
+  LegMutation mutation(this,
+                       req,
+                       LEG_NATIVE,
+                       add_force_native + add_reject_colocated_voip,
+                       twin_prefix_bytes(req->line.req.uri, twin_prefix));
+  add_twin_prefix(req->line.req.uri, twin_prefix, mutation);
+
+  if (add_force_native)
+  {
+    pjsip_accept_contact_hdr* accept_hdr =
+                           pjsip_accept_contact_hdr_create(mutation.pool());
+    accept_hdr->explicit_match = true;
+    accept_hdr->required_match = true;
+    pjsip_param* force_native = mutation.new_param(STR_3GPP_ICS);
+    force_native->value = TAG_3GPP_ICS_SERVER_PRINCIPAL.str;
+    pj_list_insert_after(&accept_hdr->feature_set, force_native);
+    mutation.add_hdr(req, accept_hdr);
+  }
+
+  // Add Reject-Contact "+sip.with-twin", to guard against the
+  // unexpected case where a phone specifies both "+sip.with-twin" and "+g.3gpp.ics".
+  if (add_reject_colocated_voip)
+  {
+    pjsip_reject_contact_hdr* reject_hdr =
+                           pjsip_reject_contact_hdr_create(mutation.pool());
+    pjsip_param* reject_colocated_voip = mutation.new_param(STR_WITH_TWIN);
+    pj_list_insert_after(&reject_hdr->feature_set, reject_colocated_voip);
+    mutation.add_hdr(req, reject_hdr);
+  }
+}
+
+pj_size_t MobileTwinnedAppServerTsx::twin_prefix_bytes(pjsip_uri* req_uri,
+                                                       pjsip_param* twin_prefix)
+{
+  return ((twin_prefix != NULL) && (twin_prefix->value.slen != 0)) ?
+           twin_prefix->value.slen + ((pjsip_sip_uri*)req_uri)->user.slen :
+           0;
+}
+
+void MobileTwinnedAppServerTsx::add_twin_prefix(pjsip_uri* req_uri,
+                                                pjsip_param* twin_prefix,
+                                                LegMutation& mutation)
+{
+  if ((twin_prefix != NULL) && (twin_prefix->value.slen != 0))
+  {
+    pj_str_t& user = ((pjsip_sip_uri*)req_uri)->user;
+    pj_size_t len = twin_prefix_bytes(req_uri, twin_prefix);
+    char* new_user = mutation.new_string(len);
+    pj_memcpy(new_user, twin_prefix->value.ptr, twin_prefix->value.slen);
+    pj_memcpy(new_user + twin_prefix->value.slen, user.ptr, user.slen);
+    user.ptr = new_user;
+    user.slen = len;
+    mutation.added_bytes(twin_prefix->value.slen);
+  }
+}
+
+void MobileTwinnedAppServerTsx::set_up_mobile_voip_fork(pjsip_msg* req)
+{
+  if (!need_contact_hdr(req, ACCEPT_WITH_TWIN))
+  {
+    return;
+  }
+
+  LegMutation mutation(this, req, LEG_MOBILE_VOIP, 1);
+  pjsip_accept_contact_hdr* new_hdr =
+                           pjsip_accept_contact_hdr_create(mutation.pool());
+  new_hdr->explicit_match = true;
+  new_hdr->required_match = true;
+  pjsip_param* force_twinned = mutation.new_param(STR_WITH_TWIN);
+  pj_list_insert_after(&new_hdr->feature_set, force_twinned);
+  mutation.add_hdr(req, new_hdr);
+}
+
+bool MobileTwinnedAppServerTsx::need_contact_hdr(pjsip_msg* req,
+                                                 GeminiContactHeader contact_hdr)
+{
+  if (existing_contact_headers(req) & (1 << contact_hdr))
+  {
+    _mobile_twinned->stats().contact_headers_skipped.increment();
+    return false;
+  }
+
+  return true;
+}
+
+int MobileTwinnedAppServerTsx::existing_contact_headers(pjsip_msg* req)
+{
+  if (_existing_contact_headers < 0)
+  {
+    int truncated;
+    _existing_contact_headers = GeminiUtils::contact_headers_present(
+                             req,
+                             _mobile_twinned->config().accept_contact_limits,
+                             truncated);
+    count_truncated_scan(truncated);
+
+    if (_existing_contact_headers != 0)
+    {
+      TRC_DEBUG("Request already has some of Gemini's headers (0x%x)",
+                _existing_contact_headers);
+    }
+  }
+
+  return _existing_contact_headers;
+}
+
+MobileTwinnedAppServerTsx::LegMutation::LegMutation(
+                                         MobileTwinnedAppServerTsx* tsx,
+                                         pjsip_msg* req,
+                                         GeminiLegType leg_type,
+                                         int num_params,
+                                         pj_size_t string_bytes) :
+  _tsx(tsx),
+  _pool(tsx->get_pool(req)),
+  _leg_type(leg_type),
+  _reserved_params(NULL),
+  _reserved_num_params(0),
+  _reserved_strings(NULL),
+  _reserved_string_bytes(0),
+  _used_before(0),
+  _capacity_before(0),
+  _wire_bytes(0)
+{
+  const MobileTwinnedAppServer::Config& config = tsx->_mobile_twinned->config();
+
+  if (config.record_pool_usage)
+  {
+    _used_before = pj_pool_get_used_size(_pool);
+    _capacity_before = pj_pool_get_capacity(_pool);
+  }
+
+  if (config.reserve_pool)
+  {
+    // Reserve everything in one go. The parameters are at the start of the
+    // block (which the pool aligns), and the strings after them, so the
+    // parameters stay aligned whichever order the changes allocate them in.
+    pj_size_t param_bytes = num_params * sizeof(pjsip_param);
+
+    if (param_bytes + string_bytes != 0)
+    {
+      char* reserved = (char*)pj_pool_alloc(_pool, param_bytes + string_bytes);
+      _reserved_params = (pjsip_param*)reserved;
+      _reserved_num_params = num_params;
+      _reserved_strings = reserved + param_bytes;
+      _reserved_string_bytes = string_bytes;
+    }
+  }
+}
+
+MobileTwinnedAppServerTsx::LegMutation::~LegMutation()
+{
+  MobileTwinnedAppServer* as = _tsx->_mobile_twinned;
+  GeminiStats& stats = as->stats();
+
+  if (as->config().record_pool_usage)
+  {
+    as->record(stats.wire_bytes_added[_leg_type], _wire_bytes);
+    pj_size_t used = pj_pool_get_used_size(_pool);
+    as->record(stats.pool_bytes_added[_leg_type], used - _used_before);
+    as->record(stats.pool_used_bytes[_leg_type], used);
+
+    if (pj_pool_get_capacity(_pool) > _capacity_before)
+    {
+      stats.pool_expansions[_leg_type].increment();
+    }
+  }
+}
+
+pjsip_param* MobileTwinnedAppServerTsx::LegMutation::new_param(const pj_str_t& name)
+{
+  pjsip_param* param;
+
+  if (_reserved_num_params > 0)
+  {
+    param = _reserved_params++;
+    _reserved_num_params--;
+  }
+  else
+  {
+    param = PJ_POOL_ALLOC_T(_pool, pjsip_param);
+  }
+
+  param->name = name;
+  param->value.ptr = NULL;
+  param->value.slen = 0;
+  return param;
+}
+
+char* MobileTwinnedAppServerTsx::LegMutation::new_string(pj_size_t len)
+{
+  if (len <= _reserved_string_bytes)
+  {
+    char* str = _reserved_strings;
+    _reserved_strings += len;
+    _reserved_string_bytes -= len;
+    return str;
+  }
+
+  return (char*)pj_pool_alloc(_pool, len);
+}
+
+void MobileTwinnedAppServerTsx::LegMutation::add_hdr(pjsip_msg* req,
+                                                     void* hdr)
+{
+  pjsip_msg_add_hdr(req, (pjsip_hdr*)hdr);
+
+  if (_tsx->_mobile_twinned->config().record_pool_usage)
+  {
+    // Print the header to find its size on the wire (plus its CRLF). Gemini's
+    // headers are all well within the buffer.
+    char buf[256];
+    int len = pjsip_hdr_print_on(hdr, buf, sizeof(buf));
+
+    if (len > 0)
+    {
+      _wire_bytes += len + 2;
+    }
+  }
+}
+
+int MobileTwinnedAppServerTsx::send_fork(pjsip_msg*& req,
+                                         GeminiLegType leg_type)
+{
+  static const DecisionTrace::Event FORK_EVENTS[NUM_LEG_TYPES] =
+    {DecisionTrace::FORK_TO_VOIP,
+     DecisionTrace::FORK_TO_NATIVE,
+     DecisionTrace::FORK_TO_MOBILE_VOIP};
+
+  if (_mobile_twinned->config().tenant_accounting != NULL)
+  {
+    // Sprout takes ownership of the request when we send it, so measure its
+    // pool first.
+    account(TenantAccounting::FORKS);
+    account(TenantAccounting::POOL_BYTES,
+            pj_pool_get_used_size(get_pool(req)));
+  }
+
+  int fork_id = send_request(req);
+  trace_decision(FORK_EVENTS[leg_type], fork_id);
+
+  if (_num_forks < MAX_FORKS)
+  {
+    ForkRecord& fork = _forks[_num_forks++];
+    fork.fork_id = fork_id;
+    fork.leg_type = leg_type;
+    fork.sent_ms = _mobile_twinned->now_ms();
+    fork.first_18x_ms = 0;
+    fork.final_ms = 0;
+    fork.final_code = 0;
+  }
+
+  return fork_id;
+}
+
+MobileTwinnedAppServerTsx::ForkRecord*
+                 MobileTwinnedAppServerTsx::track_fork(pjsip_msg* rsp, int fork_id)
+{
+  ForkRecord* fork = NULL;
+
+  for (int ii = 0; ii < _num_forks; ++ii)
+  {
+    if (_forks[ii].fork_id == fork_id)
+    {
+      fork = &_forks[ii];
+      break;
+    }
+  }
+
+  if ((fork == NULL) || (fork->final_ms != 0))
+  {
+    return fork;
+  }
+
+  GeminiStats& stats = _mobile_twinned->stats();
+  int status_code = rsp->line.status.code;
+  uint64_t now_ms = _mobile_twinned->now_ms();
+
+  if ((status_code >= PJSIP_SC_RINGING) &&
+      (status_code < PJSIP_SC_OK) &&
+      (fork->first_18x_ms == 0))
+  {
+    fork->first_18x_ms = now_ms;
+    _mobile_twinned->record(stats.time_to_ring_ms[fork->leg_type],
+                            now_ms - fork->sent_ms);
+
+    if ((!_rung) && (_mobile_twinned->config().detailed_timings))
+    {
+      _rung = true;
+      _mobile_twinned->record(stats.post_dial_delay_ms[fork->leg_type],
+                              now_ms - _start_ms);
+    }
+  }
+  else if (status_code >= PJSIP_SC_OK)
+  {
+    fork->final_ms = now_ms;
+    fork->final_code = status_code;
+
+    if (status_code < PJSIP_SC_MULTIPLE_CHOICES)
+    {
+      _mobile_twinned->record(stats.time_to_answer_ms[fork->leg_type],
+                              now_ms - fork->sent_ms);
+    }
+    else if (_mobile_twinned->config().detailed_timings)
+    {
+      _mobile_twinned->record(stats.time_to_fail_ms[fork->leg_type],
+                              now_ms - fork->sent_ms);
+    }
+  }
+
+  return fork;
+}
+
+bool MobileTwinnedAppServerTsx::all_native_forks_unavailable()
+{
+  for (int ii = 0; ii < _num_forks; ++ii)
+  {
+    if ((_forks[ii].leg_type == LEG_NATIVE) &&
+        (_forks[ii].final_code != PJSIP_SC_TEMPORARILY_UNAVAILABLE))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void MobileTwinnedAppServerTsx::trace_decision(DecisionTrace::Event event,
+                                               int fork_id,
+                                               int status_code)
+{
+  DecisionTrace* decision_trace = _mobile_twinned->config().decision_trace;
+
+  if (decision_trace != NULL)
+  {
+    decision_trace->record(trail(), event, fork_id, status_code);
+  }
+}
+
+void MobileTwinnedAppServerTsx::record_twin_state(TwinStateCache::State state)
+{
+  // We only record the first thing we learn about the native twin on each
+  // transaction.
+  if (!_twin_state_key.empty())
+  {
+    TwinStateCache* cache = _mobile_twinned->config().twin_state_cache;
+    GeminiWorker* worker = _mobile_twinned->config().worker;
+
+    if (worker != NULL)
+    {
+      worker->set_native_state(cache, _twin_state_key, state);
+    }
+    else
+    {
+      cache->set_native_state(_twin_state_key, state);
+    }
+
+    _twin_state_key.clear();
+  }
+}
+
+void MobileTwinnedAppServerTsx::set_subscribe_leg(GeminiLegType leg_type)
+{
+  SubscribeMemo* memo = _mobile_twinned->config().subscribe_memo;
+  GeminiWorker* worker = _mobile_twinned->config().worker;
+
+  if (worker != NULL)
+  {
+    worker->set_subscribe_leg(memo, _subscribe_key, leg_type);
+  }
+  else if (leg_type == NUM_LEG_TYPES)
+  {
+    memo->forget(_subscribe_key);
+  }
+  else
+  {
+    memo->set_leg(_subscribe_key, leg_type);
+  }
+}
+
+bool MobileTwinnedAppServerTsx::all_forks_failed()
+{
+  for (int ii = 0; ii < _num_forks; ++ii)
+  {
+    if ((_forks[ii].final_code == 0) ||
+        (_forks[ii].final_code < PJSIP_SC_MULTIPLE_CHOICES))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool MobileTwinnedAppServerTsx::native_fork_in_flight(pjsip_msg* req)
+{
+  NativeForkDedup* dedup = _mobile_twinned->config().native_fork_dedup;
+
+  if ((dedup == NULL) || (req->line.req.method.id != PJSIP_INVITE_METHOD))
+  {
+    return false;
+  }
+
+  pjsip_sip_uri* sip_uri = (pjsip_sip_uri*)req->line.req.uri;
+  uint64_t key = NativeForkDedup::key(&PJSIP_MSG_CID_HDR(req)->id,
+                                      &sip_uri->user,
+                                      &sip_uri->host);
+
+  uint64_t owner;
+
+  if (!dedup->claim(key, owner))
+  {
+    return true;
+  }
+
+  if (owner == 0)
+  {
+    // The table had no room to record the call, so there's nothing to
+    // release.
+    _mobile_twinned->stats().native_fork_dedup_overflows.increment();
+    return false;
+  }
+
+  _native_fork_key = key;
+  _native_fork_owner = owner;
+  return false;
+}
+
+void MobileTwinnedAppServerTsx::release_native_fork()
+{
+  if (_native_fork_key == 0)
+  {
+    return;
+  }
+
+  for (int ii = 0; ii < _num_forks; ++ii)
+  {
+    if ((_forks[ii].leg_type == LEG_NATIVE) && (_forks[ii].final_code == 0))
+    {
+      // Still paging this native device.
+      return;
+    }
+  }
+
+  _mobile_twinned->config().native_fork_dedup->release(_native_fork_key,
+                                                       _native_fork_owner);
+  _native_fork_key = 0;
+}
+
+bool MobileTwinnedAppServerTsx::shadow_sampled()
+{
+  // Count calls per thread, so that sampling doesn't share a counter
+  // between threads.
+  static thread_local uint32_t t_forked_calls = 0;
+  int sample_rate = _mobile_twinned->config().shadow_sample_rate;
+
+  if ((sample_rate <= 0) || ((++t_forked_calls % sample_rate) != 0))
+  {
+    return false;
+  }
+
+  GeminiStats& stats = _mobile_twinned->stats();
+
+  for (int ii = 0; ii < NUM_SHADOW_POLICIES; ++ii)
+  {
+    stats.shadow[ii].calls.increment();
+  }
+
+  return true;
+}
+
+void MobileTwinnedAppServerTsx::shadow_on_retry(uint64_t now_ms)
+{
+  GeminiStats& stats = _mobile_twinned->stats();
+
+  // Forking in parallel would have reached the mobile hosted VoIP clients
+  // as soon as the call arrived.
+  GeminiShadowStats& parallel = stats.shadow[SHADOW_PARALLEL_FORK];
+  parallel.earlier_retries.increment();
+  _mobile_twinned->record(parallel.latency_saved_ms, now_ms - _start_ms);
+
+  // Hedging would have reached them once the hedge delay expired, if no
+  // native device had rung by then.
+  uint64_t hedge_ms = hedge_retry_ms(now_ms);
+
+  if (hedge_ms != 0)
+  {
+    GeminiShadowStats& hedged = stats.shadow[SHADOW_HEDGED_RETRY];
+    hedged.earlier_retries.increment();
+    _mobile_twinned->record(hedged.latency_saved_ms, now_ms - hedge_ms);
+  }
+}
+
+void MobileTwinnedAppServerTsx::shadow_on_response(int status_code)
+{
+  // The call completes without a retry once it's answered or every fork has
+  // failed. (Once we've retried, the retry has already been evaluated.)
+  if ((_shadow) &&
+      (!_attempted_mobile_voip_client) &&
+      (status_code >= PJSIP_SC_OK) &&
+      ((status_code < PJSIP_SC_MULTIPLE_CHOICES) || (all_forks_failed())))
+  {
+    shadow_on_complete();
+    _shadow = false;
+  }
+}
+
+void MobileTwinnedAppServerTsx::shadow_on_complete()
+{
+  GeminiStats& stats = _mobile_twinned->stats();
+
+  // The call didn't need the mobile hosted VoIP clients, so forking to them
+  // in parallel would have been a wasted fork. Hedging would also have
+  // wasted one if nothing happened on the call before the hedge delay.
+  stats.shadow[SHADOW_PARALLEL_FORK].extra_forks.increment();
+
+  if (hedge_retry_ms(_mobile_twinned->now_ms()) != 0)
+  {
+    stats.shadow[SHADOW_HEDGED_RETRY].extra_forks.increment();
+  }
+}
+
+uint64_t MobileTwinnedAppServerTsx::hedge_retry_ms(uint64_t now_ms)
+{
+  // The hedge is timed from the first fork to a native device, and is
+  // called off by any native device ringing (or responding), or by the call
+  // being answered.
+  uint64_t native_sent_ms = 0;
+  uint64_t progress_ms = now_ms;
+
+  for (int ii = 0; ii < _num_forks; ++ii)
+  {
+    const ForkRecord& fork = _forks[ii];
+
+    if (fork.leg_type == LEG_NATIVE)
+    {
+      if ((native_sent_ms == 0) || (fork.sent_ms < native_sent_ms))
+      {
+        native_sent_ms = fork.sent_ms;
+      }
+
+      uint64_t fork_progress_ms = (fork.first_18x_ms != 0) ?
+                                    fork.first_18x_ms : fork.final_ms;
+
+      if ((fork_progress_ms != 0) && (fork_progress_ms < progress_ms))
+      {
+        progress_ms = fork_progress_ms;
+      }
+    }
+    else if ((fork.final_ms != 0) &&
+             (fork.final_code < PJSIP_SC_MULTIPLE_CHOICES) &&
+             (fork.final_ms < progress_ms))
+    {
+      progress_ms = fork.final_ms;
+    }
+  }
+
+  uint64_t hedge_ms = native_sent_ms +
+                      _mobile_twinned->config().shadow_hedge_ms;
+
+  return ((native_sent_ms != 0) && (hedge_ms < progress_ms)) ? hedge_ms : 0;
+}
+
+void MobileTwinnedAppServerTsx::account(TenantAccounting::Counter counter,
+                                        uint64_t value)
+{
+  TenantAccounting* accounting = _mobile_twinned->config().tenant_accounting;
+
+  if (accounting != NULL)
+  {
+    accounting->add(_tenant, counter, value);
+  }
+}
+
+bool MobileTwinnedAppServerTsx::accept_contact_header_has_3gpp_ics(pjsip_msg* req)
+{
+  int truncated;
+  bool has_3gpp_ics = GeminiUtils::accept_contact_has_3gpp_ics(
+                           req,
+                           _mobile_twinned->config().accept_contact_limits,
+                           truncated);
+  count_truncated_scan(truncated);
+
+  return has_3gpp_ics;
+}
+
+void MobileTwinnedAppServerTsx::count_truncated_scan(int truncated)
+{
+  if (truncated != 0)
+  {
+    TRC_DEBUG("Scan of contact headers cut short (limits 0x%x)",
+              truncated);
+
+    for (int limit = 0; limit < NUM_SCAN_LIMITS; ++limit)
+    {
+      if (truncated & (1 << limit))
+      {
+        _mobile_twinned->stats().accept_contact_scans_truncated[limit].increment();
+      }
+    }
+  }
 }
@@ -0,0 +1,165 @@
+/**
+ * @file nativeforkdedup.cpp Implementation of the table of native forks in
+ * flight, used to avoid paging a native twin twice for the same call.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdlib.h>
+#include <new>
+
+#include "log.h"
+#include "nativeforkdedup.h"
+#include "geminiutils.h"
+
+/// Adds a string to a 64-bit FNV-1a hash.
+static uint64_t hash_str(uint64_t hash, const pj_str_t* str)
+{
+  for (pj_ssize_t ii = 0; ii < str->slen; ++ii)
+  {
+    hash = (hash ^ (uint8_t)str->ptr[ii]) * 1099511628211ull;
+  }
+
+  // Separate this string from the next one.
+  return (hash ^ 0xff) * 1099511628211ull;
+}
+
+NativeForkDedup::NativeForkDedup(int window_ms,
+                                 uint32_t capacity,
+                                 GeminiUtils::Clock clock) :
+  _window_ms(window_ms),
+  _stripe_slots((capacity + NUM_STRIPES - 1) / NUM_STRIPES),
+  _max_probes((_stripe_slots < MAX_PROBES) ? _stripe_slots : MAX_PROBES),
+  _clock(clock),
+  _overflows(0)
+{
+  for (int ii = 0; ii < NUM_STRIPES; ++ii)
+  {
+    pthread_mutex_init(&_stripes[ii].lock, NULL);
+    _stripes[ii].entries = new Entry[_stripe_slots]();
+    _stripes[ii].next_owner = 1;
+  }
+}
+
+void* NativeForkDedup::operator new(size_t size)
+{
+  void* ptr;
+
+  if (posix_memalign(&ptr, alignof(NativeForkDedup), size) != 0)
+  {
+    // LCOV_EXCL_START
+    throw std::bad_alloc();
+    // LCOV_EXCL_STOP
+  }
+
+  return ptr;
+}
+
+void NativeForkDedup::operator delete(void* ptr)
+{
+  free(ptr);
+}
+
+NativeForkDedup::~NativeForkDedup()
+{
+  for (int ii = 0; ii < NUM_STRIPES; ++ii)
+  {
+    delete[] _stripes[ii].entries;
+    pthread_mutex_destroy(&_stripes[ii].lock);
+  }
+}
+
+uint64_t NativeForkDedup::key(const pj_str_t* call_id,
+                              const pj_str_t* callee_user,
+                              const pj_str_t* callee_host)
+{
+  uint64_t hash = 14695981039346656037ull;
+  hash = hash_str(hash, call_id);
+  hash = hash_str(hash, callee_user);
+  hash = hash_str(hash, callee_host);
+
+  // 0 marks an empty slot.
+  return (hash != 0) ? hash : 1;
+}
+
+bool NativeForkDedup::claim(uint64_t key, uint64_t& owner)
+{
+  Stripe& stripe = stripe_for(key);
+  uint64_t now_ms = this->now_ms();
+  bool claimed = true;
+  Entry* free_entry = NULL;
+  owner = 0;
+
+  pthread_mutex_lock(&stripe.lock);
+
+  // A call can only be in one of the slots within MAX_PROBES of its home
+  // slot, so we check all of those (and no more) for it.
+  uint32_t home = (uint32_t)(key / NUM_STRIPES);
+
+  for (uint32_t ii = 0; ii < _max_probes; ++ii)
+  {
+    Entry& entry = stripe.entries[(home + ii) % _stripe_slots];
+
+    if ((entry.key == 0) || (entry.expiry_ms <= now_ms))
+    {
+      if (free_entry == NULL)
+      {
+        free_entry = &entry;
+      }
+    }
+    else if (entry.key == key)
+    {
+      claimed = false;
+      break;
+    }
+  }
+
+  if ((claimed) && (free_entry != NULL))
+  {
+    owner = stripe.next_owner++;
+    free_entry->key = key;
+    free_entry->owner = owner;
+    free_entry->expiry_ms = now_ms + _window_ms;
+  }
+
+  pthread_mutex_unlock(&stripe.lock);
+
+  if ((claimed) && (free_entry == NULL))
+  {
+    TRC_DEBUG("No room to record native fork - not deduplicating it");
+    _overflows++;
+  }
+
+  return claimed;
+}
+
+void NativeForkDedup::release(uint64_t key, uint64_t owner)
+{
+  Stripe& stripe = stripe_for(key);
+
+  pthread_mutex_lock(&stripe.lock);
+  uint32_t home = (uint32_t)(key / NUM_STRIPES);
+
+  for (uint32_t ii = 0; ii < _max_probes; ++ii)
+  {
+    Entry& entry = stripe.entries[(home + ii) % _stripe_slots];
+
+    if ((entry.key == key) && (entry.owner == owner))
+    {
+      entry.key = 0;
+      break;
+    }
+  }
+
+  pthread_mutex_unlock(&stripe.lock);
+}
+
+NativeForkDedup::Stripe& NativeForkDedup::stripe_for(uint64_t key)
+{
+  return _stripes[key % NUM_STRIPES];
+}
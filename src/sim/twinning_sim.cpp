@@ -0,0 +1,811 @@
+/**
+ * @file twinning_sim.cpp Discrete-event simulator for the twinning
+ * strategies of the mobile twinned AS which is part of gemini.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+// Simulates calls to a twinned subscriber, to compare the post-dial delay,
+// forks per call and downstream load of twinning strategies without
+// experimenting on live subscribers.
+//
+// Each call samples an outcome for each type of leg (the VoIP clients, the
+// native device and the mobile hosted VoIP clients) from a configured
+// distribution. Gemini's policy - fork to the VoIP clients and the native
+// device, and retry to the mobile hosted VoIP clients on a 480 from the
+// native device - is simulated by driving the real MobileTwinnedAppServerTsx
+// on a virtual clock, with a helper that plays back the sampled responses
+// (and cancels the other forks once a call is answered, as Sprout does).
+// The alternatives Gemini doesn't implement - forking to the mobile hosted
+// VoIP clients in parallel, and hedging - are modelled by the simulator from
+// the same sampled outcomes, so every policy sees exactly the same calls.
+// The run is deterministic for a given seed.
+//
+// The simulator is a long-running tool rather than a test, so it's
+// disabled by default. Run it with
+//
+//   --gtest_also_run_disabled_tests --gtest_filter=TwinningSim.DISABLED_Run
+//
+// It is configured through the environment:
+//
+//   GEMINI_SIM_CALLS        - Number of calls to simulate (default 10000 -
+//                             use millions for results to act on).
+//   GEMINI_SIM_SEED         - Seed for the outcomes (default 1).
+//   GEMINI_SIM_HEDGE_MS     - Hedge delay of the hedged retry policy
+//                             (default 2000).
+//   GEMINI_SIM_VOIP         - Outcomes of the fork to the VoIP clients.
+//   GEMINI_SIM_NATIVE       - Outcomes of the fork to the native device.
+//   GEMINI_SIM_MOBILE_VOIP  - Outcomes of the fork to the mobile hosted VoIP
+//                             clients.
+//
+// Outcomes are a comma-separated list of weight:code:final_ms[:ring_ms],
+// where the times (from the fork being sent) are either a fixed number of
+// milliseconds or a range min-max to pick uniformly from. For example,
+// "0.3:480:8000,0.7:200:6000-12000:2000-4000" is a native device that
+// returns a 480 after 8s 30% of the time, and otherwise rings after 2-4s and
+// is answered after 6-12s.
+
+#include <string>
+#include <vector>
+#include <queue>
+#include <random>
+#include <algorithm>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gtest/gtest.h"
+
+#include "siptest.hpp"
+#include "mockappserver.hpp"
+#include "mobiletwinned.h"
+#include "stack.h"
+#include "pjutils.h"
+#include "custom_headers.h"
+#include "constants.h"
+#include "gemini_constants.h"
+#include "geminiutils.h"
+
+/// The virtual clock the Tsx runs on.
+static uint64_t g_sim_now_ms = 0;
+
+static uint64_t sim_clock()
+{
+  return g_sim_now_ms;
+}
+
+/// How long after a call is answered its other forks return a 487 (the
+/// round trip of the CANCEL).
+static const uint64_t CANCEL_MS = 50;
+
+/// A time, or range of times, in milliseconds.
+struct Latency
+{
+  uint64_t min_ms;
+  uint64_t max_ms;
+};
+
+/// One possible outcome of a fork.
+struct Outcome
+{
+  double weight;
+  int status_code;
+  Latency final;
+
+  /// When the fork rings, if it does.
+  bool rings;
+  Latency ring;
+};
+
+/// An outcome sampled for a fork on a call, as times from the fork being
+/// sent.
+struct SampledOutcome
+{
+  int status_code;
+  uint64_t final_ms;
+
+  /// When the fork rings, or 0 if it doesn't.
+  uint64_t ring_ms;
+};
+
+/// The distribution of outcomes of a type of leg.
+class LegModel
+{
+public:
+  /// Parses the distribution from its configuration.
+  bool parse(const std::string& config)
+  {
+    _outcomes.clear();
+    _total_weight = 0;
+    size_t start = 0;
+
+    while (start < config.length())
+    {
+      size_t end = config.find(',', start);
+      end = (end == std::string::npos) ? config.length() : end;
+      std::string item = config.substr(start, end - start);
+      start = end + 1;
+
+      Outcome outcome;
+      char final_str[64];
+      char ring_str[64] = "";
+
+      if (sscanf(item.c_str(),
+                 "%lf:%d:%63[0-9-]:%63[0-9-]",
+                 &outcome.weight,
+                 &outcome.status_code,
+                 final_str,
+                 ring_str) < 3)
+      {
+        printf("Invalid outcome: %s\n", item.c_str());
+        return false;
+      }
+
+      outcome.final = parse_latency(final_str);
+      outcome.rings = (ring_str[0] != '\0');
+      outcome.ring = parse_latency(ring_str);
+      _total_weight += outcome.weight;
+      _outcomes.push_back(outcome);
+    }
+
+    return !_outcomes.empty();
+  }
+
+  /// Samples an outcome.
+  SampledOutcome sample(std::mt19937_64& rng) const
+  {
+    double pick = std::uniform_real_distribution<double>(0, _total_weight)(rng);
+    const Outcome* outcome = &_outcomes.back();
+
+    for (size_t ii = 0; ii < _outcomes.size(); ++ii)
+    {
+      if (pick < _outcomes[ii].weight)
+      {
+        outcome = &_outcomes[ii];
+        break;
+      }
+
+      pick -= _outcomes[ii].weight;
+    }
+
+    SampledOutcome sampled;
+    sampled.status_code = outcome->status_code;
+    sampled.final_ms = sample_latency(outcome->final, rng);
+    sampled.ring_ms = outcome->rings ? sample_latency(outcome->ring, rng) : 0;
+
+    // A fork can't ring after it's completed.
+    if (sampled.ring_ms >= sampled.final_ms)
+    {
+      sampled.ring_ms = 0;
+    }
+
+    return sampled;
+  }
+
+  /// The status codes of the outcomes.
+  std::vector<int> status_codes() const
+  {
+    std::vector<int> codes;
+
+    for (size_t ii = 0; ii < _outcomes.size(); ++ii)
+    {
+      codes.push_back(_outcomes[ii].status_code);
+    }
+
+    return codes;
+  }
+
+private:
+  static Latency parse_latency(const char* str)
+  {
+    Latency latency = {0, 0};
+
+    if (sscanf(str, "%" SCNu64 "-%" SCNu64, &latency.min_ms, &latency.max_ms) < 2)
+    {
+      latency.max_ms = latency.min_ms;
+    }
+
+    return latency;
+  }
+
+  static uint64_t sample_latency(const Latency& latency, std::mt19937_64& rng)
+  {
+    // Never 0, as the Tsx treats a time of 0 as unset.
+    uint64_t ms = (latency.max_ms > latency.min_ms) ?
+      std::uniform_int_distribution<uint64_t>(latency.min_ms, latency.max_ms)(rng) :
+      latency.min_ms;
+    return (ms != 0) ? ms : 1;
+  }
+
+  std::vector<Outcome> _outcomes;
+  double _total_weight;
+};
+
+/// What a strategy did across all the calls.
+struct StrategyResult
+{
+  StrategyResult(const std::string& strategy_name) :
+    name(strategy_name),
+    calls(0),
+    answered(0),
+    cancels(0)
+  {
+    memset(forks, 0, sizeof(forks));
+  }
+
+  std::string name;
+  uint64_t calls;
+  uint64_t answered;
+
+  /// The forks sent on each type of leg, and the forks cancelled because
+  /// another was answered.
+  uint64_t forks[NUM_LEG_TYPES];
+  uint64_t cancels;
+
+  /// The post-dial delay (to the first 18x or 2xx) of each call that
+  /// alerted, and the time to answer of each call that was answered.
+  std::vector<uint32_t> post_dial_delay_ms;
+  std::vector<uint32_t> time_to_answer_ms;
+};
+
+/// Plays back the sampled responses to the forks the Tsx sends on the
+/// virtual clock. Like the benchmark's helper, this overrides the methods
+/// Gemini calls so they bypass gmock.
+class SimTsxHelper : public MockAppServerTsxHelper
+{
+public:
+  SimTsxHelper(pj_pool_t* pool,
+               pjsip_route_hdr* route,
+               const std::vector<pjsip_msg*>& responses,
+               StrategyResult& result) :
+    _pool(pool),
+    _route(route),
+    _responses(responses),
+    _result(result),
+    _original(NULL),
+    _outcomes(NULL),
+    _next_seq(0),
+    _delivering(-1),
+    _start_ms(0),
+    _alerted(false),
+    _answered(false)
+  {
+  }
+
+  /// Starts a call.
+  void start_call(pjsip_msg* req, const SampledOutcome* outcomes)
+  {
+    // Keep a copy of the request as it was received, as the Tsx changes the
+    // one it's given.
+    _original = pjsip_msg_clone(_pool, req);
+    _outcomes = outcomes;
+    _forks.clear();
+    _start_ms = g_sim_now_ms;
+    _alerted = false;
+    _answered = false;
+    _result.calls++;
+  }
+
+  /// Delivers the next response to the Tsx, moving the clock on to it.
+  ///
+  /// @returns false once there's nothing more to deliver.
+  bool deliver_next(MobileTwinnedAppServerTsx* tsx)
+  {
+    while (!_events.empty())
+    {
+      Event event = _events.top();
+      _events.pop();
+      Fork& fork = _forks[event.fork_id - 1];
+
+      // Drop responses the fork would have sent if it hadn't been
+      // cancelled, or had already completed.
+      if ((fork.complete) || (fork.cancelled != event.cancelled))
+      {
+        continue;
+      }
+
+      g_sim_now_ms = event.time_ms;
+      fork.complete = (event.status_code >= PJSIP_SC_OK);
+      _delivering = event.fork_id - 1;
+      tsx->on_response(_responses[event.status_code], event.fork_id);
+      _delivering = -1;
+      return true;
+    }
+
+    return false;
+  }
+
+  pjsip_msg* original_request() override
+  {
+    return pjsip_msg_clone(_pool, _original);
+  }
+
+  const pjsip_route_hdr* route_hdr() const override
+  {
+    return _route;
+  }
+
+  pjsip_msg* clone_request(pjsip_msg* req) override
+  {
+    return pjsip_msg_clone(_pool, req);
+  }
+
+  pjsip_msg* create_response(pjsip_msg* req,
+                             pjsip_status_code status_code,
+                             const std::string& status_text) override
+  {
+    return _responses[status_code];
+  }
+
+  int send_request(pjsip_msg*& req) override
+  {
+    Fork fork;
+    fork.leg_type = leg_type(req);
+    fork.complete = false;
+    fork.cancelled = false;
+    _forks.push_back(fork);
+    _result.forks[fork.leg_type]++;
+
+    int fork_id = _forks.size();
+    const SampledOutcome& outcome = _outcomes[fork.leg_type];
+
+    if (outcome.ring_ms != 0)
+    {
+      schedule(g_sim_now_ms + outcome.ring_ms, fork_id, PJSIP_SC_RINGING, false);
+    }
+
+    schedule(g_sim_now_ms + outcome.final_ms, fork_id, outcome.status_code, false);
+    return fork_id;
+  }
+
+  void send_response(pjsip_msg*& rsp) override
+  {
+    int status_code = rsp->line.status.code;
+    uint64_t elapsed_ms = g_sim_now_ms - _start_ms;
+
+    if ((!_alerted) &&
+        (status_code >= PJSIP_SC_RINGING) &&
+        (status_code < PJSIP_SC_MULTIPLE_CHOICES))
+    {
+      _alerted = true;
+      _result.post_dial_delay_ms.push_back(elapsed_ms);
+    }
+
+    if ((!_answered) &&
+        (status_code >= PJSIP_SC_OK) &&
+        (status_code < PJSIP_SC_MULTIPLE_CHOICES))
+    {
+      _answered = true;
+      _result.answered++;
+      _result.time_to_answer_ms.push_back(elapsed_ms);
+
+      // Sprout cancels the other forks once one is answered.
+      for (size_t ii = 0; ii < _forks.size(); ++ii)
+      {
+        if ((!_forks[ii].complete) && ((int)ii != _delivering))
+        {
+          _forks[ii].cancelled = true;
+          _result.cancels++;
+          schedule(g_sim_now_ms + CANCEL_MS,
+                   ii + 1,
+                   PJSIP_SC_REQUEST_TERMINATED,
+                   true);
+        }
+      }
+    }
+  }
+
+  void free_msg(pjsip_msg*& msg) override
+  {
+  }
+
+  pj_pool_t* get_pool(const pjsip_msg* msg) override
+  {
+    return _pool;
+  }
+
+  SAS::TrailId trail() const override
+  {
+    return 0;
+  }
+
+private:
+  struct Fork
+  {
+    GeminiLegType leg_type;
+    bool complete;
+    bool cancelled;
+  };
+
+  struct Event
+  {
+    uint64_t time_ms;
+    uint64_t seq;
+    int fork_id;
+    int status_code;
+    bool cancelled;
+
+    /// Orders the queue by time, then by when the events were scheduled, so
+    /// the run is deterministic.
+    bool operator>(const Event& other) const
+    {
+      return (time_ms != other.time_ms) ? (time_ms > other.time_ms) :
+                                          (seq > other.seq);
+    }
+  };
+
+  void schedule(uint64_t time_ms, int fork_id, int status_code, bool cancelled)
+  {
+    Event event = {time_ms, _next_seq++, fork_id, status_code, cancelled};
+    _events.push(event);
+  }
+
+  /// Works out which type of leg a fork is from the Accept-Contact headers
+  /// the Tsx added to it.
+  static GeminiLegType leg_type(pjsip_msg* req)
+  {
+    pjsip_accept_contact_hdr* accept_hdr = (pjsip_accept_contact_hdr*)
+                   pjsip_msg_find_hdr_by_name(req, &STR_ACCEPT_CONTACT, NULL);
+
+    while (accept_hdr != NULL)
+    {
+      if (pjsip_param_find(&accept_hdr->feature_set, &STR_WITH_TWIN) != NULL)
+      {
+        return LEG_MOBILE_VOIP;
+      }
+
+      if (pjsip_param_find(&accept_hdr->feature_set, &STR_3GPP_ICS) != NULL)
+      {
+        return LEG_NATIVE;
+      }
+
+      accept_hdr = (pjsip_accept_contact_hdr*)
+          pjsip_msg_find_hdr_by_name(req, &STR_ACCEPT_CONTACT, accept_hdr->next);
+    }
+
+    return LEG_VOIP;
+  }
+
+  pj_pool_t* _pool;
+  pjsip_route_hdr* _route;
+  const std::vector<pjsip_msg*>& _responses;
+  StrategyResult& _result;
+
+  pjsip_msg* _original;
+  const SampledOutcome* _outcomes;
+  std::vector<Fork> _forks;
+  std::priority_queue<Event, std::vector<Event>, std::greater<Event> > _events;
+  uint64_t _next_seq;
+  int _delivering;
+
+  uint64_t _start_ms;
+  bool _alerted;
+  bool _answered;
+};
+
+/// Models a policy that sends each type of leg at a given time (from the
+/// call arriving), or not at all, against a call's sampled outcomes.
+///
+/// @param outcomes         - The outcome of each type of leg.
+/// @param start_ms         - When each type of leg is sent, or UINT64_MAX if
+///                           it isn't.
+/// @param result           - <out> The policy's results.
+static void model_call(const SampledOutcome* outcomes,
+                       const uint64_t* start_ms,
+                       StrategyResult& result)
+{
+  uint64_t answer_ms = UINT64_MAX;
+
+  for (int leg = 0; leg < NUM_LEG_TYPES; ++leg)
+  {
+    if ((start_ms[leg] != UINT64_MAX) &&
+        (outcomes[leg].status_code >= PJSIP_SC_OK) &&
+        (outcomes[leg].status_code < PJSIP_SC_MULTIPLE_CHOICES))
+    {
+      answer_ms = std::min(answer_ms, start_ms[leg] + outcomes[leg].final_ms);
+    }
+  }
+
+  uint64_t alert_ms = answer_ms;
+  result.calls++;
+
+  for (int leg = 0; leg < NUM_LEG_TYPES; ++leg)
+  {
+    // Legs that would be sent after the call is answered never are.
+    if ((start_ms[leg] == UINT64_MAX) || (start_ms[leg] >= answer_ms))
+    {
+      continue;
+    }
+
+    result.forks[leg]++;
+
+    if ((outcomes[leg].ring_ms != 0) &&
+        (start_ms[leg] + outcomes[leg].ring_ms < alert_ms))
+    {
+      alert_ms = start_ms[leg] + outcomes[leg].ring_ms;
+    }
+
+    if (start_ms[leg] + outcomes[leg].final_ms > answer_ms)
+    {
+      result.cancels++;
+    }
+  }
+
+  if (alert_ms != UINT64_MAX)
+  {
+    result.post_dial_delay_ms.push_back(alert_ms);
+  }
+
+  if (answer_ms != UINT64_MAX)
+  {
+    result.answered++;
+    result.time_to_answer_ms.push_back(answer_ms);
+  }
+}
+
+/// Returns a percentile of a set of times.
+static uint32_t percentile(std::vector<uint32_t>& values, double percentile)
+{
+  if (values.empty())
+  {
+    return 0;
+  }
+
+  size_t rank = std::min(values.size() - 1,
+                         (size_t)((percentile / 100.0) * values.size()));
+  std::nth_element(values.begin(), values.begin() + rank, values.end());
+  return values[rank];
+}
+
+/// Returns the mean of a set of times.
+static double mean(const std::vector<uint32_t>& values)
+{
+  double total = 0;
+
+  for (size_t ii = 0; ii < values.size(); ++ii)
+  {
+    total += values[ii];
+  }
+
+  return values.empty() ? 0 : (total / values.size());
+}
+
+/// Fixture for the simulator.
+///
+/// This derives from SipTest to ensure PJSIP is set up correctly, but doesn't
+/// actually use most of its function (and doesn't register a module).
+class TwinningSim : public SipTest
+{
+public:
+  static void SetUpTestCase()
+  {
+    SipTest::SetUpTestCase();
+  }
+
+  static void TearDownTestCase()
+  {
+    SipTest::TearDownTestCase();
+  }
+
+  TwinningSim() : SipTest(NULL)
+  {
+  }
+
+  /// Reads an integer from the environment.
+  static int env_int(const char* name, int default_value)
+  {
+    const char* value = getenv(name);
+    return (value != NULL) ? atoi(value) : default_value;
+  }
+
+  /// Reads a string from the environment.
+  static std::string env_str(const char* name, const char* default_value)
+  {
+    const char* value = getenv(name);
+    return (value != NULL) ? value : default_value;
+  }
+
+  /// Parses a message into a pool.
+  static pjsip_msg* parse(pj_pool_t* pool, const std::string& text)
+  {
+    char* buf = (char*)pj_pool_alloc(pool, text.length() + 1);
+    memcpy(buf, text.c_str(), text.length() + 1);
+    return pjsip_parse_msg(pool, buf, text.length(), NULL);
+  }
+
+  /// Builds the text of the request, or a response to it.
+  static std::string message_text(int status_code)
+  {
+    std::string first_line = "INVITE sip:6505551234@homedomain SIP/2.0";
+
+    if (status_code != 0)
+    {
+      const pj_str_t* reason = pjsip_get_status_text(status_code);
+      first_line = "SIP/2.0 " + std::to_string(status_code) + " " +
+                   std::string(reason->ptr, reason->slen);
+    }
+
+    return first_line + "\r\n"
+      "Via: SIP/2.0/TCP 10.114.61.213;branch=z9hG4bK0123456789abcdef\r\n"
+      "From: <sip:6505551000@homedomain>;tag=10.114.61.213+1+8c8b232a+5fb751cf\r\n"
+      "To: <sip:6505551234@homedomain>\r\n"
+      "Max-Forwards: 68\r\n"
+      "Call-ID: 0gQAAC8WAAACBAAALxYAAAL8P3UbW8l4mT8YBkKGRKc5SOHaJ1gMRqsUOO4ohntC@10.114.61.213\r\n"
+      "CSeq: 16567 INVITE\r\n"
+      "Content-Length: 0\r\n\r\n";
+  }
+
+  /// Prints a strategy's results.
+  static void print_result(StrategyResult& result)
+  {
+    double calls = (result.calls != 0) ? result.calls : 1;
+    uint64_t forks = 0;
+
+    for (int leg = 0; leg < NUM_LEG_TYPES; ++leg)
+    {
+      forks += result.forks[leg];
+    }
+
+    printf("%-24s %6.3f %6.3f %6.3f %6.3f %7.3f %7.1f%% %7u %7u %7u %8.0f %7u\n",
+           result.name.c_str(),
+           forks / calls,
+           result.forks[LEG_VOIP] / calls,
+           result.forks[LEG_NATIVE] / calls,
+           result.forks[LEG_MOBILE_VOIP] / calls,
+           result.cancels / calls,
+           100.0 * result.answered / calls,
+           percentile(result.post_dial_delay_ms, 50),
+           percentile(result.post_dial_delay_ms, 90),
+           percentile(result.post_dial_delay_ms, 99),
+           mean(result.post_dial_delay_ms),
+           percentile(result.time_to_answer_ms, 50));
+  }
+};
+
+TEST_F(TwinningSim, DISABLED_Run)
+{
+  int num_calls = env_int("GEMINI_SIM_CALLS", 10000);
+  int seed = env_int("GEMINI_SIM_SEED", 1);
+  int hedge_ms = env_int("GEMINI_SIM_HEDGE_MS", 2000);
+
+  LegModel models[NUM_LEG_TYPES];
+  ASSERT_TRUE(models[LEG_VOIP].parse(
+         env_str("GEMINI_SIM_VOIP", "0.7:480:200,0.2:200:4000-15000:1000-2000,0.1:486:3000:1000-2000")));
+  ASSERT_TRUE(models[LEG_NATIVE].parse(
+         env_str("GEMINI_SIM_NATIVE", "0.55:200:5000-20000:2000-5000,0.25:480:8000,0.15:486:4000-10000:2000-5000,0.05:408:32000")));
+  ASSERT_TRUE(models[LEG_MOBILE_VOIP].parse(
+         env_str("GEMINI_SIM_MOBILE_VOIP", "0.5:200:4000-15000:1000-2000,0.5:480:300")));
+
+  // Parse a response for each status code the forks can return.
+  pj_pool_t* template_pool =
+       pj_pool_create(&stack_data.cp.factory, "sim-templates", 4000, 4000, NULL);
+  pj_pool_t* call_pool =
+       pj_pool_create(&stack_data.cp.factory, "sim-call", 4000, 4000, NULL);
+
+  std::vector<pjsip_msg*> responses(700, (pjsip_msg*)NULL);
+  std::vector<int> codes = {PJSIP_SC_RINGING, PJSIP_SC_REQUEST_TERMINATED};
+
+  for (int leg = 0; leg < NUM_LEG_TYPES; ++leg)
+  {
+    std::vector<int> leg_codes = models[leg].status_codes();
+    codes.insert(codes.end(), leg_codes.begin(), leg_codes.end());
+  }
+
+  for (size_t ii = 0; ii < codes.size(); ++ii)
+  {
+    ASSERT_TRUE((codes[ii] >= PJSIP_SC_RINGING) && (codes[ii] < 700));
+    responses[codes[ii]] = parse(template_pool, message_text(codes[ii]));
+  }
+
+  pjsip_msg* request = parse(template_pool, message_text(0));
+  pjsip_route_hdr* route = pjsip_route_hdr_create(template_pool);
+  route->name_addr.uri = PJUtils::uri_from_string(
+                     "sip:mobile-twinned@gemini.homedomain;twin-prefix=111",
+                     template_pool);
+
+  // Gemini's policy runs through the real Tsx on the virtual clock, which
+  // also evaluates the alternatives in shadow mode as a cross-check on the
+  // simulator's models of them.
+  MobileTwinnedAppServer::Config config;
+  config.shadow_sample_rate = 1;
+  config.shadow_hedge_ms = hedge_ms;
+  config.clock = sim_clock;
+  MobileTwinnedAppServer as("mobile-twinned", config);
+
+  StrategyResult sequential("retry-on-480");
+  StrategyResult parallel("parallel-fork");
+  StrategyResult hedged("hedged-retry (" + std::to_string(hedge_ms) + "ms)");
+  SimTsxHelper helper(call_pool, route, responses, sequential);
+  std::mt19937_64 rng(seed);
+  g_sim_now_ms = 1;
+
+  for (int call = 0; call < num_calls; ++call)
+  {
+    SampledOutcome outcomes[NUM_LEG_TYPES];
+
+    for (int leg = 0; leg < NUM_LEG_TYPES; ++leg)
+    {
+      outcomes[leg] = models[leg].sample(rng);
+    }
+
+    // Gemini's policy.
+    pj_pool_reset(call_pool);
+    pjsip_msg* req = pjsip_msg_clone(call_pool, request);
+    helper.start_call(req, outcomes);
+
+    {
+      MobileTwinnedAppServerTsx tsx(&as);
+      tsx.set_helper(&helper);
+      tsx.on_initial_request(req);
+
+      while (helper.deliver_next(&tsx))
+      {
+      }
+    }
+
+    // Forking to all three legs at once.
+    uint64_t start_ms[NUM_LEG_TYPES] = {0, 0, 0};
+    model_call(outcomes, start_ms, parallel);
+
+    // Hedging - retrying to the mobile hosted VoIP clients if the native
+    // device hasn't rung within the hedge delay, as well as on a 480.
+    const SampledOutcome& native = outcomes[LEG_NATIVE];
+    uint64_t progress_ms = (native.ring_ms != 0) ? native.ring_ms : native.final_ms;
+
+    if (progress_ms > (uint64_t)hedge_ms)
+    {
+      start_ms[LEG_MOBILE_VOIP] = hedge_ms;
+    }
+    else if (native.status_code == PJSIP_SC_TEMPORARILY_UNAVAILABLE)
+    {
+      start_ms[LEG_MOBILE_VOIP] = native.final_ms;
+    }
+    else
+    {
+      start_ms[LEG_MOBILE_VOIP] = UINT64_MAX;
+    }
+
+    model_call(outcomes, start_ms, hedged);
+
+    // Leave a gap between calls.
+    g_sim_now_ms += 60000;
+  }
+
+  printf("\nSimulated %d calls (seed %d)\n\n", num_calls, seed);
+  printf("%-24s %6s %6s %6s %6s %7s %8s %7s %7s %7s %8s %7s\n",
+         "Policy", "Forks", "VoIP", "Native", "Mobile", "Cancels",
+         "Answered", "PDD p50", "p90", "p99", "mean", "TTA p50");
+  printf("%-24s %6s %6s %6s %6s %7s\n",
+         "", "/call", "/call", "/call", "/call", "/call");
+  print_result(sequential);
+  print_result(parallel);
+  print_result(hedged);
+
+  GeminiStats& stats = as.stats();
+  printf("\nShadow evaluation by the Tsx:\n");
+
+  for (int policy = 0; policy < NUM_SHADOW_POLICIES; ++policy)
+  {
+    GeminiShadowStats& shadow = stats.shadow[policy];
+    printf("  %-16s extra forks %" PRIu64 ", earlier retries %" PRIu64
+           " (mean %.0fms earlier)\n",
+           GeminiStats::shadow_policy_name((GeminiShadowPolicy)policy),
+           shadow.extra_forks.value(),
+           shadow.earlier_retries.value(),
+           (shadow.latency_saved_ms.count() != 0) ?
+             (double)shadow.latency_saved_ms.sum() / shadow.latency_saved_ms.count() :
+             0.0);
+  }
+
+  pj_pool_release(call_pool);
+  pj_pool_release(template_pool);
+
+  EXPECT_EQ((uint64_t)num_calls, sequential.calls);
+  EXPECT_EQ((uint64_t)num_calls, parallel.calls);
+  EXPECT_EQ((uint64_t)num_calls, hedged.calls);
+}
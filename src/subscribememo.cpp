@@ -0,0 +1,107 @@
+/**
+ * @file subscribememo.cpp Implementation of the memo of which leg accepted
+ * each subscriber's subscriptions.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <functional>
+
+#include "log.h"
+#include "subscribememo.h"
+#include "geministats.h"
+#include "geminiutils.h"
+
+SubscribeMemo::SubscribeMemo(int ttl_ms,
+                             unsigned int max_entries,
+                             GeminiUtils::Clock clock) :
+  _ttl_ms(ttl_ms),
+  _max_shard_entries((max_entries + NUM_SHARDS - 1) / NUM_SHARDS),
+  _clock(clock)
+{
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    pthread_mutex_init(&_shards[ii].lock, NULL);
+  }
+}
+
+SubscribeMemo::~SubscribeMemo()
+{
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    pthread_mutex_destroy(&_shards[ii].lock);
+  }
+}
+
+std::string SubscribeMemo::key(const std::string& user,
+                               const std::string& package)
+{
+  // Event packages are tokens, so can't contain a space.
+  return user + " " + package;
+}
+
+GeminiLegType SubscribeMemo::get_leg(const std::string& key)
+{
+  GeminiLegType leg_type = NUM_LEG_TYPES;
+  Shard& shard = shard_for(key);
+
+  pthread_mutex_lock(&shard.lock);
+  std::unordered_map<std::string, Entry>::iterator it = shard.entries.find(key);
+
+  if (it != shard.entries.end())
+  {
+    if (it->second.expiry_ms > now_ms())
+    {
+      leg_type = it->second.leg_type;
+    }
+    else
+    {
+      shard.entries.erase(it);
+    }
+  }
+  pthread_mutex_unlock(&shard.lock);
+
+  return leg_type;
+}
+
+void SubscribeMemo::set_leg(const std::string& key, GeminiLegType leg_type)
+{
+  Shard& shard = shard_for(key);
+
+  pthread_mutex_lock(&shard.lock);
+
+  if ((shard.entries.size() >= _max_shard_entries) &&
+      (shard.entries.find(key) == shard.entries.end()))
+  {
+    // The shard is full. Make room by discarding an arbitrary entry - this
+    // only costs a fork to both legs if that subscriber resubscribes soon.
+    shard.entries.erase(shard.entries.begin());
+  }
+
+  Entry& entry = shard.entries[key];
+  entry.leg_type = leg_type;
+  entry.expiry_ms = now_ms() + _ttl_ms;
+  pthread_mutex_unlock(&shard.lock);
+
+  TRC_DEBUG("Subscriptions for %s are accepted by the %s leg",
+            key.c_str(), GeminiStats::leg_type_name(leg_type));
+}
+
+void SubscribeMemo::forget(const std::string& key)
+{
+  Shard& shard = shard_for(key);
+
+  pthread_mutex_lock(&shard.lock);
+  shard.entries.erase(key);
+  pthread_mutex_unlock(&shard.lock);
+}
+
+SubscribeMemo::Shard& SubscribeMemo::shard_for(const std::string& key)
+{
+  return _shards[std::hash<std::string>()(key) % NUM_SHARDS];
+}
@@ -0,0 +1,381 @@
+/**
+ * @file tenantaccounting.cpp Implementation of the per-tenant accounting of
+ * the resources used by the gemini AS.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unordered_map>
+
+#include "log.h"
+#include "tenantaccounting.h"
+
+const int TenantAccounting::OTHER_TENANT;
+
+std::atomic<uint64_t> TenantAccounting::_next_id(1);
+
+/// The counters most recently used by this thread, and the accounting they
+/// belong to.
+static thread_local uint64_t t_accounting_id = 0;
+static thread_local std::atomic<uint64_t>* t_counters = NULL;
+
+/// The counters this thread has in every accounting it has counted into, by
+/// the ID of the accounting, so that a thread alternating between
+/// accountings keeps using the same counters in each. IDs are never reused,
+/// so the entries of accountings that have been destroyed are never looked
+/// up again.
+static thread_local std::unordered_map<uint64_t, std::atomic<uint64_t>*>
+                                                          t_counters_by_id;
+
+/// Returns the FNV-1a hash of a tenant key.
+static uint32_t key_hash(const char* key, int key_len)
+{
+  uint32_t hash = 2166136261u;
+
+  for (int ii = 0; ii < key_len; ++ii)
+  {
+    hash = (hash ^ (uint8_t)key[ii]) * 16777619u;
+  }
+
+  return hash;
+}
+
+TenantAccounting::TenantAccounting(int max_tenants,
+                                   int snapshot_period_ms,
+                                   SnapshotListener* listener) :
+  _max_tenants(max_tenants),
+  _snapshot_period_ms(snapshot_period_ms),
+  _listener(listener),
+  _tenants(max_tenants),
+  _num_tenants(1),
+  _slots(NULL),
+  _slot_mask(0),
+  _thread_counters(),
+  _snapshot_totals(max_tenants * NUM_COUNTERS, 0),
+  _last_snapshot(),
+  _id(_next_id++),
+  _terminated(false),
+  _thread_started(false)
+{
+  // Keep the hash table no more than half full, so probe sequences are
+  // short.
+  uint32_t num_slots = 1;
+
+  while (num_slots < (uint32_t)(max_tenants * 2))
+  {
+    num_slots <<= 1;
+  }
+
+  _slot_mask = num_slots - 1;
+  _slots = new std::atomic<int>[num_slots];
+
+  for (uint32_t ii = 0; ii < num_slots; ++ii)
+  {
+    _slots[ii].store(0, std::memory_order_relaxed);
+  }
+
+  // Tenant 0 is the catch-all tenant, and is never in the hash table.
+  _tenants[OTHER_TENANT].hash = 0;
+  _tenants[OTHER_TENANT].key = "other";
+
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_cond, NULL);
+
+  int rc = pthread_create(&_thread, NULL, &TenantAccounting::thread_function, this);
+
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to start tenant accounting thread: %s", strerror(rc));
+    // LCOV_EXCL_STOP
+  }
+  else
+  {
+    _thread_started = true;
+  }
+}
+
+TenantAccounting::~TenantAccounting()
+{
+  pthread_mutex_lock(&_lock);
+  _terminated = true;
+  pthread_cond_signal(&_cond);
+  pthread_mutex_unlock(&_lock);
+
+  if (_thread_started)
+  {
+    pthread_join(_thread, NULL);
+  }
+
+  for (size_t ii = 0; ii < _thread_counters.size(); ++ii)
+  {
+    delete[] _thread_counters[ii];
+  }
+
+  delete[] _slots;
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+int TenantAccounting::tenant_id(const pjsip_route_hdr* route_hdr)
+{
+  if (route_hdr == NULL)
+  {
+    return OTHER_TENANT;
+  }
+
+  // Print the AS URI to the stack, rather than building a string, as this
+  // is done for every request.
+  char buf[256];
+  int len = pjsip_uri_print(PJSIP_URI_IN_ROUTING_HDR,
+                            route_hdr->name_addr.uri,
+                            buf,
+                            sizeof(buf));
+
+  return (len > 0) ? tenant_id(buf, len) : OTHER_TENANT;
+}
+
+int TenantAccounting::tenant_id(const char* key, int key_len)
+{
+  uint32_t hash = key_hash(key, key_len);
+
+  // Look for the tenant without locking. Tenants are fully written before
+  // being published in a slot, and never change after that.
+  uint32_t slot = hash & _slot_mask;
+  int id;
+
+  while ((id = _slots[slot].load(std::memory_order_acquire)) != 0)
+  {
+    const Tenant& tenant = _tenants[id - 1];
+
+    if ((tenant.hash == hash) &&
+        (tenant.key.length() == (size_t)key_len) &&
+        (memcmp(tenant.key.data(), key, key_len) == 0))
+    {
+      return id - 1;
+    }
+
+    slot = (slot + 1) & _slot_mask;
+  }
+
+  // This is a new tenant. Check again under the lock, in case another thread
+  // is adding it.
+  pthread_mutex_lock(&_lock);
+  slot = hash & _slot_mask;
+
+  while ((id = _slots[slot].load(std::memory_order_relaxed)) != 0)
+  {
+    const Tenant& tenant = _tenants[id - 1];
+
+    if ((tenant.hash == hash) &&
+        (tenant.key.length() == (size_t)key_len) &&
+        (memcmp(tenant.key.data(), key, key_len) == 0))
+    {
+      break;
+    }
+
+    slot = (slot + 1) & _slot_mask;
+  }
+
+  if (id == 0)
+  {
+    if (_num_tenants.load() < _max_tenants)
+    {
+      id = _num_tenants++ + 1;
+      _tenants[id - 1].hash = hash;
+      _tenants[id - 1].key.assign(key, key_len);
+      _slots[slot].store(id, std::memory_order_release);
+
+      TRC_DEBUG("New tenant %d: %.*s", id - 1, key_len, key);
+    }
+    else
+    {
+      TRC_WARNING("Too many tenants to account for %.*s separately",
+                  key_len, key);
+      id = OTHER_TENANT + 1;
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  return id - 1;
+}
+
+void TenantAccounting::add(int tenant, Counter counter, uint64_t value)
+{
+  std::atomic<uint64_t>* counters = counters_for_this_thread();
+
+  // Only this thread writes to its counters, so there's no need for an
+  // atomic read-modify-write.
+  std::atomic<uint64_t>& count = counters[(tenant * NUM_COUNTERS) + counter];
+  count.store(count.load(std::memory_order_relaxed) + value,
+              std::memory_order_relaxed);
+}
+
+void TenantAccounting::totals(std::vector<Usage>& usage)
+{
+  pthread_mutex_lock(&_lock);
+  int num_tenants = _num_tenants.load();
+  usage.resize(num_tenants);
+
+  for (int tenant = 0; tenant < num_tenants; ++tenant)
+  {
+    usage[tenant].tenant = _tenants[tenant].key;
+    memset(usage[tenant].counters, 0, sizeof(usage[tenant].counters));
+
+    for (size_t ii = 0; ii < _thread_counters.size(); ++ii)
+    {
+      for (int counter = 0; counter < NUM_COUNTERS; ++counter)
+      {
+        usage[tenant].counters[counter] +=
+                        _thread_counters[ii][(tenant * NUM_COUNTERS) + counter]
+                                             .load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void TenantAccounting::last_snapshot(std::vector<Usage>& usage)
+{
+  pthread_mutex_lock(&_lock);
+  usage = _last_snapshot;
+  pthread_mutex_unlock(&_lock);
+}
+
+void TenantAccounting::take_snapshot()
+{
+  std::vector<Usage> usage;
+  totals(usage);
+
+  // Work out what each tenant has used since the last snapshot.
+  std::vector<Usage> snapshot;
+
+  pthread_mutex_lock(&_lock);
+
+  for (size_t tenant = 0; tenant < usage.size(); ++tenant)
+  {
+    bool active = false;
+
+    for (int counter = 0; counter < NUM_COUNTERS; ++counter)
+    {
+      uint64_t& previous = _snapshot_totals[(tenant * NUM_COUNTERS) + counter];
+      uint64_t total = usage[tenant].counters[counter];
+      usage[tenant].counters[counter] = total - previous;
+      previous = total;
+      active = active || (usage[tenant].counters[counter] != 0);
+    }
+
+    if (active)
+    {
+      snapshot.push_back(usage[tenant]);
+    }
+  }
+
+  _last_snapshot = snapshot;
+  pthread_mutex_unlock(&_lock);
+
+  if (_listener != NULL)
+  {
+    _listener->snapshot_taken(snapshot);
+  }
+}
+
+int TenantAccounting::num_threads()
+{
+  pthread_mutex_lock(&_lock);
+  int num_threads = _thread_counters.size();
+  pthread_mutex_unlock(&_lock);
+  return num_threads;
+}
+
+uint64_t TenantAccounting::now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+std::atomic<uint64_t>* TenantAccounting::counters_for_this_thread()
+{
+  if (t_accounting_id == _id)
+  {
+    return t_counters;
+  }
+
+  std::unordered_map<uint64_t, std::atomic<uint64_t>*>::iterator it =
+                                                 t_counters_by_id.find(_id);
+
+  if (it != t_counters_by_id.end())
+  {
+    t_accounting_id = _id;
+    t_counters = it->second;
+  }
+  else
+  {
+    // This thread hasn't counted anything before, so give it some counters.
+    int num_counters = _max_tenants * NUM_COUNTERS;
+    std::atomic<uint64_t>* counters = new std::atomic<uint64_t>[num_counters];
+
+    for (int ii = 0; ii < num_counters; ++ii)
+    {
+      counters[ii].store(0, std::memory_order_relaxed);
+    }
+
+    pthread_mutex_lock(&_lock);
+    _thread_counters.push_back(counters);
+    pthread_mutex_unlock(&_lock);
+
+    t_counters_by_id[_id] = counters;
+    t_accounting_id = _id;
+    t_counters = counters;
+  }
+
+  return t_counters;
+}
+
+void* TenantAccounting::thread_function(void* accounting)
+{
+  ((TenantAccounting*)accounting)->run();
+  return NULL;
+}
+
+void TenantAccounting::run()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (!_terminated)
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t deadline_ns = ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec +
+                           ((uint64_t)_snapshot_period_ms * 1000000);
+    ts.tv_sec = deadline_ns / 1000000000;
+    ts.tv_nsec = deadline_ns % 1000000000;
+
+    int rc = 0;
+
+    while ((!_terminated) && (rc != ETIMEDOUT))
+    {
+      rc = pthread_cond_timedwait(&_cond, &_lock, &ts);
+    }
+
+    if (!_terminated)
+    {
+      pthread_mutex_unlock(&_lock);
+      take_snapshot();
+      pthread_mutex_lock(&_lock);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
@@ -0,0 +1,67 @@
+/**
+ * @file gemini_trace_decode.cpp Offline decoder for gemini decision traces.
+ *
+ * Usage: gemini_trace_decode <trace file> [<trail>]
+ *
+ * Prints every record in the trace in time order, optionally only those for
+ * a single transaction (identified by its SAS trail).
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "decisiontrace.h"
+
+int main(int argc, char** argv)
+{
+  if ((argc < 2) || (argc > 3))
+  {
+    fprintf(stderr, "Usage: %s <trace file> [<trail>]\n", argv[0]);
+    return 1;
+  }
+
+  uint64_t trail = (argc == 3) ? strtoull(argv[2], NULL, 0) : 0;
+
+  std::vector<DecisionRecord> records;
+
+  if (!DecisionTrace::load(argv[1], records))
+  {
+    fprintf(stderr, "%s is not a valid decision trace\n", argv[1]);
+    return 1;
+  }
+
+  for (std::vector<DecisionRecord>::const_iterator it = records.begin();
+       it != records.end();
+       ++it)
+  {
+    if ((trail != 0) && (it->trail != trail))
+    {
+      continue;
+    }
+
+    time_t secs = it->timestamp_ns / 1000000000;
+    struct tm tm;
+    char time_str[32];
+    gmtime_r(&secs, &tm);
+    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &tm);
+
+    printf("%s.%09" PRIu64 " trail=%" PRIu64 " %-22s fork=%d status=%u\n",
+           time_str,
+           it->timestamp_ns % 1000000000,
+           it->trail,
+           DecisionTrace::event_name(it->event),
+           it->fork_id,
+           it->status_code);
+  }
+
+  return 0;
+}
@@ -0,0 +1,348 @@
+/**
+ * @file twinstatecache.cpp Implementation of the cache of native twin
+ * reachability shared between gemini nodes.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <functional>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "twinstatecache.h"
+#include "geminiutils.h"
+
+const std::string TwinStateCache::TABLE = "gemini_twin_state";
+
+TwinStateCache::TwinStateCache(Store* store,
+                               int ttl,
+                               int near_ttl,
+                               int batch_budget_ms,
+                               unsigned int max_queue,
+                               unsigned int max_entries,
+                               int probe_interval,
+                               GeminiUtils::Clock clock) :
+  _store(store),
+  _ttl(ttl),
+  _near_ttl_ms(near_ttl * 1000),
+  _batch_budget_ms(batch_budget_ms),
+  _max_shard_entries((max_entries + NUM_SHARDS - 1) / NUM_SHARDS),
+  _probe_interval_ms(probe_interval * 1000),
+  _clock(clock),
+  _queue(max_queue),
+  _thread_started(false),
+  _dropped_ops(0),
+  _probes(0),
+  _ops_queued(0),
+  _ops_done(0)
+{
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    pthread_mutex_init(&_shards[ii].lock, NULL);
+  }
+
+  pthread_mutex_init(&_flush_lock, NULL);
+  pthread_cond_init(&_flush_cond, NULL);
+
+  int rc = pthread_create(&_thread, NULL, &TwinStateCache::thread_function, this);
+
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to start twin state cache thread: %s", strerror(rc));
+    // LCOV_EXCL_STOP
+  }
+  else
+  {
+    _thread_started = true;
+  }
+}
+
+TwinStateCache::~TwinStateCache()
+{
+  _queue.terminate();
+
+  if (_thread_started)
+  {
+    pthread_join(_thread, NULL);
+  }
+
+  pthread_cond_destroy(&_flush_cond);
+  pthread_mutex_destroy(&_flush_lock);
+
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    pthread_mutex_destroy(&_shards[ii].lock);
+  }
+}
+
+void TwinStateCache::flush()
+{
+  if (!_thread_started)
+  {
+    // LCOV_EXCL_START
+    return;
+    // LCOV_EXCL_STOP
+  }
+
+  uint64_t target = _ops_queued.load();
+
+  pthread_mutex_lock(&_flush_lock);
+
+  while (_ops_done < target)
+  {
+    pthread_cond_wait(&_flush_cond, &_flush_lock);
+  }
+
+  pthread_mutex_unlock(&_flush_lock);
+}
+
+TwinStateCache::State TwinStateCache::get_native_state(const std::string& user)
+{
+  State state = UNKNOWN;
+  bool lookup = false;
+  Shard& shard = shard_for(user);
+
+  pthread_mutex_lock(&shard.lock);
+  std::unordered_map<std::string, Entry>::iterator it = shard.entries.find(user);
+
+  uint64_t now_ms = this->now_ms();
+
+  if ((it != shard.entries.end()) &&
+      (it->second.expiry_ms > now_ms))
+  {
+    state = it->second.state;
+
+    if ((state == UNREACHABLE) && (it->second.probe_ms <= now_ms))
+    {
+      // Let this call fork to the native twin, in case it's reachable again.
+      // Only one call gets to do so in each probe interval.
+      TRC_DEBUG("Probing native twin of %s", user.c_str());
+      it->second.probe_ms = now_ms + _probe_interval_ms;
+      state = UNKNOWN;
+      _probes++;
+    }
+  }
+  else
+  {
+    // Nothing is known locally. Add a placeholder entry so that concurrent
+    // requests for the same user don't each queue a lookup, and then ask the
+    // background thread to fetch the state from the store.
+    update_entry(shard, user, UNKNOWN);
+    lookup = true;
+  }
+  pthread_mutex_unlock(&shard.lock);
+
+  if (lookup)
+  {
+    queue_op(Op::GET, user, UNKNOWN);
+  }
+
+  return state;
+}
+
+void TwinStateCache::set_native_state(const std::string& user, State state)
+{
+  bool changed = true;
+  Shard& shard = shard_for(user);
+
+  pthread_mutex_lock(&shard.lock);
+  std::unordered_map<std::string, Entry>::iterator it = shard.entries.find(user);
+
+  if ((it != shard.entries.end()) &&
+      (it->second.state == state) &&
+      (it->second.expiry_ms > now_ms()))
+  {
+    // We recently learnt (or wrote) the same state, so there's no need to
+    // write it to the store again.
+    changed = false;
+  }
+  else
+  {
+    update_entry(shard, user, state);
+  }
+  pthread_mutex_unlock(&shard.lock);
+
+  if (changed)
+  {
+    queue_op(Op::SET, user, state);
+  }
+}
+
+TwinStateCache::Shard& TwinStateCache::shard_for(const std::string& user)
+{
+  return _shards[std::hash<std::string>()(user) % NUM_SHARDS];
+}
+
+void TwinStateCache::update_entry(Shard& shard,
+                                  const std::string& user,
+                                  State state)
+{
+  std::unordered_map<std::string, Entry>::iterator it = shard.entries.find(user);
+
+  if ((shard.entries.size() >= _max_shard_entries) &&
+      (it == shard.entries.end()))
+  {
+    // The shard is full. Make room by discarding an arbitrary entry - this
+    // only costs us a store lookup if that user calls again soon.
+    shard.entries.erase(shard.entries.begin());
+  }
+
+  uint64_t now_ms = this->now_ms();
+  bool was_unreachable = ((it != shard.entries.end()) &&
+                          (it->second.state == UNREACHABLE));
+  Entry& entry = shard.entries[user];
+
+  if ((state != UNREACHABLE) || (!was_unreachable))
+  {
+    // The native twin has just become unreachable, so the first probe is
+    // due a probe interval from now. Refreshing an unreachable entry keeps
+    // the probe that's already due.
+    entry.probe_ms = now_ms + _probe_interval_ms;
+  }
+
+  entry.state = state;
+  entry.expiry_ms = now_ms + _near_ttl_ms;
+}
+
+void TwinStateCache::queue_op(Op::Type type,
+                              const std::string& user,
+                              State state)
+{
+  Op op;
+  op.type = type;
+  op.user = user;
+  op.state = state;
+
+  if (_queue.push_noblock(op))
+  {
+    // The background thread may deal with the operation before we count it,
+    // but flush only needs the count to cover operations queued before it's
+    // called.
+    _ops_queued++;
+  }
+  else
+  {
+    TRC_DEBUG("Twin state cache queue full - dropping operation for %s",
+              user.c_str());
+    _dropped_ops++;
+  }
+}
+
+void* TwinStateCache::thread_function(void* cache)
+{
+  ((TwinStateCache*)cache)->run();
+  return NULL;
+}
+
+void TwinStateCache::run()
+{
+  Op op;
+
+  while (_queue.pop(op))
+  {
+    // Drain whatever else is queued as part of the same batch. Writes are
+    // always made, but lookups are only worth making while we're within the
+    // batch budget - a lookup that completes late is of little use, and
+    // abandoning it just means the next request for that user queues
+    // another.
+    uint64_t batch_start_ms = now_ms();
+    int batch_size = 0;
+
+    while (true)
+    {
+      if (op.type == Op::SET)
+      {
+        do_set(op.user, op.state);
+      }
+      else if (now_ms() - batch_start_ms < (uint64_t)_batch_budget_ms)
+      {
+        do_get(op.user);
+      }
+      else
+      {
+        TRC_DEBUG("Batch budget exceeded - abandoning lookup for %s",
+                  op.user.c_str());
+        _dropped_ops++;
+      }
+
+      if ((++batch_size >= MAX_BATCH_SIZE) ||
+          (_queue.is_empty()) ||
+          (!_queue.pop(op)))
+      {
+        break;
+      }
+    }
+
+    pthread_mutex_lock(&_flush_lock);
+    _ops_done += batch_size;
+    pthread_cond_broadcast(&_flush_cond);
+    pthread_mutex_unlock(&_flush_lock);
+  }
+}
+
+void TwinStateCache::do_get(const std::string& user)
+{
+  std::string data;
+  uint64_t cas;
+  Store::Status status = _store->get_data(TABLE, user, data, cas, 0);
+
+  if (status == Store::OK)
+  {
+    State state = (State)atoi(data.c_str());
+
+    if ((state == REACHABLE) || (state == UNREACHABLE))
+    {
+      TRC_DEBUG("Learnt native twin state %d for %s", state, user.c_str());
+      Shard& shard = shard_for(user);
+      pthread_mutex_lock(&shard.lock);
+      update_entry(shard, user, state);
+      pthread_mutex_unlock(&shard.lock);
+    }
+  }
+  else if (status != Store::NOT_FOUND)
+  {
+    TRC_DEBUG("Failed to read native twin state for %s", user.c_str());
+  }
+}
+
+void TwinStateCache::do_set(const std::string& user, State state)
+{
+  std::string data = std::to_string((int)state);
+  Store::Status status;
+  int attempts = 0;
+
+  // The store only overwrites an existing record if we supply its CAS, so
+  // read it first. Another node may write the record in between, in which
+  // case we try once more - whichever state is written last wins, which is
+  // fine as both are recent.
+  do
+  {
+    std::string old_data;
+    uint64_t cas = 0;
+    status = _store->get_data(TABLE, user, old_data, cas, 0);
+
+    if (status == Store::NOT_FOUND)
+    {
+      cas = 0;
+    }
+    else if (status != Store::OK)
+    {
+      break;
+    }
+
+    status = _store->set_data(TABLE, user, data, cas, _ttl, 0);
+  }
+  while ((status == Store::DATA_CONTENTION) && (++attempts < 2));
+
+  if (status != Store::OK)
+  {
+    TRC_DEBUG("Failed to write native twin state for %s", user.c_str());
+  }
+}
@@ -0,0 +1,159 @@
+/**
+ * @file decisiontrace_test.cpp UT for the decision trace which is part of
+ * gemini.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include <thread>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "gtest/gtest.h"
+
+#include "decisiontrace.h"
+
+/// Fixture for DecisionTraceTest.
+class DecisionTraceTest : public ::testing::Test
+{
+public:
+  DecisionTraceTest()
+  {
+    char file[] = "/tmp/gemini_trace_test.XXXXXX";
+    close(mkstemp(file));
+    _file = file;
+  }
+
+  ~DecisionTraceTest()
+  {
+    unlink(_file.c_str());
+  }
+
+  std::string _file;
+};
+
+// Test that records written to a file-backed trace can be read back.
+TEST_F(DecisionTraceTest, RecordAndLoad)
+{
+  DecisionTrace trace(_file, 4, 16);
+  trace.record(1234, DecisionTrace::REQ_FORKED);
+  trace.record(1234, DecisionTrace::FORK_TO_NATIVE, 1);
+  trace.record(1234, DecisionTrace::RSP_RECEIVED, 1, 480);
+  trace.sync();
+
+  std::vector<DecisionRecord> records;
+  EXPECT_TRUE(DecisionTrace::load(_file, records));
+  ASSERT_EQ(3u, records.size());
+  EXPECT_EQ(1234u, records[0].trail);
+  EXPECT_EQ(DecisionTrace::REQ_FORKED, records[0].event);
+  EXPECT_EQ(DecisionTrace::FORK_TO_NATIVE, records[1].event);
+  EXPECT_EQ(1, records[1].fork_id);
+  EXPECT_EQ(DecisionTrace::RSP_RECEIVED, records[2].event);
+  EXPECT_EQ(480, records[2].status_code);
+  EXPECT_STREQ("RSP_RECEIVED", DecisionTrace::event_name(records[2].event));
+}
+
+// Test that each ring only keeps the most recent records, and that the
+// oldest slot (which the writer may be part way through filling in) is
+// skipped once the ring is full.
+TEST_F(DecisionTraceTest, RingWraps)
+{
+  DecisionTrace trace(_file, 1, 8);
+
+  for (int ii = 0; ii < 20; ++ii)
+  {
+    trace.record(ii, DecisionTrace::RSP_RECEIVED);
+  }
+
+  std::vector<DecisionRecord> records;
+  EXPECT_TRUE(DecisionTrace::load(_file, records));
+  ASSERT_EQ(7u, records.size());
+  EXPECT_EQ(13u, records[0].trail);
+  EXPECT_EQ(19u, records[6].trail);
+}
+
+// Test that each thread writes to its own ring, and that threads beyond the
+// number of rings are counted as dropped.
+TEST_F(DecisionTraceTest, RingPerThread)
+{
+  DecisionTrace trace(_file, 2, 8);
+  trace.record(1, DecisionTrace::REQ_FORKED);
+
+  std::thread t1([&trace]() { trace.record(2, DecisionTrace::REQ_FORKED); });
+  t1.join();
+  std::thread t2([&trace]() { trace.record(3, DecisionTrace::REQ_FORKED); });
+  t2.join();
+
+  std::vector<DecisionRecord> records;
+  EXPECT_TRUE(DecisionTrace::load(_file, records));
+  EXPECT_EQ(2u, records.size());
+  EXPECT_EQ(1u, trace.dropped_records());
+}
+
+// Test that a thread alternating between traces keeps writing to the same
+// ring in each.
+TEST_F(DecisionTraceTest, ThreadAlternatesTraces)
+{
+  DecisionTrace trace_a(_file, 1, 8);
+  DecisionTrace trace_b("", 1, 8);
+
+  for (int ii = 0; ii < 3; ++ii)
+  {
+    trace_a.record(ii, DecisionTrace::REQ_FORKED);
+    trace_b.record(ii, DecisionTrace::REQ_FORKED);
+  }
+
+  EXPECT_EQ(0u, trace_a.dropped_records());
+  EXPECT_EQ(0u, trace_b.dropped_records());
+
+  std::vector<DecisionRecord> records;
+  EXPECT_TRUE(DecisionTrace::load(_file, records));
+  EXPECT_EQ(3u, records.size());
+}
+
+// Test that an in-memory trace is dumped to a file if the process crashes.
+TEST_F(DecisionTraceTest, DumpOnCrash)
+{
+  EXPECT_DEATH({
+                 DecisionTrace trace("", 4, 16);
+                 trace.record(1234, DecisionTrace::RSP_RECEIVED, 1, 480);
+                 trace.dump_on_crash(_file);
+                 abort();
+               },
+               "");
+
+  std::vector<DecisionRecord> records;
+  EXPECT_TRUE(DecisionTrace::load(_file, records));
+  ASSERT_EQ(1u, records.size());
+  EXPECT_EQ(1234u, records[0].trail);
+}
+
+// Test that an in-memory trace can be dumped to a file.
+TEST_F(DecisionTraceTest, Dump)
+{
+  DecisionTrace trace("", 4, 16);
+  trace.record(1234, DecisionTrace::REQ_NOT_SIP);
+  EXPECT_TRUE(trace.dump(_file.c_str()));
+
+  std::vector<DecisionRecord> records;
+  EXPECT_TRUE(DecisionTrace::load(_file, records));
+  ASSERT_EQ(1u, records.size());
+  EXPECT_EQ(DecisionTrace::REQ_NOT_SIP, records[0].event);
+}
+
+// Test that a file that isn't a trace is rejected.
+TEST_F(DecisionTraceTest, LoadInvalidFile)
+{
+  FILE* f = fopen(_file.c_str(), "w");
+  fprintf(f, "This is not a trace file, though it is long enough to be one.\n");
+  fclose(f);
+
+  std::vector<DecisionRecord> records;
+  EXPECT_FALSE(DecisionTrace::load(_file, records));
+}
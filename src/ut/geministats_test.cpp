@@ -0,0 +1,84 @@
+/**
+ * @file geministats_test.cpp UT for the statistics collected by gemini.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "gtest/gtest.h"
+
+#include "geministats.h"
+
+// Test that values are recorded in the right buckets.
+TEST(GeminiHistogramTest, BucketIndex)
+{
+  EXPECT_EQ(0, GeminiHistogram::bucket_index(0));
+  EXPECT_EQ(1, GeminiHistogram::bucket_index(1));
+  EXPECT_EQ(2, GeminiHistogram::bucket_index(2));
+  EXPECT_EQ(2, GeminiHistogram::bucket_index(3));
+  EXPECT_EQ(11, GeminiHistogram::bucket_index(1024));
+  EXPECT_EQ(GeminiHistogram::NUM_BUCKETS - 1,
+            GeminiHistogram::bucket_index(0xFFFFFFFFFFFFFFFFull));
+}
+
+// Test the count, sum and percentiles of a histogram.
+TEST(GeminiHistogramTest, Percentiles)
+{
+  GeminiHistogram histogram;
+  EXPECT_EQ(0u, histogram.percentile(50));
+
+  for (uint64_t ii = 1; ii <= 100; ++ii)
+  {
+    histogram.record(ii);
+  }
+
+  EXPECT_EQ(100u, histogram.count());
+  EXPECT_EQ(5050u, histogram.sum());
+  EXPECT_EQ(1u, histogram.bucket(1));
+  EXPECT_EQ(37u, histogram.bucket(7));
+
+  // The 50th value is 50, in the bucket [32, 64).
+  EXPECT_EQ(63u, histogram.percentile(50));
+
+  // The 100th value is 100, in the bucket [64, 128).
+  EXPECT_EQ(127u, histogram.percentile(100));
+  EXPECT_EQ(1u, histogram.percentile(0));
+}
+
+// Test that neighbouring histograms don't share cache lines.
+TEST(GeminiHistogramTest, HistogramsOnSeparateCacheLines)
+{
+  GeminiStats stats;
+
+  for (int ii = 0; ii < NUM_LEG_TYPES; ++ii)
+  {
+    EXPECT_EQ(0u, (uintptr_t)&stats.time_to_ring_ms[ii] % 64);
+  }
+
+  EXPECT_EQ(0u, sizeof(GeminiHistogram) % 64);
+}
+
+// Test that counters count, and that neighbouring counters don't share cache
+// lines.
+TEST(GeminiCounterTest, CountersOnSeparateCacheLines)
+{
+  GeminiStats stats;
+  stats.contact_headers_skipped.increment();
+  stats.contact_headers_skipped.increment();
+  EXPECT_EQ(2u, stats.contact_headers_skipped.value());
+  EXPECT_EQ(0u, stats.requests_passed_through.value());
+
+  EXPECT_EQ(0u, (uintptr_t)&stats.requests_passed_through % 64);
+  EXPECT_EQ(0u, (uintptr_t)&stats.contact_headers_skipped % 64);
+
+  for (int ii = 0; ii < NUM_SCAN_LIMITS; ++ii)
+  {
+    EXPECT_EQ(0u, (uintptr_t)&stats.accept_contact_scans_truncated[ii] % 64);
+  }
+
+  EXPECT_EQ(64u, sizeof(GeminiCounter));
+}
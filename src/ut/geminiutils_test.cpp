@@ -0,0 +1,114 @@
+/**
+ * @file geminiutils_test.cpp UT for the utility functions shared by gemini.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include <string.h>
+#include "gtest/gtest.h"
+
+#include "geminiutils.h"
+
+/// Converts a tel: URI number and context to a SIP user, returning "<invalid>"
+/// if the conversion fails.
+static std::string tel_to_sip_user(const std::string& number,
+                                   const std::string& context,
+                                   int out_len = 64)
+{
+  char out[64];
+  int len = GeminiUtils::tel_to_sip_user(number.data(),
+                                         number.length(),
+                                         context.data(),
+                                         context.length(),
+                                         out,
+                                         out_len);
+  return (len < 0) ? "<invalid>" : std::string(out, len);
+}
+
+// Test that visual separators are removed from global numbers.
+TEST(GeminiUtilsTest, GlobalNumber)
+{
+  EXPECT_EQ("+16505551234", tel_to_sip_user("+16505551234", ""));
+  EXPECT_EQ("+16505551234", tel_to_sip_user("+1-650-555-1234", ""));
+  EXPECT_EQ("+16505551234", tel_to_sip_user("+1.(650).555.1234", "example.com"));
+  EXPECT_EQ("<invalid>", tel_to_sip_user("+1-650-555-123A", ""));
+  EXPECT_EQ("<invalid>", tel_to_sip_user("+", ""));
+  EXPECT_EQ("<invalid>", tel_to_sip_user("+--", ""));
+}
+
+// Test local numbers in the context of a global number prefix.
+TEST(GeminiUtilsTest, LocalNumberGlobalContext)
+{
+  EXPECT_EQ("+16505551234", tel_to_sip_user("555-1234", "+1-650"));
+  EXPECT_EQ("<invalid>", tel_to_sip_user("*1234", "+1-650"));
+  EXPECT_EQ("<invalid>", tel_to_sip_user("5551234", "+1-65x"));
+}
+
+// Test local numbers in the context of a domain.
+TEST(GeminiUtilsTest, LocalNumberDomainContext)
+{
+  EXPECT_EQ("5551234;phone-context=example.com",
+            tel_to_sip_user("555-1234", "example.com"));
+  EXPECT_EQ("*12#AB;phone-context=example.com",
+            tel_to_sip_user("*12#ab", "example.com"));
+  EXPECT_EQ("1234", tel_to_sip_user("1234", ""));
+  EXPECT_EQ("<invalid>", tel_to_sip_user("12 34", "example.com"));
+}
+
+// Test that the conversion fails rather than overrunning the buffer.
+TEST(GeminiUtilsTest, BufferTooSmall)
+{
+  EXPECT_EQ("<invalid>", tel_to_sip_user("+16505551234", "", 11));
+  EXPECT_EQ("+16505551234", tel_to_sip_user("+16505551234", "", 12));
+  EXPECT_EQ("<invalid>", tel_to_sip_user("555-1234", "+1-650", 11));
+  EXPECT_EQ("<invalid>", tel_to_sip_user("1234", "example.com", 20));
+}
+
+// Test that tel: URI parameters are appended to the user part, and that
+// appending fails rather than overrunning the buffer.
+TEST(GeminiUtilsTest, AppendTelParam)
+{
+  char out[32] = "+16505551234";
+  int len = strlen(out);
+
+  len = GeminiUtils::append_tel_param("isub", 4, "1234", 4, out, len, 32);
+  len = GeminiUtils::append_tel_param("ext", 3, "22", 2, out, len, 32);
+  EXPECT_EQ("+16505551234;isub=1234;ext=22", std::string(out, len));
+
+  len = GeminiUtils::append_tel_param("x", 1, "", 0, out, len, 32);
+  EXPECT_EQ("+16505551234;isub=1234;ext=22;x", std::string(out, len));
+
+  EXPECT_EQ(-1, GeminiUtils::append_tel_param("postd", 5, "pp22", 4, out, len, 32));
+  EXPECT_EQ(-1, GeminiUtils::append_tel_param("ext", 3, "22", 2, out, -1, 32));
+}
+
+// Test that tags are built at compile time with the right length.
+TEST(GeminiUtilsTest, TagsAreConstant)
+{
+  static_assert(TAG_WITH_TWIN.str.slen == 14, "Wrong tag length");
+
+  EXPECT_EQ(std::string("+g.3gpp.ics"),
+            std::string(STR_3GPP_ICS.ptr, STR_3GPP_ICS.slen));
+}
+
+// Test matching strings against tags.
+TEST(GeminiUtilsTest, TagMatches)
+{
+  pj_str_t name = pj_str((char*)"Twin-Prefix");
+  EXPECT_TRUE(GeminiUtils::tag_matches(&name, TAG_TWIN_PREFIX));
+  EXPECT_FALSE(GeminiUtils::tag_matches(&name, TAG_WITH_TWIN));
+
+  // Same length, different contents.
+  name = pj_str((char*)"twin-prefiy");
+  EXPECT_FALSE(GeminiUtils::tag_matches(&name, TAG_TWIN_PREFIX));
+
+  // A prefix of the tag.
+  name = pj_str((char*)"twin");
+  EXPECT_FALSE(GeminiUtils::tag_matches(&name, TAG_TWIN_PREFIX));
+}
@@ -0,0 +1,119 @@
+/**
+ * @file geminiworker_test.cpp UT for the background worker that does the
+ * gemini AS's bookkeeping.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "geminiworker.h"
+
+// Test that the SUBSCRIBE memo is updated through the worker.
+TEST(GeminiWorkerTest, SubscribeLeg)
+{
+  GeminiWorker worker;
+  SubscribeMemo memo;
+  std::string key = SubscribeMemo::key("6505551234@homedomain", "presence");
+
+  worker.set_subscribe_leg(&memo, key, LEG_NATIVE);
+  worker.flush();
+  EXPECT_EQ(LEG_NATIVE, memo.get_leg(key));
+
+  worker.set_subscribe_leg(&memo, key, NUM_LEG_TYPES);
+  worker.flush();
+  EXPECT_EQ(NUM_LEG_TYPES, memo.get_leg(key));
+}
+
+// Test that records from many threads are all either processed or counted
+// as dropped, with a queue small enough to fill.
+TEST(GeminiWorkerTest, ManyProducers)
+{
+  static const int NUM_THREADS = 4;
+  static const int NUM_RECORDS = 10000;
+  GeminiWorker worker(64);
+  SubscribeMemo memo;
+  std::string key = SubscribeMemo::key("6505551234@homedomain", "presence");
+  std::vector<std::thread> threads;
+
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    threads.push_back(std::thread([&]()
+    {
+      for (int jj = 0; jj < NUM_RECORDS; ++jj)
+      {
+        worker.set_subscribe_leg(&memo, key, LEG_NATIVE);
+      }
+    }));
+  }
+
+  for (size_t ii = 0; ii < threads.size(); ++ii)
+  {
+    threads[ii].join();
+  }
+
+  worker.flush();
+
+  EXPECT_EQ((uint64_t)(NUM_THREADS * NUM_RECORDS),
+            worker.processed() + worker.dropped(GeminiWorker::SUBSCRIBE_LEG));
+  EXPECT_EQ(LEG_NATIVE, memo.get_leg(key));
+  EXPECT_EQ(0u, worker.dropped(GeminiWorker::SAS_EVENT));
+}
+
+// Test that everything queued is done before the worker is destroyed.
+TEST(GeminiWorkerTest, DrainedOnDestruction)
+{
+  static const int NUM_RECORDS = 1000;
+  SubscribeMemo memo;
+
+  {
+    GeminiWorker worker;
+
+    for (int ii = 0; ii < NUM_RECORDS; ++ii)
+    {
+      worker.set_subscribe_leg(&memo,
+                               SubscribeMemo::key(std::to_string(ii), "presence"),
+                               LEG_VOIP);
+    }
+  }
+
+  for (int ii = 0; ii < NUM_RECORDS; ++ii)
+  {
+    EXPECT_EQ(LEG_VOIP,
+              memo.get_leg(SubscribeMemo::key(std::to_string(ii), "presence")));
+  }
+}
+
+// Test that a record queued once the worker has gone to sleep wakes it.
+TEST(GeminiWorkerTest, WokenFromSleep)
+{
+  GeminiWorker worker;
+  SubscribeMemo memo;
+  std::string key = SubscribeMemo::key("6505551234@homedomain", "presence");
+
+  // Let the worker find the queue empty and go to sleep.
+  worker.flush();
+  std::this_thread::yield();
+
+  worker.set_subscribe_leg(&memo, key, LEG_VOIP);
+  worker.flush();
+  EXPECT_EQ(LEG_VOIP, memo.get_leg(key));
+  EXPECT_EQ(1u, worker.processed());
+}
+
+// Test that a worker on the heap keeps its positions on their own cache
+// lines.
+TEST(GeminiWorkerTest, AllocatedOnCacheLine)
+{
+  GeminiWorker* worker = new GeminiWorker();
+  EXPECT_EQ(0u, (uintptr_t)worker % 64);
+  delete worker;
+}
@@ -13,6 +13,8 @@
 
 #include <string>
 #include <unordered_map>
+#include <stdlib.h>
+#include <unistd.h>
 #include "gtest/gtest.h"
 
 #include "siptest.hpp"
@@ -23,10 +25,18 @@
 #include "custom_headers.h"
 #include "constants.h"
 #include "gemini_constants.h"
+#include "localstore.h"
+#include "twinstatecache.h"
+#include "decisiontrace.h"
+#include "tenantaccounting.h"
+#include "subscribememo.h"
+#include "geminiworker.h"
+#include "nativeforkdedup.h"
 
 using namespace std;
 using testing::InSequence;
 using testing::Return;
+using testing::_;
 
 /// Fixture for MobileTwinnedAppServerTest.
 ///
@@ -47,14 +57,56 @@ public:
     SipTest::TearDownTestCase();
   }
 
-  MobileTwinnedAppServerTest() : SipTest(NULL)
+  MobileTwinnedAppServerTest() : SipTest(NULL), _store(NULL), _cache(NULL)
   {
+    _as = new MobileTwinnedAppServer("mobile-twinned");
   }
 
   ~MobileTwinnedAppServerTest()
   {
+    delete _as; _as = NULL;
+    delete _cache; _cache = NULL;
+    delete _store; _store = NULL;
   }
 
+  void SetUp()
+  {
+    SipTest::SetUp();
+    _now_ms = 1000000;
+  }
+
+  // Replaces the AS under test with one using the given config.
+  void reconfigure(const MobileTwinnedAppServer::Config& config)
+  {
+    delete _as;
+    _as = new MobileTwinnedAppServer("mobile-twinned", config);
+  }
+
+  // Replaces the AS under test with one using a twin state cache, backed by
+  // a LocalStore and timed on the fixture's clock.
+  TwinStateCache* use_twin_state_cache()
+  {
+    _store = new LocalStore();
+    _cache = new TwinStateCache(_store, 300, 30, 20, 1000, 100000, 10, fake_clock);
+    MobileTwinnedAppServer::Config config;
+    config.twin_state_cache = _cache;
+    reconfigure(config);
+    return _cache;
+  }
+
+  // The clock that twin state caches created by the fixture run on. Each
+  // test starts at the same time.
+  static uint64_t fake_clock()
+  {
+    return _now_ms;
+  }
+
+  // Send a call to a subscriber with a single native device, and respond on
+  // the second fork with the given status, retrying to the mobile hosted
+  // VoIP clients if expected. Unlike test_with_two_forks, this doesn't check
+  // the headers Gemini adds. Returns the Request URI of the second fork.
+  std::string fork_call(std::string status, bool retry);
+
   // Test a call that gets forked to a VoIP client and the native device
   void test_with_two_forks(std::string method,
                            std::string status,
@@ -65,6 +117,13 @@ public:
   void test_with_gr(std::string method,
                     std::string status);
 
+  // Test a call that gets forked to a VoIP client and two native devices.
+  // The native devices respond with the given statuses, and the call is
+  // retried to the mobile hosted VoIP clients if expected.
+  void test_with_two_twins(std::string status1,
+                           std::string status2,
+                           bool retry);
+
   // Test a call that gets sent to the native device
   void test_with_g_3gpp_ics(std::string method,
                             std::string status,
@@ -100,16 +159,23 @@ public:
   }
 
   static MockAppServerTsxHelper* _helper;
+  MobileTwinnedAppServer* _as;
+  LocalStore* _store;
+  TwinStateCache* _cache;
+  static uint64_t _now_ms;
 
   static const int VOIP_FORK_ID;
   static const int MOBILE_FORK_ID;
   static const int MOBILE_VOIP_FORK_ID;
+  static const int MOBILE_FORK_ID_2;
 };
 MockAppServerTsxHelper* MobileTwinnedAppServerTest::_helper = NULL;
+uint64_t MobileTwinnedAppServerTest::_now_ms = 0;
 
 const int MobileTwinnedAppServerTest::VOIP_FORK_ID = 11111;
 const int MobileTwinnedAppServerTest::MOBILE_FORK_ID = 11112;
 const int MobileTwinnedAppServerTest::MOBILE_VOIP_FORK_ID = 11113;
+const int MobileTwinnedAppServerTest::MOBILE_FORK_ID_2 = 11114;
 
 namespace MobileTwinnedAS
 {
@@ -237,6 +303,47 @@ MATCHER_P(ReqUriEquals, uri, "")
   return arg_uri == uri;
 }
 
+std::string MobileTwinnedAppServerTest::fork_call(std::string status,
+                                                  bool retry)
+{
+  Message msg;
+  MobileTwinnedAppServerTsx as_tsx(_as);
+  as_tsx.set_helper(_helper);
+
+  pjsip_route_hdr* hdr = pjsip_rr_hdr_create(stack_data.pool);
+  hdr->name_addr.uri = PJUtils::uri_from_string("sip:mobile-twinned@gemini.homedomain;twin-prefix=111", stack_data.pool);
+  pjsip_msg* req = parse_msg(msg.get_request());
+  pjsip_msg* second = parse_msg(msg.get_request());
+  EXPECT_CALL(*_helper, route_hdr()).WillOnce(Return(hdr));
+  EXPECT_CALL(*_helper, clone_request(req)).WillOnce(Return(second));
+  EXPECT_CALL(*_helper, get_pool(_)).WillRepeatedly(Return(stack_data.pool));
+  EXPECT_CALL(*_helper, send_request(req)).WillOnce(Return(VOIP_FORK_ID));
+  EXPECT_CALL(*_helper, send_request(second)).WillOnce(Return(MOBILE_FORK_ID));
+  as_tsx.on_initial_request(req);
+
+  std::string second_uri = PJUtils::uri_to_string(PJSIP_URI_IN_REQ_URI,
+                                                  second->line.req.uri);
+
+  msg._status = status;
+  pjsip_msg* rsp = parse_msg(msg.get_response());
+
+  if (retry)
+  {
+    InSequence seq;
+    EXPECT_CALL(*_helper, original_request()).WillOnce(Return(req));
+    EXPECT_CALL(*_helper, send_request(req))
+      .WillOnce(Return(MOBILE_VOIP_FORK_ID));
+    EXPECT_CALL(*_helper, free_msg(rsp));
+  }
+  else
+  {
+    EXPECT_CALL(*_helper, send_response(rsp));
+  }
+  as_tsx.on_response(rsp, MOBILE_FORK_ID);
+
+  return second_uri;
+}
+
 void MobileTwinnedAppServerTest::test_with_two_forks(std::string method,
                                                      std::string status,
                                                      bool retry,
@@ -245,7 +352,7 @@ void MobileTwinnedAppServerTest::test_with_two_forks(std::string method,
   Message msg;
   msg._method = method;
   msg._extra = extra;
-  MobileTwinnedAppServerTsx as_tsx;
+  MobileTwinnedAppServerTsx as_tsx(_as);
   as_tsx.set_helper(_helper);
 
   pjsip_route_hdr* hdr = pjsip_rr_hdr_create(stack_data.pool);
@@ -390,13 +497,81 @@ void MobileTwinnedAppServerTest::test_with_two_forks(std::string method,
   }
 }
 
+void MobileTwinnedAppServerTest::test_with_two_twins(std::string status1,
+                                                     std::string status2,
+                                                     bool retry)
+{
+  Message msg;
+  MobileTwinnedAppServerTsx as_tsx(_as);
+  as_tsx.set_helper(_helper);
+
+  pjsip_route_hdr* hdr = pjsip_rr_hdr_create(stack_data.pool);
+  hdr->name_addr.uri = PJUtils::uri_from_string("sip:mobile-twinned@gemini.homedomain;twin-prefix=111;twin-prefix=222", stack_data.pool);
+  pjsip_msg* req = parse_msg(msg.get_request());
+  pjsip_msg* mobile1 = parse_msg(msg.get_request());
+  pjsip_msg* mobile2 = parse_msg(msg.get_request());
+  {
+    // Use a sequence to ensure this happens in order.
+    InSequence seq;
+    EXPECT_CALL(*_helper, route_hdr()).WillOnce(Return(hdr));
+    EXPECT_CALL(*_helper, clone_request(req))
+      .WillOnce(Return(mobile1))
+      .WillOnce(Return(mobile2));
+    EXPECT_CALL(*_helper, get_pool(req))
+      .WillOnce(Return(stack_data.pool));
+    EXPECT_CALL(*_helper, get_pool(mobile1))
+      .WillOnce(Return(stack_data.pool));
+    EXPECT_CALL(*_helper, get_pool(mobile2))
+      .WillOnce(Return(stack_data.pool));
+    EXPECT_CALL(*_helper, send_request(req))
+      .WillOnce(Return(VOIP_FORK_ID));
+    EXPECT_CALL(*_helper, send_request(mobile1))
+      .WillOnce(Return(MOBILE_FORK_ID));
+    EXPECT_CALL(*_helper, send_request(mobile2))
+      .WillOnce(Return(MOBILE_FORK_ID_2));
+  }
+  as_tsx.on_initial_request(req);
+
+  EXPECT_THAT(req, ReqUriEquals("sip:6505551234@homedomain"));
+  EXPECT_THAT(mobile1, ReqUriEquals("sip:1116505551234@homedomain"));
+  EXPECT_THAT(mobile2, ReqUriEquals("sip:2226505551234@homedomain"));
+
+  // The first response is always passed on - Sprout holds on to it until
+  // the other forks have responded.
+  msg._status = status1;
+  pjsip_msg* rsp = parse_msg(msg.get_response());
+  EXPECT_CALL(*_helper, send_response(rsp));
+  as_tsx.on_response(rsp, MOBILE_FORK_ID);
+
+  msg._status = status2;
+  rsp = parse_msg(msg.get_response());
+
+  if (retry)
+  {
+    InSequence seq;
+    EXPECT_CALL(*_helper, original_request())
+      .WillOnce(Return(req));
+    EXPECT_CALL(*_helper, get_pool(req))
+      .WillOnce(Return(stack_data.pool));
+    EXPECT_CALL(*_helper, send_request(req))
+      .WillOnce(Return(MOBILE_VOIP_FORK_ID));
+    EXPECT_CALL(*_helper, free_msg(rsp));
+  }
+  else
+  {
+    EXPECT_CALL(*_helper, send_response(rsp));
+  }
+
+  as_tsx.on_response(rsp, MOBILE_FORK_ID_2);
+}
+
 void MobileTwinnedAppServerTest::test_with_gr(std::string method,
                                               std::string status)
 {
   Message msg;
   msg._method = method;
   msg._parameters = ";gr=hello";
-  MobileTwinnedAppServerTsx as_tsx;
+  MobileTwinnedAppServerTsx as_tsx(_as);
   as_tsx.set_helper(_helper);
 
   pjsip_msg* req = parse_msg(msg.get_request());
@@ -420,7 +595,7 @@ void MobileTwinnedAppServerTest::test_with_g_3gpp_ics(std::string method,
   Message msg;
   msg._method = method;
   msg._extra = "Accept-Contact: *;audio\r\nAccept-Contact: *;+g.3gpp.ics=\"server,principal\"";
-  MobileTwinnedAppServerTsx as_tsx;
+  MobileTwinnedAppServerTsx as_tsx(_as);
   as_tsx.set_helper(_helper);
 
   pjsip_route_hdr* hdr = pjsip_rr_hdr_create(stack_data.pool);
@@ -495,6 +670,49 @@ TEST_F(MobileTwinnedAppServerTest, CreateMobileTwinnedAppServer)
   EXPECT_TRUE(as_tsx != NULL);
   delete as_tsx; as_tsx = NULL;
 
+  // Requests targeted at a specific VoIP client are passed through without
+  // creating an application server transaction.
+  msg._method = "INVITE";
+  msg._parameters = ";gr=hello";
+  req = parse_msg(msg.get_request());
+  as_tsx = (MobileTwinnedAppServerTsx*)as->get_app_tsx(NULL, req, uri, NULL, 0);
+  EXPECT_TRUE(as_tsx == NULL);
+  EXPECT_TRUE(uri == NULL);
+  EXPECT_EQ(1u, as->stats().requests_passed_through.value());
+
+  delete as; as = NULL;
+}
+
+// Test the policy for which requests are passed through without creating an
+// application server transaction.
+TEST_F(MobileTwinnedAppServerTest, PassThroughPolicy)
+{
+  Message msg;
+  pjsip_sip_uri* uri = NULL;
+  MobileTwinnedAppServerTsx* as_tsx;
+
+  // Don't pass anything through. Requests targeted at VoIP clients then get
+  // a transaction, just like any other.
+  MobileTwinnedAppServer::Config config;
+  config.pass_through = 0;
+  MobileTwinnedAppServer* as = new MobileTwinnedAppServer("gemini", config);
+
+  msg._method = "INVITE";
+  msg._parameters = ";gr=hello";
+  pjsip_msg* req = parse_msg(msg.get_request());
+  as_tsx = (MobileTwinnedAppServerTsx*)as->get_app_tsx(NULL, req, uri, NULL, 0);
+  EXPECT_TRUE(as_tsx != NULL);
+  delete as_tsx; as_tsx = NULL;
+
+  // SUBSCRIBEs are never passed through, as they're forked to both legs.
+  msg._method = "SUBSCRIBE";
+  msg._parameters = "";
+  req = parse_msg(msg.get_request());
+  as_tsx = (MobileTwinnedAppServerTsx*)as->get_app_tsx(NULL, req, uri, NULL, 0);
+  EXPECT_TRUE(as_tsx != NULL);
+  delete as_tsx; as_tsx = NULL;
+
+  EXPECT_EQ(0u, as->stats().requests_passed_through.value());
   delete as; as = NULL;
 }
 
@@ -603,6 +821,38 @@ TEST_F(MobileTwinnedAppServerTest, SuccessfulInviteWithAcceptContactNoTwinPrefix
   test_with_g_3gpp_ics("INVITE", "200 OK", "");
 }
 
+// Test that a subscriber with more native devices than Gemini forks to is
+// only forked to the first of them, and that this is counted.
+TEST_F(MobileTwinnedAppServerTest, TwinPrefixesTruncated)
+{
+  Message msg;
+  msg._extra = "Accept-Contact: *;+g.3gpp.ics=\"server,principal\"";
+  MobileTwinnedAppServerTsx as_tsx(_as);
+  as_tsx.set_helper(_helper);
+
+  pjsip_route_hdr* hdr = pjsip_rr_hdr_create(stack_data.pool);
+  hdr->name_addr.uri = PJUtils::uri_from_string("sip:mobile-twinned@gemini.homedomain;twin-prefix=111;twin-prefix=222;twin-prefix=333;twin-prefix=444;twin-prefix=555", stack_data.pool);
+  pjsip_msg* req = parse_msg(msg.get_request());
+  pjsip_msg* native2 = parse_msg(msg.get_request());
+  pjsip_msg* native3 = parse_msg(msg.get_request());
+  pjsip_msg* native4 = parse_msg(msg.get_request());
+
+  EXPECT_CALL(*_helper, route_hdr()).WillOnce(Return(hdr));
+  EXPECT_CALL(*_helper, clone_request(req))
+    .WillOnce(Return(native2))
+    .WillOnce(Return(native3))
+    .WillOnce(Return(native4));
+  EXPECT_CALL(*_helper, get_pool(_)).WillRepeatedly(Return(stack_data.pool));
+  EXPECT_CALL(*_helper, send_request(_))
+    .Times(4)
+    .WillRepeatedly(Return(MOBILE_FORK_ID));
+  as_tsx.on_initial_request(req);
+
+  EXPECT_THAT(req, ReqUriEquals("sip:1116505551234@homedomain"));
+  EXPECT_THAT(native4, ReqUriEquals("sip:4446505551234@homedomain"));
+  EXPECT_EQ(1u, _as->stats().twin_prefixes_truncated.value());
+}
+
 // Test with a non SIP URI. Call is rejected with a 480.
 TEST_F(MobileTwinnedAppServerTest, NoSIPURI)
 {
@@ -610,7 +860,115 @@ TEST_F(MobileTwinnedAppServerTest, NoSIPURI)
   msg._toscheme = "tel";
   msg._todomain = "";
 
-  MobileTwinnedAppServerTsx as_tsx;
+  MobileTwinnedAppServerTsx as_tsx(_as);
+  as_tsx.set_helper(_helper);
+  pjsip_msg* req = parse_msg(msg.get_request());
+  pjsip_msg* rsp = parse_msg(msg.get_response());
+  {
+    InSequence seq;
+    EXPECT_CALL(*_helper, create_response(req, PJSIP_SC_TEMPORARILY_UNAVAILABLE, ""))
+      .WillOnce(Return(rsp));
+    EXPECT_CALL(*_helper, send_response(rsp));
+    EXPECT_CALL(*_helper, free_msg(req));
+  }
+  as_tsx.on_initial_request(req);
+  EXPECT_EQ(1u, _as->stats().non_sip_uris_rejected.value());
+}
+
+// Test with a tel: URI when the home domain is configured. The URI is
+// converted to a SIP URI and the call is forked as normal.
+TEST_F(MobileTwinnedAppServerTest, TelURIConverted)
+{
+  MobileTwinnedAppServer::Config config;
+  config.home_domain = "homedomain";
+  reconfigure(config);
+
+  Message msg;
+  msg._toscheme = "tel";
+  msg._to = "+1-650-555-1234";
+  msg._todomain = "";
+  Message mobile_msg;
+  mobile_msg._to = "+16505551234";
+
+  MobileTwinnedAppServerTsx as_tsx(_as);
+  as_tsx.set_helper(_helper);
+  pjsip_msg* req = parse_msg(msg.get_request());
+  pjsip_msg* mobile = parse_msg(mobile_msg.get_request());
+  {
+    InSequence seq;
+    EXPECT_CALL(*_helper, get_pool(req))
+      .WillOnce(Return(stack_data.pool));
+    EXPECT_CALL(*_helper, route_hdr()).WillOnce(Return((pjsip_route_hdr*)NULL));
+    EXPECT_CALL(*_helper, clone_request(req))
+      .WillOnce(Return(mobile));
+    EXPECT_CALL(*_helper, get_pool(req))
+      .WillOnce(Return(stack_data.pool));
+    EXPECT_CALL(*_helper, get_pool(mobile))
+      .WillOnce(Return(stack_data.pool));
+    EXPECT_CALL(*_helper, send_request(req));
+    EXPECT_CALL(*_helper, send_request(mobile))
+      .WillOnce(Return(MOBILE_FORK_ID));
+  }
+  as_tsx.on_initial_request(req);
+
+  EXPECT_THAT(req, ReqUriEquals("sip:+16505551234@homedomain;user=phone"));
+  EXPECT_EQ(1u, _as->stats().tel_uris_converted.value());
+  EXPECT_EQ(0u, _as->stats().non_sip_uris_rejected.value());
+}
+
+// Test that the parameters of a tel: URI are kept in the user part of the
+// SIP URI it's converted to.
+TEST_F(MobileTwinnedAppServerTest, TelURIWithParamsConverted)
+{
+  MobileTwinnedAppServer::Config config;
+  config.home_domain = "homedomain";
+  reconfigure(config);
+
+  Message msg;
+  msg._toscheme = "tel";
+  msg._to = "+1-650-555-1234;isub=1234;ext=22;postd=pp22";
+  msg._todomain = "";
+  Message mobile_msg;
+
+  MobileTwinnedAppServerTsx as_tsx(_as);
+  as_tsx.set_helper(_helper);
+  pjsip_msg* req = parse_msg(msg.get_request());
+  pjsip_msg* mobile = parse_msg(mobile_msg.get_request());
+  {
+    InSequence seq;
+    EXPECT_CALL(*_helper, get_pool(req))
+      .WillOnce(Return(stack_data.pool));
+    EXPECT_CALL(*_helper, route_hdr()).WillOnce(Return((pjsip_route_hdr*)NULL));
+    EXPECT_CALL(*_helper, clone_request(req))
+      .WillOnce(Return(mobile));
+    EXPECT_CALL(*_helper, get_pool(req))
+      .WillOnce(Return(stack_data.pool));
+    EXPECT_CALL(*_helper, get_pool(mobile))
+      .WillOnce(Return(stack_data.pool));
+    EXPECT_CALL(*_helper, send_request(req));
+    EXPECT_CALL(*_helper, send_request(mobile))
+      .WillOnce(Return(MOBILE_FORK_ID));
+  }
+  as_tsx.on_initial_request(req);
+
+  EXPECT_THAT(req, ReqUriEquals("sip:+16505551234;isub=1234;ext=22;postd=pp22@homedomain;user=phone"));
+  EXPECT_EQ(1u, _as->stats().tel_uris_converted.value());
+}
+
+// Test that a request with a tel: URI that can't be converted is rejected
+// with a 480, even when the home domain is configured.
+TEST_F(MobileTwinnedAppServerTest, TelURINotConverted)
+{
+  MobileTwinnedAppServer::Config config;
+  config.home_domain = "homedomain";
+  reconfigure(config);
+
+  Message msg;
+  msg._toscheme = "tel";
+  msg._to = "+1-650-555-123A";
+  msg._todomain = "";
+
+  MobileTwinnedAppServerTsx as_tsx(_as);
   as_tsx.set_helper(_helper);
   pjsip_msg* req = parse_msg(msg.get_request());
   pjsip_msg* rsp = parse_msg(msg.get_response());
@@ -622,4 +980,777 @@ TEST_F(MobileTwinnedAppServerTest, NoSIPURI)
     EXPECT_CALL(*_helper, free_msg(req));
   }
   as_tsx.on_initial_request(req);
+
+  EXPECT_EQ(0u, _as->stats().tel_uris_converted.value());
+  EXPECT_EQ(1u, _as->stats().non_sip_uris_rejected.value());
+}
+
+// Test an INVITE to a subscriber whose native twin is known to be
+// unreachable. The call is forked straight to the VoIP clients and the
+// mobile hosted VoIP clients.
+TEST_F(MobileTwinnedAppServerTest, ForkNativeTwinKnownUnreachable)
+{
+  TwinStateCache* cache = use_twin_state_cache();
+  cache->set_native_state("6505551234@homedomain", TwinStateCache::UNREACHABLE);
+
+  Message msg;
+  MobileTwinnedAppServerTsx as_tsx(_as);
+  as_tsx.set_helper(_helper);
+
+  pjsip_route_hdr* hdr = pjsip_rr_hdr_create(stack_data.pool);
+  hdr->name_addr.uri = PJUtils::uri_from_string("sip:mobile-twinned@gemini.homedomain;twin-prefix=111", stack_data.pool);
+  pjsip_msg* req = parse_msg(msg.get_request());
+  pjsip_msg* mobile_voip = parse_msg(msg.get_request());
+  {
+    InSequence seq;
+    EXPECT_CALL(*_helper, route_hdr()).WillOnce(Return(hdr));
+    EXPECT_CALL(*_helper, clone_request(req))
+      .WillOnce(Return(mobile_voip));
+    EXPECT_CALL(*_helper, get_pool(req))
+      .WillOnce(Return(stack_data.pool));
+    EXPECT_CALL(*_helper, get_pool(mobile_voip))
+      .WillOnce(Return(stack_data.pool));
+    EXPECT_CALL(*_helper, send_request(req));
+    EXPECT_CALL(*_helper, send_request(mobile_voip))
+      .WillOnce(Return(MOBILE_VOIP_FORK_ID));
+  }
+  as_tsx.on_initial_request(req);
+
+  // The second fork isn't sent to the native device.
+  EXPECT_THAT(mobile_voip, ReqUriEquals("sip:6505551234@homedomain"));
+  pjsip_accept_contact_hdr* accept_header =
+   (pjsip_accept_contact_hdr*)pjsip_msg_find_hdr_by_name(mobile_voip,
+                                                         &STR_ACCEPT_CONTACT,
+                                                         NULL);
+  ASSERT_TRUE(accept_header != NULL);
+  EXPECT_TRUE(pjsip_param_find(&accept_header->feature_set, &STR_WITH_TWIN) != NULL);
+
+  // A 480 from the mobile hosted VoIP clients isn't retried.
+  msg._status = "480 Temporarily Unavailable";
+  pjsip_msg* rsp = parse_msg(msg.get_response());
+  EXPECT_CALL(*_helper, send_response(rsp));
+  as_tsx.on_response(rsp, MOBILE_VOIP_FORK_ID);
+}
+
+// Test that once the probe interval has passed, a call to a subscriber whose
+// native twin is known to be unreachable is forked to the native twin again,
+// and that the twin is learnt to be reachable when it answers.
+TEST_F(MobileTwinnedAppServerTest, NativeTwinKnownUnreachableProbed)
+{
+  TwinStateCache* cache = use_twin_state_cache();
+  cache->set_native_state("6505551234@homedomain", TwinStateCache::UNREACHABLE);
+
+  // Within the probe interval, the native twin isn't tried.
+  _now_ms += 9999;
+  EXPECT_EQ("sip:6505551234@homedomain", fork_call("200 OK", false));
+  EXPECT_EQ(0u, cache->probes());
+
+  _now_ms += 1;
+  EXPECT_EQ("sip:1116505551234@homedomain", fork_call("200 OK", false));
+  EXPECT_EQ(1u, cache->probes());
+  EXPECT_EQ(TwinStateCache::REACHABLE,
+            cache->get_native_state("6505551234@homedomain"));
+}
+
+// Test that a 480 from the native device is recorded in the twin state
+// cache, and that the next call isn't forked to the native device.
+TEST_F(MobileTwinnedAppServerTest, Native480RecordedInTwinStateCache)
+{
+  TwinStateCache* cache = use_twin_state_cache();
+
+  EXPECT_EQ("sip:1116505551234@homedomain",
+            fork_call("480 Temporarily Unavailable", true));
+  EXPECT_EQ(TwinStateCache::UNREACHABLE,
+            cache->get_native_state("6505551234@homedomain"));
+
+  EXPECT_EQ("sip:6505551234@homedomain", fork_call("200 OK", false));
+}
+
+// Test that the decisions made on a forked call that is retried are recorded
+// in the decision trace.
+TEST_F(MobileTwinnedAppServerTest, DecisionTraceRecordsRetry)
+{
+  DecisionTrace trace;
+  MobileTwinnedAppServer::Config config;
+  config.decision_trace = &trace;
+  reconfigure(config);
+
+  test_with_two_forks("INVITE", "480 Temporarily Unavailable", true);
+
+  char file[] = "/tmp/gemini_trace_ut.XXXXXX";
+  close(mkstemp(file));
+  std::vector<DecisionRecord> records;
+  EXPECT_TRUE(trace.dump(file));
+  EXPECT_TRUE(DecisionTrace::load(file, records));
+  unlink(file);
+
+  std::vector<uint16_t> events;
+  for (std::vector<DecisionRecord>::iterator it = records.begin();
+       it != records.end();
+       ++it)
+  {
+    events.push_back(it->event);
+  }
+
+  std::vector<uint16_t> expected_events = {DecisionTrace::REQ_FORKED,
+                                           DecisionTrace::FORK_TO_VOIP,
+                                           DecisionTrace::FORK_TO_NATIVE,
+                                           DecisionTrace::RSP_RECEIVED,
+                                           DecisionTrace::RETRY_ON_480,
+                                           DecisionTrace::FORK_TO_MOBILE_VOIP,
+                                           DecisionTrace::RSP_RECEIVED};
+  EXPECT_EQ(expected_events, events);
+  EXPECT_EQ(MOBILE_FORK_ID, records[2].fork_id);
+  EXPECT_EQ(480, records[3].status_code);
+}
+
+// Test that the timings of each fork are recorded against the right type of
+// leg.
+TEST_F(MobileTwinnedAppServerTest, ForkTimingsRecorded)
+{
+  MobileTwinnedAppServer::Config config;
+  config.detailed_timings = true;
+  reconfigure(config);
+
+  test_with_two_forks("INVITE", "480 Temporarily Unavailable", true);
+
+  GeminiStats& stats = _as->stats();
+  EXPECT_EQ(1u, stats.time_to_fail_ms[LEG_NATIVE].count());
+  EXPECT_EQ(0u, stats.time_to_answer_ms[LEG_NATIVE].count());
+  EXPECT_EQ(1u, stats.time_to_answer_ms[LEG_MOBILE_VOIP].count());
+  EXPECT_EQ(0u, stats.time_to_ring_ms[LEG_MOBILE_VOIP].count());
+}
+
+// Test that only the time to ring and answer are recorded unless detailed
+// timings are configured.
+TEST_F(MobileTwinnedAppServerTest, DetailedTimingsNotRecordedByDefault)
+{
+  test_with_two_forks("INVITE", "480 Temporarily Unavailable", true);
+
+  GeminiStats& stats = _as->stats();
+  EXPECT_EQ(0u, stats.time_to_fail_ms[LEG_NATIVE].count());
+  EXPECT_EQ(0u, stats.post_dial_delay_ms[LEG_NATIVE].count());
+  EXPECT_EQ(1u, stats.time_to_answer_ms[LEG_MOBILE_VOIP].count());
+}
+
+// Test that the AS, and so its histograms, are allocated on a cache line.
+TEST_F(MobileTwinnedAppServerTest, AllocatedOnCacheLine)
+{
+  EXPECT_EQ(0u, (uintptr_t)_as % 64);
+  EXPECT_EQ(0u, (uintptr_t)&_as->stats().time_to_answer_ms[LEG_NATIVE] % 64);
+}
+
+// Test that the fork timings are recorded inline, and the SAS events on the
+// background worker, if there is one.
+TEST_F(MobileTwinnedAppServerTest, BookkeepingOnWorker)
+{
+  GeminiWorker worker;
+  MobileTwinnedAppServer::Config config;
+  config.worker = &worker;
+  config.detailed_timings = true;
+  reconfigure(config);
+
+  test_with_two_forks("INVITE", "480 Temporarily Unavailable", true);
+
+  GeminiStats& stats = _as->stats();
+  EXPECT_EQ(1u, stats.time_to_fail_ms[LEG_NATIVE].count());
+  EXPECT_EQ(1u, stats.time_to_answer_ms[LEG_MOBILE_VOIP].count());
+
+  worker.flush();
+  EXPECT_GT(worker.processed(), 0u);
+  EXPECT_EQ(0u, worker.dropped(GeminiWorker::SAS_EVENT));
+}
+
+// Test that the time to ring and post-dial delay are recorded from the first
+// 18x response on a fork.
+TEST_F(MobileTwinnedAppServerTest, PostDialDelayRecorded)
+{
+  MobileTwinnedAppServer::Config config;
+  config.detailed_timings = true;
+  reconfigure(config);
+
+  Message msg;
+  msg._extra = "Accept-Contact: *;+g.3gpp.ics=\"server,principal\"";
+  MobileTwinnedAppServerTsx as_tsx(_as);
+  as_tsx.set_helper(_helper);
+
+  pjsip_msg* req = parse_msg(msg.get_request());
+  EXPECT_CALL(*_helper, route_hdr()).WillOnce(Return((pjsip_route_hdr*)NULL));
+  EXPECT_CALL(*_helper, get_pool(req)).WillOnce(Return(stack_data.pool));
+  EXPECT_CALL(*_helper, send_request(req)).WillOnce(Return(MOBILE_FORK_ID));
+  as_tsx.on_initial_request(req);
+
+  msg._status = "180 Ringing";
+  pjsip_msg* rsp = parse_msg(msg.get_response());
+  EXPECT_CALL(*_helper, send_response(rsp));
+  as_tsx.on_response(rsp, MOBILE_FORK_ID);
+
+  msg._status = "183 Session Progress";
+  rsp = parse_msg(msg.get_response());
+  EXPECT_CALL(*_helper, send_response(rsp));
+  as_tsx.on_response(rsp, MOBILE_FORK_ID);
+
+  msg._status = "200 OK";
+  rsp = parse_msg(msg.get_response());
+  EXPECT_CALL(*_helper, send_response(rsp));
+  as_tsx.on_response(rsp, MOBILE_FORK_ID);
+
+  GeminiStats& stats = _as->stats();
+  EXPECT_EQ(1u, stats.time_to_ring_ms[LEG_NATIVE].count());
+  EXPECT_EQ(1u, stats.post_dial_delay_ms[LEG_NATIVE].count());
+  EXPECT_EQ(1u, stats.time_to_answer_ms[LEG_NATIVE].count());
+}
+
+// Test that the pool memory used by Gemini's changes to each leg is
+// recorded, and that reserving it up front doesn't change the requests.
+TEST_F(MobileTwinnedAppServerTest, PoolUsageRecorded)
+{
+  MobileTwinnedAppServer::Config config;
+  config.record_pool_usage = true;
+  config.reserve_pool = true;
+  reconfigure(config);
+
+  test_with_two_forks("INVITE", "480 Temporarily Unavailable", true);
+
+  GeminiStats& stats = _as->stats();
+
+  for (int leg_type = 0; leg_type < NUM_LEG_TYPES; ++leg_type)
+  {
+    EXPECT_EQ(1u, stats.pool_bytes_added[leg_type].count());
+    EXPECT_GT(stats.pool_bytes_added[leg_type].sum(), 0u);
+    EXPECT_EQ(1u, stats.pool_used_bytes[leg_type].count());
+  }
+}
+
+// Test that the parameters Gemini adds are aligned when they're reserved
+// along with the twin prefix, which is allocated first and has an odd
+// length.
+TEST_F(MobileTwinnedAppServerTest, ReservedParamsAligned)
+{
+  MobileTwinnedAppServer::Config config;
+  config.reserve_pool = true;
+  reconfigure(config);
+
+  Message msg;
+  MobileTwinnedAppServerTsx as_tsx(_as);
+  as_tsx.set_helper(_helper);
+
+  pjsip_route_hdr* hdr = pjsip_rr_hdr_create(stack_data.pool);
+  hdr->name_addr.uri = PJUtils::uri_from_string("sip:mobile-twinned@gemini.homedomain;twin-prefix=111", stack_data.pool);
+  pjsip_msg* req = parse_msg(msg.get_request());
+  pjsip_msg* mobile = parse_msg(msg.get_request());
+  {
+    InSequence seq;
+    EXPECT_CALL(*_helper, route_hdr()).WillOnce(Return(hdr));
+    EXPECT_CALL(*_helper, clone_request(req)).WillOnce(Return(mobile));
+    EXPECT_CALL(*_helper, get_pool(req)).WillOnce(Return(stack_data.pool));
+    EXPECT_CALL(*_helper, get_pool(mobile)).WillOnce(Return(stack_data.pool));
+    EXPECT_CALL(*_helper, send_request(req));
+    EXPECT_CALL(*_helper, send_request(mobile)).WillOnce(Return(MOBILE_FORK_ID));
+  }
+  as_tsx.on_initial_request(req);
+
+  EXPECT_THAT(mobile, ReqUriEquals("sip:1116505551234@homedomain"));
+
+  int num_params = 0;
+  const pj_str_t* hdr_names[] = {&STR_ACCEPT_CONTACT, &STR_REJECT_CONTACT};
+
+  for (const pj_str_t* hdr_name : hdr_names)
+  {
+    pjsip_accept_contact_hdr* contact_hdr = (pjsip_accept_contact_hdr*)
+                         pjsip_msg_find_hdr_by_name(mobile, hdr_name, NULL);
+
+    while (contact_hdr != NULL)
+    {
+      for (pjsip_param* param = contact_hdr->feature_set.next;
+           param != &contact_hdr->feature_set;
+           param = param->next)
+      {
+        EXPECT_EQ(0u, (uintptr_t)param % alignof(pjsip_param));
+        num_params++;
+      }
+
+      contact_hdr = (pjsip_accept_contact_hdr*)
+            pjsip_msg_find_hdr_by_name(mobile, hdr_name, contact_hdr->next);
+    }
+  }
+
+  EXPECT_EQ(2, num_params);
+}
+
+// Test that the candidate policies are evaluated in shadow mode on a call
+// that's retried to the mobile hosted VoIP clients, and on one that isn't.
+TEST_F(MobileTwinnedAppServerTest, ShadowPoliciesEvaluated)
+{
+  MobileTwinnedAppServer::Config config;
+  config.shadow_sample_rate = 1;
+  reconfigure(config);
+
+  test_with_two_forks("INVITE", "480 Temporarily Unavailable", true);
+
+  GeminiStats& stats = _as->stats();
+  GeminiShadowStats& parallel = stats.shadow[SHADOW_PARALLEL_FORK];
+  GeminiShadowStats& hedged = stats.shadow[SHADOW_HEDGED_RETRY];
+  EXPECT_EQ(1u, parallel.calls.value());
+  EXPECT_EQ(1u, parallel.earlier_retries.value());
+  EXPECT_EQ(1u, parallel.latency_saved_ms.count());
+  EXPECT_EQ(0u, parallel.extra_forks.value());
+
+  // The native device failed well within the hedge delay, so hedging
+  // wouldn't have made a difference.
+  EXPECT_EQ(1u, hedged.calls.value());
+  EXPECT_EQ(0u, hedged.earlier_retries.value());
+  EXPECT_EQ(0u, hedged.extra_forks.value());
+
+  test_with_two_forks("INVITE", "200 OK", false);
+
+  EXPECT_EQ(2u, parallel.calls.value());
+  EXPECT_EQ(1u, parallel.earlier_retries.value());
+  EXPECT_EQ(1u, parallel.extra_forks.value());
+  EXPECT_EQ(2u, hedged.calls.value());
+  EXPECT_EQ(0u, hedged.extra_forks.value());
+}
+
+// Test that a call that completes without a retry is evaluated when its
+// final response is passed on, not when the transaction is destroyed.
+TEST_F(MobileTwinnedAppServerTest, ShadowEvaluatedOnFinalResponse)
+{
+  MobileTwinnedAppServer::Config config;
+  config.shadow_sample_rate = 1;
+  reconfigure(config);
+  GeminiShadowStats& parallel = _as->stats().shadow[SHADOW_PARALLEL_FORK];
+
+  {
+    Message msg;
+    MobileTwinnedAppServerTsx as_tsx(_as);
+    as_tsx.set_helper(_helper);
+
+    pjsip_msg* req = parse_msg(msg.get_request());
+    pjsip_msg* mobile = parse_msg(msg.get_request());
+    EXPECT_CALL(*_helper, route_hdr()).WillOnce(Return((pjsip_route_hdr*)NULL));
+    EXPECT_CALL(*_helper, clone_request(req)).WillOnce(Return(mobile));
+    EXPECT_CALL(*_helper, get_pool(req)).WillOnce(Return(stack_data.pool));
+    EXPECT_CALL(*_helper, get_pool(mobile)).WillOnce(Return(stack_data.pool));
+    EXPECT_CALL(*_helper, send_request(req)).WillOnce(Return(VOIP_FORK_ID));
+    EXPECT_CALL(*_helper, send_request(mobile)).WillOnce(Return(MOBILE_FORK_ID));
+    as_tsx.on_initial_request(req);
+
+    // A failure on one fork doesn't complete the call.
+    msg._status = "486 Busy Here";
+    pjsip_msg* rsp = parse_msg(msg.get_response());
+    EXPECT_CALL(*_helper, send_response(rsp));
+    as_tsx.on_response(rsp, VOIP_FORK_ID);
+    EXPECT_EQ(0u, parallel.extra_forks.value());
+
+    msg._status = "200 OK";
+    rsp = parse_msg(msg.get_response());
+    EXPECT_CALL(*_helper, send_response(rsp));
+    as_tsx.on_response(rsp, MOBILE_FORK_ID);
+    EXPECT_EQ(1u, parallel.extra_forks.value());
+  }
+
+  EXPECT_EQ(1u, parallel.calls.value());
+  EXPECT_EQ(1u, parallel.extra_forks.value());
+}
+
+// Test that a SUBSCRIBE is only sent to the leg that accepted the
+// subscriber's last subscription to the event package.
+TEST_F(MobileTwinnedAppServerTest, SubscribeSentToMemoisedLeg)
+{
+  SubscribeMemo memo;
+  memo.set_leg(SubscribeMemo::key("6505551234@homedomain", "presence"),
+               LEG_NATIVE);
+  MobileTwinnedAppServer::Config config;
+  config.subscribe_memo = &memo;
+  reconfigure(config);
+
+  Message msg;
+  msg._method = "SUBSCRIBE";
+  msg._extra = "Event: presence";
+  MobileTwinnedAppServerTsx as_tsx(_as);
+  as_tsx.set_helper(_helper);
+
+  pjsip_route_hdr* hdr = pjsip_rr_hdr_create(stack_data.pool);
+  hdr->name_addr.uri = PJUtils::uri_from_string("sip:mobile-twinned@gemini.homedomain;twin-prefix=111", stack_data.pool);
+  pjsip_msg* req = parse_msg(msg.get_request());
+  {
+    InSequence seq;
+    EXPECT_CALL(*_helper, route_hdr()).WillOnce(Return(hdr));
+    EXPECT_CALL(*_helper, get_pool(req)).WillOnce(Return(stack_data.pool));
+    EXPECT_CALL(*_helper, send_request(req)).WillOnce(Return(MOBILE_FORK_ID));
+  }
+  as_tsx.on_initial_request(req);
+
+  EXPECT_THAT(req, ReqUriEquals("sip:1116505551234@homedomain"));
+
+  pjsip_msg* rsp = parse_msg(msg.get_response());
+  EXPECT_CALL(*_helper, send_response(rsp));
+  as_tsx.on_response(rsp, MOBILE_FORK_ID);
+
+  EXPECT_EQ(1u, _as->stats().subscribes_to_memoised_leg.value());
+  EXPECT_EQ(0u, _as->stats().subscribe_memo_fallbacks.value());
+}
+
+// Test that the memo also finds the event package of a SUBSCRIBE with the
+// compact form of the Event header.
+TEST_F(MobileTwinnedAppServerTest, SubscribeCompactEventHeader)
+{
+  SubscribeMemo memo;
+  memo.set_leg(SubscribeMemo::key("6505551234@homedomain", "presence"),
+               LEG_NATIVE);
+  MobileTwinnedAppServer::Config config;
+  config.subscribe_memo = &memo;
+  reconfigure(config);
+
+  Message msg;
+  msg._method = "SUBSCRIBE";
+  msg._extra = "o: presence";
+  MobileTwinnedAppServerTsx as_tsx(_as);
+  as_tsx.set_helper(_helper);
+
+  pjsip_route_hdr* hdr = pjsip_rr_hdr_create(stack_data.pool);
+  hdr->name_addr.uri = PJUtils::uri_from_string("sip:mobile-twinned@gemini.homedomain;twin-prefix=111", stack_data.pool);
+  pjsip_msg* req = parse_msg(msg.get_request());
+  {
+    InSequence seq;
+    EXPECT_CALL(*_helper, route_hdr()).WillOnce(Return(hdr));
+    EXPECT_CALL(*_helper, get_pool(req)).WillOnce(Return(stack_data.pool));
+    EXPECT_CALL(*_helper, send_request(req)).WillOnce(Return(MOBILE_FORK_ID));
+  }
+  as_tsx.on_initial_request(req);
+
+  EXPECT_THAT(req, ReqUriEquals("sip:1116505551234@homedomain"));
+  EXPECT_EQ(1u, _as->stats().subscribes_to_memoised_leg.value());
+
+  pjsip_msg* rsp = parse_msg(msg.get_response());
+  EXPECT_CALL(*_helper, send_response(rsp));
+  as_tsx.on_response(rsp, MOBILE_FORK_ID);
+}
+
+// Test that a SUBSCRIBE rejected by the memoised leg is forked to the other
+// leg, and that the leg that accepted it is memoised instead.
+TEST_F(MobileTwinnedAppServerTest, SubscribeMemoFallsBack)
+{
+  SubscribeMemo memo;
+  std::string key = SubscribeMemo::key("6505551234@homedomain", "presence");
+  memo.set_leg(key, LEG_VOIP);
+  MobileTwinnedAppServer::Config config;
+  config.subscribe_memo = &memo;
+  reconfigure(config);
+
+  Message msg;
+  msg._method = "SUBSCRIBE";
+  msg._extra = "Event: presence";
+  MobileTwinnedAppServerTsx as_tsx(_as);
+  as_tsx.set_helper(_helper);
+
+  pjsip_route_hdr* hdr = pjsip_rr_hdr_create(stack_data.pool);
+  hdr->name_addr.uri = PJUtils::uri_from_string("sip:mobile-twinned@gemini.homedomain;twin-prefix=111", stack_data.pool);
+  pjsip_msg* req = parse_msg(msg.get_request());
+  pjsip_msg* native = parse_msg(msg.get_request());
+  {
+    InSequence seq;
+    EXPECT_CALL(*_helper, route_hdr()).WillOnce(Return(hdr));
+    EXPECT_CALL(*_helper, get_pool(req)).WillOnce(Return(stack_data.pool));
+    EXPECT_CALL(*_helper, send_request(req)).WillOnce(Return(VOIP_FORK_ID));
+  }
+  as_tsx.on_initial_request(req);
+
+  EXPECT_THAT(req, ReqUriEquals("sip:6505551234@homedomain"));
+
+  msg._status = "404 Not Found";
+  pjsip_msg* rsp = parse_msg(msg.get_response());
+  {
+    InSequence seq;
+    EXPECT_CALL(*_helper, original_request()).WillOnce(Return(native));
+    EXPECT_CALL(*_helper, route_hdr()).WillOnce(Return(hdr));
+    EXPECT_CALL(*_helper, get_pool(native)).WillOnce(Return(stack_data.pool));
+    EXPECT_CALL(*_helper, send_request(native)).WillOnce(Return(MOBILE_FORK_ID));
+    EXPECT_CALL(*_helper, free_msg(rsp));
+  }
+  as_tsx.on_response(rsp, VOIP_FORK_ID);
+
+  EXPECT_THAT(native, ReqUriEquals("sip:1116505551234@homedomain"));
+  EXPECT_EQ(NUM_LEG_TYPES, memo.get_leg(key));
+
+  msg._status = "200 OK";
+  rsp = parse_msg(msg.get_response());
+  EXPECT_CALL(*_helper, send_response(rsp));
+  as_tsx.on_response(rsp, MOBILE_FORK_ID);
+
+  EXPECT_EQ(LEG_NATIVE, memo.get_leg(key));
+  EXPECT_EQ(1u, _as->stats().subscribe_memo_fallbacks.value());
+}
+
+// Test that a call isn't forked to the native twin if another transaction
+// already has a fork of the same call to it in flight.
+TEST_F(MobileTwinnedAppServerTest, NativeForkDeduplicated)
+{
+  NativeForkDedup dedup;
+  MobileTwinnedAppServer::Config config;
+  config.native_fork_dedup = &dedup;
+  reconfigure(config);
+
+  Message msg;
+  MobileTwinnedAppServerTsx as_tsx(_as);
+  as_tsx.set_helper(_helper);
+
+  pjsip_route_hdr* hdr = pjsip_rr_hdr_create(stack_data.pool);
+  hdr->name_addr.uri = PJUtils::uri_from_string("sip:mobile-twinned@gemini.homedomain;twin-prefix=111", stack_data.pool);
+  pjsip_msg* req = parse_msg(msg.get_request());
+  pjsip_msg* mobile = parse_msg(msg.get_request());
+
+  // Another transaction is already paging the native twin for this call.
+  pjsip_sip_uri* uri = (pjsip_sip_uri*)req->line.req.uri;
+  uint64_t key = NativeForkDedup::key(&PJSIP_MSG_CID_HDR(req)->id,
+                                      &uri->user,
+                                      &uri->host);
+  uint64_t owner;
+  ASSERT_TRUE(dedup.claim(key, owner));
+
+  {
+    InSequence seq;
+    EXPECT_CALL(*_helper, route_hdr()).WillOnce(Return(hdr));
+    EXPECT_CALL(*_helper, clone_request(req)).WillOnce(Return(mobile));
+    EXPECT_CALL(*_helper, get_pool(req)).WillOnce(Return(stack_data.pool));
+    EXPECT_CALL(*_helper, free_msg(mobile));
+    EXPECT_CALL(*_helper, send_request(req)).WillOnce(Return(VOIP_FORK_ID));
+  }
+  as_tsx.on_initial_request(req);
+
+  EXPECT_THAT(req, ReqUriEquals("sip:6505551234@homedomain"));
+  EXPECT_EQ(1u, _as->stats().native_forks_deduplicated.value());
+
+  // Once the other transaction's native fork completes, the next one can
+  // page the native twin.
+  dedup.release(key, owner);
+  test_with_two_forks("INVITE", "200 OK", false);
+  EXPECT_EQ(1u, _as->stats().native_forks_deduplicated.value());
+  EXPECT_TRUE(dedup.claim(key, owner));
+}
+
+// Test that a call is still forked to the native twin if there's no room to
+// record it in the dedup table, and that this is counted.
+TEST_F(MobileTwinnedAppServerTest, NativeForkDedupOverflow)
+{
+  // One slot per stripe, which is already taken in the call's stripe.
+  NativeForkDedup dedup(5000, 1);
+  MobileTwinnedAppServer::Config config;
+  config.native_fork_dedup = &dedup;
+  reconfigure(config);
+
+  Message msg;
+  pjsip_msg* req = parse_msg(msg.get_request());
+  pjsip_sip_uri* uri = (pjsip_sip_uri*)req->line.req.uri;
+  uint64_t key = NativeForkDedup::key(&PJSIP_MSG_CID_HDR(req)->id,
+                                      &uri->user,
+                                      &uri->host);
+  uint64_t owner;
+  ASSERT_TRUE(dedup.claim(key + 64, owner));
+
+  test_with_two_forks("INVITE", "200 OK", false);
+  EXPECT_EQ(0u, _as->stats().native_forks_deduplicated.value());
+  EXPECT_EQ(1u, _as->stats().native_fork_dedup_overflows.value());
+  EXPECT_EQ(1u, dedup.overflows());
+}
+
+// Test that a g.3gpp.ics feature beyond the Accept-Contact scan limits is
+// ignored, and that the truncated scans are counted.
+TEST_F(MobileTwinnedAppServerTest, AcceptContactScanLimited)
+{
+  MobileTwinnedAppServer::Config config;
+  config.accept_contact_limits.max_headers = 2;
+  config.accept_contact_limits.max_value_len = 20;
+  reconfigure(config);
+  GeminiStats& stats = _as->stats();
+
+  // Too many headers before the one targeting the native device.
+  test_with_two_forks("INVITE",
+                      "200 OK",
+                      false,
+                      "Accept-Contact: *;audio\r\n"
+                      "Accept-Contact: *;video\r\n"
+                      "Accept-Contact: *;+g.3gpp.ics=\"server,principal\"");
+  EXPECT_EQ(1u, stats.accept_contact_scans_truncated[SCAN_LIMIT_HEADERS].value());
+
+  // The native device's value is beyond the length examined.
+  test_with_two_forks("INVITE",
+                      "200 OK",
+                      false,
+                      "Accept-Contact: *;+g.3gpp.ics=\"xxxxxxxxxxxxxxxxxxxxxxxx,server\"");
+  EXPECT_EQ(1u, stats.accept_contact_scans_truncated[SCAN_LIMIT_VALUE_LEN].value());
+  EXPECT_EQ(0u, stats.accept_contact_scans_truncated[SCAN_LIMIT_PARAMS].value());
+
+  // Within the limits, the request is still sent to the native device.
+  test_with_g_3gpp_ics("INVITE", "200 OK", "111");
+  EXPECT_EQ(1u, stats.accept_contact_scans_truncated[SCAN_LIMIT_HEADERS].value());
+}
+
+// Test that Gemini doesn't add headers that are already in a request (for
+// example because it has spiralled), and counts the bytes it does add.
+TEST_F(MobileTwinnedAppServerTest, ExistingContactHeadersNotDuplicated)
+{
+  MobileTwinnedAppServer::Config config;
+  config.record_pool_usage = true;
+  reconfigure(config);
+  GeminiStats& stats = _as->stats();
+
+  // A header with an extra feature isn't equivalent to one of Gemini's.
+  test_with_two_forks("INVITE",
+                      "200 OK",
+                      false,
+                      "Reject-Contact: *;+sip.with-twin;audio");
+  EXPECT_EQ(0u, stats.contact_headers_skipped.value());
+  uint64_t voip_bytes = stats.wire_bytes_added[LEG_VOIP].sum();
+  uint64_t native_bytes = stats.wire_bytes_added[LEG_NATIVE].sum();
+  EXPECT_GT(voip_bytes, 0u);
+  EXPECT_GT(native_bytes, 0u);
+
+  // The request already has the VoIP fork's headers, one of which is also
+  // on the native fork. Only the native fork's Accept-Contact header and
+  // twin prefix are added.
+  test_with_two_forks("INVITE",
+                      "200 OK",
+                      false,
+                      "Reject-Contact: *;+sip.with-twin\r\n"
+                      "Reject-Contact: *;+g.3gpp.ics=\"server,principal\"");
+  EXPECT_EQ(3u, stats.contact_headers_skipped.value());
+  EXPECT_EQ(2u, stats.wire_bytes_added[LEG_VOIP].count());
+  EXPECT_EQ(voip_bytes, stats.wire_bytes_added[LEG_VOIP].sum());
+  EXPECT_EQ(strlen("Accept-Contact: *;+g.3gpp.ics=\"server,principal\";require;explicit\r\n") +
+            strlen("111"),
+            stats.wire_bytes_added[LEG_NATIVE].sum() - native_bytes);
+}
+
+// Test that one of Gemini's headers beyond the scan limits isn't spotted, so
+// is added again, and that the truncated scan is counted.
+TEST_F(MobileTwinnedAppServerTest, ExistingContactHeadersScanLimited)
+{
+  MobileTwinnedAppServer::Config config;
+  config.accept_contact_limits.max_headers = 2;
+  reconfigure(config);
+  GeminiStats& stats = _as->stats();
+
+  test_with_two_forks("INVITE",
+                      "200 OK",
+                      false,
+                      "Reject-Contact: *;audio\r\n"
+                      "Reject-Contact: *;video\r\n"
+                      "Reject-Contact: *;+sip.with-twin");
+  EXPECT_EQ(0u, stats.contact_headers_skipped.value());
+  EXPECT_EQ(1u, stats.accept_contact_scans_truncated[SCAN_LIMIT_HEADERS].value());
+
+  // The wire bytes are only recorded along with the pool usage.
+  EXPECT_EQ(0u, stats.wire_bytes_added[LEG_VOIP].count());
+
+  // Within the limit, the header isn't added again.
+  test_with_two_forks("INVITE",
+                      "200 OK",
+                      false,
+                      "Reject-Contact: *;+sip.with-twin");
+  EXPECT_EQ(2u, stats.contact_headers_skipped.value());
+  EXPECT_EQ(1u, stats.accept_contact_scans_truncated[SCAN_LIMIT_HEADERS].value());
+}
+
+// Test that the work done for a request is accounted to the tenant whose AS
+// URI invoked Gemini.
+TEST_F(MobileTwinnedAppServerTest, TenantAccounted)
+{
+  TenantAccounting accounting;
+  MobileTwinnedAppServer::Config config;
+  config.tenant_accounting = &accounting;
+  reconfigure(config);
+
+  Message msg;
+  msg._extra = "Accept-Contact: *;+g.3gpp.ics=\"server,principal\"";
+  MobileTwinnedAppServerTsx as_tsx(_as);
+  as_tsx.set_helper(_helper);
+
+  pjsip_route_hdr* hdr = pjsip_rr_hdr_create(stack_data.pool);
+  hdr->name_addr.uri = PJUtils::uri_from_string("sip:mobile-twinned@gemini.homedomain;twin-prefix=111", stack_data.pool);
+  pjsip_msg* req = parse_msg(msg.get_request());
+  EXPECT_CALL(*_helper, route_hdr()).WillRepeatedly(Return(hdr));
+  EXPECT_CALL(*_helper, get_pool(req)).WillRepeatedly(Return(stack_data.pool));
+  EXPECT_CALL(*_helper, send_request(req)).WillOnce(Return(MOBILE_FORK_ID));
+  as_tsx.on_initial_request(req);
+
+  msg._status = "200 OK";
+  pjsip_msg* rsp = parse_msg(msg.get_response());
+  EXPECT_CALL(*_helper, send_response(rsp));
+  as_tsx.on_response(rsp, MOBILE_FORK_ID);
+
+  std::vector<TenantAccounting::Usage> usage;
+  accounting.totals(usage);
+  ASSERT_EQ(2u, usage.size());
+  EXPECT_EQ("sip:mobile-twinned@gemini.homedomain;twin-prefix=111", usage[1].tenant);
+  EXPECT_EQ(1u, usage[1].counters[TenantAccounting::INVITES]);
+  EXPECT_EQ(0u, usage[1].counters[TenantAccounting::SUBSCRIBES]);
+  EXPECT_EQ(1u, usage[1].counters[TenantAccounting::FORKS]);
+  EXPECT_EQ(0u, usage[1].counters[TenantAccounting::RETRIES]);
+  EXPECT_GT(usage[1].counters[TenantAccounting::POOL_BYTES], 0u);
+  EXPECT_GT(usage[1].counters[TenantAccounting::PROCESSING_NS], 0u);
+}
+
+// Test a call that gets forked to two native devices, both of which return a
+// 480. The call is then retried to the mobile hosted VoIP clients.
+TEST_F(MobileTwinnedAppServerTest, ForkTwoTwinsBothUnavailable)
+{
+  test_with_two_twins("480 Temporarily Unavailable",
+                      "480 Temporarily Unavailable",
+                      true);
+}
+
+// Test a call that gets forked to two native devices, one of which returns a
+// 480 and the other rejects the call. There's no retry.
+TEST_F(MobileTwinnedAppServerTest, ForkTwoTwinsOneBusy)
+{
+  test_with_two_twins("480 Temporarily Unavailable", "486 Busy Here", false);
+  test_with_two_twins("486 Busy Here", "480 Temporarily Unavailable", false);
+}
+
+// Test a call that gets forked to two native devices, one of which answers.
+TEST_F(MobileTwinnedAppServerTest, ForkTwoTwinsOneAnswers)
+{
+  test_with_two_twins("480 Temporarily Unavailable", "200 OK", false);
+}
+
+// Test a call that is targeted at the native devices of a subscriber with two
+// of them. The call is sent to both.
+TEST_F(MobileTwinnedAppServerTest, InviteWithAcceptContactTwoTwins)
+{
+  Message msg;
+  msg._extra = "Accept-Contact: *;+g.3gpp.ics=\"server,principal\"";
+  MobileTwinnedAppServerTsx as_tsx(_as);
+  as_tsx.set_helper(_helper);
+
+  pjsip_route_hdr* hdr = pjsip_rr_hdr_create(stack_data.pool);
+  hdr->name_addr.uri = PJUtils::uri_from_string("sip:mobile-twinned@gemini.homedomain;twin-prefix=111;twin-prefix=222", stack_data.pool);
+  pjsip_msg* req = parse_msg(msg.get_request());
+  pjsip_msg* mobile2 = parse_msg(msg.get_request());
+  {
+    InSequence seq;
+    EXPECT_CALL(*_helper, route_hdr()).WillOnce(Return(hdr));
+    EXPECT_CALL(*_helper, clone_request(req))
+      .WillOnce(Return(mobile2));
+    EXPECT_CALL(*_helper, get_pool(req))
+      .WillOnce(Return(stack_data.pool));
+    EXPECT_CALL(*_helper, send_request(req))
+      .WillOnce(Return(MOBILE_FORK_ID));
+    EXPECT_CALL(*_helper, get_pool(mobile2))
+      .WillOnce(Return(stack_data.pool));
+    EXPECT_CALL(*_helper, send_request(mobile2))
+      .WillOnce(Return(MOBILE_FORK_ID_2));
+  }
+  as_tsx.on_initial_request(req);
+
+  EXPECT_THAT(req, ReqUriEquals("sip:1116505551234@homedomain"));
+  EXPECT_THAT(mobile2, ReqUriEquals("sip:2226505551234@homedomain"));
+
+  // A 480 isn't retried, as the call was targeted at the native devices.
+  msg._status = "480 Temporarily Unavailable";
+  pjsip_msg* rsp = parse_msg(msg.get_response());
+  EXPECT_CALL(*_helper, send_response(rsp));
+  as_tsx.on_response(rsp, MOBILE_FORK_ID);
+  EXPECT_CALL(*_helper, send_response(rsp));
+  as_tsx.on_response(rsp, MOBILE_FORK_ID_2);
 }
@@ -0,0 +1,128 @@
+/**
+ * @file nativeforkdedup_test.cpp UT for the table of native forks in flight
+ * which is part of gemini.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "nativeforkdedup.h"
+
+/// The time the tables under test see.
+static uint64_t g_now_ms = 1000000;
+
+static uint64_t fake_clock()
+{
+  return g_now_ms;
+}
+
+/// Returns the key of a call to a callee in the home domain.
+static uint64_t call_key(const char* call_id, const char* callee)
+{
+  pj_str_t call_id_str = pj_str((char*)call_id);
+  pj_str_t user = pj_str((char*)callee);
+  pj_str_t host = pj_str((char*)"homedomain");
+  return NativeForkDedup::key(&call_id_str, &user, &host);
+}
+
+// Test that only the first claim on a call succeeds until it's released.
+TEST(NativeForkDedupTest, ClaimAndRelease)
+{
+  NativeForkDedup dedup;
+  uint64_t key = call_key("call1@10.114.61.213", "6505551234");
+  uint64_t owner;
+  uint64_t other_owner;
+
+  EXPECT_TRUE(dedup.claim(key, owner));
+  EXPECT_NE(0u, owner);
+  EXPECT_FALSE(dedup.claim(key, other_owner));
+
+  dedup.release(key, owner);
+  EXPECT_TRUE(dedup.claim(key, other_owner));
+  EXPECT_NE(owner, other_owner);
+}
+
+// Test that calls are distinguished by both Call-ID and callee.
+TEST(NativeForkDedupTest, KeyedOnCallAndCallee)
+{
+  NativeForkDedup dedup;
+  uint64_t owner;
+
+  EXPECT_TRUE(dedup.claim(call_key("call1@10.114.61.213", "6505551234"), owner));
+  EXPECT_TRUE(dedup.claim(call_key("call1@10.114.61.213", "6505551235"), owner));
+  EXPECT_TRUE(dedup.claim(call_key("call2@10.114.61.213", "6505551234"), owner));
+  EXPECT_FALSE(dedup.claim(call_key("call2@10.114.61.213", "6505551234"), owner));
+}
+
+// Test that a claim that's never released expires.
+TEST(NativeForkDedupTest, Expiry)
+{
+  NativeForkDedup dedup(5000, 65536, fake_clock);
+  uint64_t key = call_key("call1@10.114.61.213", "6505551234");
+  uint64_t owner;
+
+  EXPECT_TRUE(dedup.claim(key, owner));
+  g_now_ms += 4999;
+  EXPECT_FALSE(dedup.claim(key, owner));
+
+  g_now_ms += 1;
+  EXPECT_TRUE(dedup.claim(key, owner));
+}
+
+// Test that releasing a claim that has expired doesn't release the claim
+// another transaction has made on the call since.
+TEST(NativeForkDedupTest, ReleaseAfterExpiry)
+{
+  NativeForkDedup dedup(5000, 65536, fake_clock);
+  uint64_t key = call_key("call1@10.114.61.213", "6505551234");
+  uint64_t owner;
+  uint64_t new_owner;
+
+  EXPECT_TRUE(dedup.claim(key, owner));
+  g_now_ms += 5000;
+  EXPECT_TRUE(dedup.claim(key, new_owner));
+
+  dedup.release(key, owner);
+  EXPECT_FALSE(dedup.claim(key, owner));
+
+  dedup.release(key, new_owner);
+  EXPECT_TRUE(dedup.claim(key, owner));
+}
+
+// Test that calls are let through, and counted, once there's no room to
+// record them.
+TEST(NativeForkDedupTest, Overflow)
+{
+  NativeForkDedup dedup(5000, 64);
+  uint64_t owner;
+  uint64_t unrecorded = 0;
+
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    EXPECT_TRUE(dedup.claim(call_key(std::to_string(ii).c_str(), "6505551234"),
+                            owner));
+
+    if (owner == 0)
+    {
+      unrecorded++;
+    }
+  }
+
+  EXPECT_GT(dedup.overflows(), 0u);
+  EXPECT_EQ(dedup.overflows(), unrecorded);
+}
+
+// Test that a table on the heap keeps its stripes on their own cache lines.
+TEST(NativeForkDedupTest, AllocatedOnCacheLine)
+{
+  NativeForkDedup* dedup = new NativeForkDedup();
+  EXPECT_EQ(0u, (uintptr_t)dedup % 64);
+  delete dedup;
+}
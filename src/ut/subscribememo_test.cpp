@@ -0,0 +1,83 @@
+/**
+ * @file subscribememo_test.cpp UT for the memo of which leg accepted each
+ * subscriber's subscriptions, which is part of gemini.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "subscribememo.h"
+
+/// The time the memos under test see.
+static uint64_t g_now_ms = 1000000;
+
+static uint64_t fake_clock()
+{
+  return g_now_ms;
+}
+
+// Test that the memo returns the leg it was told accepted a subscription,
+// separately for each event package.
+TEST(SubscribeMemoTest, SetAndGet)
+{
+  SubscribeMemo memo;
+  std::string presence = SubscribeMemo::key("6505551234@homedomain", "presence");
+  std::string reg = SubscribeMemo::key("6505551234@homedomain", "reg");
+
+  EXPECT_EQ(NUM_LEG_TYPES, memo.get_leg(presence));
+
+  memo.set_leg(presence, LEG_NATIVE);
+  memo.set_leg(reg, LEG_VOIP);
+  EXPECT_EQ(LEG_NATIVE, memo.get_leg(presence));
+  EXPECT_EQ(LEG_VOIP, memo.get_leg(reg));
+
+  memo.forget(presence);
+  EXPECT_EQ(NUM_LEG_TYPES, memo.get_leg(presence));
+  EXPECT_EQ(LEG_VOIP, memo.get_leg(reg));
+}
+
+// Test that entries aren't trusted once they've expired.
+TEST(SubscribeMemoTest, Expiry)
+{
+  SubscribeMemo memo(10000, 100000, fake_clock);
+  std::string key = SubscribeMemo::key("6505551234@homedomain", "presence");
+
+  memo.set_leg(key, LEG_VOIP);
+  g_now_ms += 9999;
+  EXPECT_EQ(LEG_VOIP, memo.get_leg(key));
+
+  g_now_ms += 1;
+  EXPECT_EQ(NUM_LEG_TYPES, memo.get_leg(key));
+}
+
+// Test that the memo doesn't grow beyond its maximum size.
+TEST(SubscribeMemoTest, Bounded)
+{
+  SubscribeMemo memo(600000, 16);
+
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    memo.set_leg(SubscribeMemo::key(std::to_string(ii) + "@homedomain", "presence"),
+                 LEG_NATIVE);
+  }
+
+  int remembered = 0;
+
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    if (memo.get_leg(SubscribeMemo::key(std::to_string(ii) + "@homedomain", "presence")) == LEG_NATIVE)
+    {
+      remembered++;
+    }
+  }
+
+  EXPECT_LE(remembered, 16);
+  EXPECT_GT(remembered, 0);
+}
@@ -0,0 +1,156 @@
+/**
+ * @file tenantaccounting_test.cpp UT for the per-tenant accounting of the
+ * resources used by gemini.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include <vector>
+#include <thread>
+#include "gtest/gtest.h"
+
+#include "tenantaccounting.h"
+
+static const std::string TENANT_A = "sip:mobile-twinned@gemini.example.com;twin-prefix=111";
+static const std::string TENANT_B = "sip:mobile-twinned@gemini.example.com;twin-prefix=222";
+
+// Test that each tenant is interned once, with its own ID.
+TEST(TenantAccountingTest, InternTenants)
+{
+  TenantAccounting accounting;
+
+  int tenant_a = accounting.tenant_id(TENANT_A.data(), TENANT_A.length());
+  int tenant_b = accounting.tenant_id(TENANT_B.data(), TENANT_B.length());
+  EXPECT_NE(TenantAccounting::OTHER_TENANT, tenant_a);
+  EXPECT_NE(TenantAccounting::OTHER_TENANT, tenant_b);
+  EXPECT_NE(tenant_a, tenant_b);
+  EXPECT_EQ(tenant_a, accounting.tenant_id(TENANT_A.data(), TENANT_A.length()));
+  EXPECT_EQ(TenantAccounting::OTHER_TENANT, accounting.tenant_id(NULL));
+}
+
+// Test that tenants beyond the maximum are accounted together.
+TEST(TenantAccountingTest, TooManyTenants)
+{
+  TenantAccounting accounting(2);
+
+  int tenant_a = accounting.tenant_id(TENANT_A.data(), TENANT_A.length());
+  EXPECT_NE(TenantAccounting::OTHER_TENANT, tenant_a);
+  EXPECT_EQ(TenantAccounting::OTHER_TENANT,
+            accounting.tenant_id(TENANT_B.data(), TENANT_B.length()));
+  EXPECT_EQ(tenant_a, accounting.tenant_id(TENANT_A.data(), TENANT_A.length()));
+}
+
+// Test that counts from several threads are summed.
+TEST(TenantAccountingTest, CountsFromThreads)
+{
+  TenantAccounting accounting;
+  int tenant_a = accounting.tenant_id(TENANT_A.data(), TENANT_A.length());
+
+  std::vector<std::thread> threads;
+  for (int ii = 0; ii < 4; ++ii)
+  {
+    threads.push_back(std::thread([&]()
+    {
+      for (int jj = 0; jj < 1000; ++jj)
+      {
+        accounting.add(tenant_a, TenantAccounting::FORKS, 2);
+      }
+    }));
+  }
+
+  for (size_t ii = 0; ii < threads.size(); ++ii)
+  {
+    threads[ii].join();
+  }
+
+  std::vector<TenantAccounting::Usage> usage;
+  accounting.totals(usage);
+  ASSERT_EQ(2u, usage.size());
+  EXPECT_EQ(TENANT_A, usage[tenant_a].tenant);
+  EXPECT_EQ(8000u, usage[tenant_a].counters[TenantAccounting::FORKS]);
+  EXPECT_EQ(0u, usage[tenant_a].counters[TenantAccounting::INVITES]);
+}
+
+// Test that snapshots hold the usage since the previous snapshot, and only
+// for tenants that have been active.
+TEST(TenantAccountingTest, Snapshots)
+{
+  TenantAccounting accounting;
+  int tenant_a = accounting.tenant_id(TENANT_A.data(), TENANT_A.length());
+  int tenant_b = accounting.tenant_id(TENANT_B.data(), TENANT_B.length());
+
+  accounting.add(tenant_a, TenantAccounting::INVITES, 3);
+  accounting.add(tenant_b, TenantAccounting::SUBSCRIBES, 1);
+  accounting.take_snapshot();
+
+  std::vector<TenantAccounting::Usage> usage;
+  accounting.last_snapshot(usage);
+  ASSERT_EQ(2u, usage.size());
+  EXPECT_EQ(TENANT_A, usage[0].tenant);
+  EXPECT_EQ(3u, usage[0].counters[TenantAccounting::INVITES]);
+  EXPECT_EQ(TENANT_B, usage[1].tenant);
+  EXPECT_EQ(1u, usage[1].counters[TenantAccounting::SUBSCRIBES]);
+
+  accounting.add(tenant_a, TenantAccounting::INVITES, 2);
+  accounting.take_snapshot();
+  accounting.last_snapshot(usage);
+  ASSERT_EQ(1u, usage.size());
+  EXPECT_EQ(TENANT_A, usage[0].tenant);
+  EXPECT_EQ(2u, usage[0].counters[TenantAccounting::INVITES]);
+}
+
+// Test that a thread alternating between accountings keeps using the same
+// counters in each.
+TEST(TenantAccountingTest, ThreadAlternatesAccountings)
+{
+  TenantAccounting accounting_a;
+  TenantAccounting accounting_b;
+
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    accounting_a.add(TenantAccounting::OTHER_TENANT, TenantAccounting::FORKS, 1);
+    accounting_b.add(TenantAccounting::OTHER_TENANT, TenantAccounting::FORKS, 1);
+  }
+
+  EXPECT_EQ(1, accounting_a.num_threads());
+  EXPECT_EQ(1, accounting_b.num_threads());
+
+  std::vector<TenantAccounting::Usage> usage;
+  accounting_b.totals(usage);
+  ASSERT_EQ(1u, usage.size());
+  EXPECT_EQ(10u, usage[0].counters[TenantAccounting::FORKS]);
+}
+
+/// Listener that keeps the snapshots it's given.
+class TestSnapshotListener : public TenantAccounting::SnapshotListener
+{
+public:
+  void snapshot_taken(const std::vector<TenantAccounting::Usage>& usage)
+  {
+    snapshots.push_back(usage);
+  }
+
+  std::vector<std::vector<TenantAccounting::Usage> > snapshots;
+};
+
+// Test that each snapshot is exported to the listener.
+TEST(TenantAccountingTest, SnapshotsExported)
+{
+  TestSnapshotListener listener;
+  TenantAccounting accounting(1024, 10000, &listener);
+  int tenant_a = accounting.tenant_id(TENANT_A.data(), TENANT_A.length());
+
+  accounting.add(tenant_a, TenantAccounting::INVITES, 3);
+  accounting.take_snapshot();
+
+  ASSERT_EQ(1u, listener.snapshots.size());
+  ASSERT_EQ(1u, listener.snapshots[0].size());
+  EXPECT_EQ(TENANT_A, listener.snapshots[0][0].tenant);
+  EXPECT_EQ(3u, listener.snapshots[0][0].counters[TenantAccounting::INVITES]);
+}
@@ -0,0 +1,161 @@
+/**
+ * @file twinstatecache_test.cpp UT for the cache of native twin reachability
+ * which is part of gemini.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include <atomic>
+#include "gtest/gtest.h"
+
+#include "localstore.h"
+#include "twinstatecache.h"
+
+/// The time the caches under test see. Their background threads read it too.
+static std::atomic<uint64_t> g_now_ms(1000000);
+
+static uint64_t fake_clock()
+{
+  return g_now_ms;
+}
+
+/// Fixture for TwinStateCacheTest.
+///
+/// The LocalStore stands in for the memcached cluster shared between Gemini
+/// nodes. This tree has no fake memcached server, but the LocalStore honours
+/// the same CAS semantics through the Store interface that the
+/// MemcachedStore does, and can be made to report contention.
+class TwinStateCacheTest : public ::testing::Test
+{
+public:
+  TwinStateCacheTest()
+  {
+    _store = new LocalStore();
+  }
+
+  ~TwinStateCacheTest()
+  {
+    delete _store; _store = NULL;
+  }
+
+  /// Returns what the store holds for a user, or "" if it holds nothing.
+  std::string stored_state(const std::string& user)
+  {
+    std::string data;
+    uint64_t cas;
+    return (_store->get_data("gemini_twin_state", user, data, cas, 0) == Store::OK) ?
+           data : "";
+  }
+
+  LocalStore* _store;
+};
+
+// Test that a state set locally is returned immediately and written to the
+// store in the background.
+TEST_F(TwinStateCacheTest, SetState)
+{
+  TwinStateCache cache(_store);
+  cache.set_native_state("6505551234@homedomain", TwinStateCache::UNREACHABLE);
+  EXPECT_EQ(TwinStateCache::UNREACHABLE,
+            cache.get_native_state("6505551234@homedomain"));
+
+  cache.flush();
+  EXPECT_EQ("2", stored_state("6505551234@homedomain"));
+}
+
+// Test that a lookup of an unknown subscriber doesn't block, and that the
+// state is learnt from the store in the background.
+TEST_F(TwinStateCacheTest, LearnStateFromStore)
+{
+  _store->set_data("gemini_twin_state", "6505551234@homedomain", "2", 0, 300, 0);
+
+  TwinStateCache cache(_store);
+  EXPECT_EQ(TwinStateCache::UNKNOWN,
+            cache.get_native_state("6505551234@homedomain"));
+
+  cache.flush();
+  EXPECT_EQ(TwinStateCache::UNREACHABLE,
+            cache.get_native_state("6505551234@homedomain"));
+}
+
+// Test that what one node learns is shared with another.
+TEST_F(TwinStateCacheTest, StateSharedBetweenNodes)
+{
+  TwinStateCache cache1(_store, 300, 30, 20, 1000, 100000, 10, fake_clock);
+  TwinStateCache cache2(_store, 300, 30, 20, 1000, 100000, 10, fake_clock);
+
+  cache1.set_native_state("6505551234@homedomain", TwinStateCache::UNREACHABLE);
+  cache1.flush();
+  EXPECT_EQ(TwinStateCache::UNKNOWN,
+            cache2.get_native_state("6505551234@homedomain"));
+  cache2.flush();
+  EXPECT_EQ(TwinStateCache::UNREACHABLE,
+            cache2.get_native_state("6505551234@homedomain"));
+
+  // The native twin becomes reachable again. The other node learns this
+  // once its near-cache entry expires.
+  cache1.set_native_state("6505551234@homedomain", TwinStateCache::REACHABLE);
+  cache1.flush();
+  g_now_ms += 30000;
+  cache2.get_native_state("6505551234@homedomain");
+  cache2.flush();
+  EXPECT_EQ(TwinStateCache::REACHABLE,
+            cache2.get_native_state("6505551234@homedomain"));
+}
+
+// Test that a native twin known to be unreachable is probed by one call in
+// each probe interval, and that it recovers once a probe finds it reachable.
+TEST_F(TwinStateCacheTest, UnreachableTwinProbed)
+{
+  TwinStateCache cache(_store, 300, 30, 20, 1000, 100000, 10, fake_clock);
+  cache.set_native_state("6505551234@homedomain", TwinStateCache::UNREACHABLE);
+  EXPECT_EQ(TwinStateCache::UNREACHABLE,
+            cache.get_native_state("6505551234@homedomain"));
+
+  // Once the probe interval has passed, one call gets to probe the twin.
+  g_now_ms += 10000;
+  EXPECT_EQ(TwinStateCache::UNKNOWN,
+            cache.get_native_state("6505551234@homedomain"));
+  EXPECT_EQ(TwinStateCache::UNREACHABLE,
+            cache.get_native_state("6505551234@homedomain"));
+  EXPECT_EQ(1u, cache.probes());
+
+  // The probe finds the twin reachable again, which is shared through the
+  // store (even though the store's entry hadn't expired).
+  cache.set_native_state("6505551234@homedomain", TwinStateCache::REACHABLE);
+  EXPECT_EQ(TwinStateCache::REACHABLE,
+            cache.get_native_state("6505551234@homedomain"));
+  cache.flush();
+  EXPECT_EQ("1", stored_state("6505551234@homedomain"));
+}
+
+// Test that a write that contends with another node's is retried.
+TEST_F(TwinStateCacheTest, StoreContention)
+{
+  _store->set_data("gemini_twin_state", "6505551234@homedomain", "1", 0, 300, 0);
+
+  TwinStateCache cache(_store);
+  _store->force_contention();
+  cache.set_native_state("6505551234@homedomain", TwinStateCache::UNREACHABLE);
+  cache.flush();
+  EXPECT_EQ("2", stored_state("6505551234@homedomain"));
+}
+
+// Test that lookups are dropped rather than queued without limit.
+TEST_F(TwinStateCacheTest, QueueFull)
+{
+  TwinStateCache cache(_store, 300, 30, 20, 1);
+
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    cache.get_native_state("user" + std::to_string(ii) + "@homedomain");
+  }
+
+  EXPECT_GT(cache.dropped_ops(), 0u);
+}